@@ -0,0 +1,94 @@
+#ifndef arena_h
+#define arena_h
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//
+// ASTArena - a bump allocator for AST data that lives as long as its owner,
+// such as the characters of interned names. objects are never destroyed one
+// by one, the slabs are released together when the arena goes away, so
+// everything allocated here must be trivially destructible
+//
+class ASTArena {
+    static constexpr size_t InitialSlabSize = 512;
+    static constexpr size_t MaxSlabSize = 1 << 20;
+
+    std::vector<void*> Slabs;
+    char *CurPtr = nullptr;
+    char *End = nullptr;
+    size_t BytesAllocated = 0;
+    size_t BytesUsed = 0;
+
+    void newSlab(size_t MinSize) {
+        size_t Size = Slabs.empty() ? InitialSlabSize
+                                    : std::min(BytesAllocated, MaxSlabSize);
+        if (Size < MinSize)
+            Size = MinSize;
+
+        void *Slab = malloc(Size);
+        if (!Slab)
+            throw std::bad_alloc();
+        Slabs.push_back(Slab);
+        BytesAllocated += Size;
+        CurPtr = static_cast<char*>(Slab);
+        End = CurPtr + Size;
+    }
+
+    static uintptr_t alignAddr(char *P, size_t Align) {
+        return (reinterpret_cast<uintptr_t>(P) + Align - 1) & ~(Align - 1);
+    }
+
+public:
+    ASTArena() = default;
+    ASTArena(ASTArena const&) = delete;
+    ASTArena &operator=(ASTArena const&) = delete;
+
+    ~ASTArena() {
+        for (void *Slab : Slabs)
+            free(Slab);
+    }
+
+    void *allocate(size_t Size, size_t Align) {
+        uintptr_t P = alignAddr(CurPtr, Align);
+        if (!CurPtr or P + Size > reinterpret_cast<uintptr_t>(End)) {
+            newSlab(Size + Align);
+            P = alignAddr(CurPtr, Align);
+        }
+        CurPtr = reinterpret_cast<char*>(P + Size);
+        BytesUsed += Size;
+        return reinterpret_cast<void*>(P);
+    }
+
+    // make - constructs a T in the arena
+    template <typename T, typename... ArgTs>
+    T *make(ArgTs&&... Args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+    }
+
+    // copyString - copies Str into the arena, e.g. to keep an identifier
+    // alive after the source buffer moves on
+    std::string_view copyString(std::string_view Str) {
+        if (Str.empty())
+            return Str;
+        char *P = static_cast<char*>(allocate(Str.size(), 1));
+        memcpy(P, Str.data(), Str.size());
+        return std::string_view(P, Str.size());
+    }
+
+    size_t getBytesAllocated() const { return BytesAllocated; }
+    size_t getBytesUsed() const { return BytesUsed; }
+};
+
+#endif // arena_h
@@ -1,150 +1,518 @@
 #ifndef ast_h
 #define ast_h
 
-#include "llvm/IR/Value.h"
-#include "llvm/IR/Function.h"
-
-#include <string>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
 #include <vector>
 
-class ExprAST {
+#include "builtins.h"
+#include "interner.h"
+
+// the IR a function is emitted as, codegen.h. the ast itself needs nothing
+// of LLVM, neither does the vm (vm.h)
+namespace llvm {
+class Function;
+}
+
+//
+// the expressions of a function are stored flat in an ExprPool: one array of
+// fixed size nodes, one of number literals, one of extra operands for the
+// nodes with more than two children and one of node types. children are
+// 32-bit ids into the pool and names are interned SymbolIds, so a pool is
+// four arrays of plain data.
+// nodes are appended as they are parsed, a child always has a smaller id than
+// its parent, so a forward walk over the pool visits children first
+//
+
+// ExprId - handle of an expression in its ExprPool. a null ExprId, like the
+// null pointer it stands in for, means no expression (e.g. a for loop with no
+// step, or a parse error)
+class ExprId {
+    uint32_t Index = ~0u;
+
 public:
-    virtual ~ExprAST() {}
-    virtual llvm::Value *codegen() = 0;
+    ExprId() = default;
+    ExprId(std::nullptr_t) {}
+    explicit ExprId(uint32_t Index) : Index(Index) {}
+
+    explicit operator bool() const { return Index != ~0u; }
+    uint32_t getIndex() const { return Index; }
+
+    bool operator==(ExprId RHS) const { return Index == RHS.Index; }
+    bool operator!=(ExprId RHS) const { return Index != RHS.Index; }
 };
 
-// expression class for numeric literals like 1.0
-class NumberExprAST : public ExprAST {
-    double Val;
+// ValueType - the type of a value. every expression has one, as does every
+// variable and every argument and result of a function. arrays are only
+// ever arguments. Unknown is only found where a type was left to
+// inference, e.g. on an unannotated var
+enum class ValueType : uint8_t {
+    Double,      // double
+    Int,         // i64
+    Bool,        // i1
+    DoubleArray, // double*
+    IntArray,    // i64*
+    Vec2,        // <2 x double>
+    Vec4,        // <4 x double>
+    Vec8,        // <8 x double>
+    Unknown,
+};
 
-public:
-    NumberExprAST(double Val) : Val(Val) {}
-    virtual llvm::Value *codegen();
+inline bool isArrayType(ValueType T) {
+    return T == ValueType::DoubleArray or T == ValueType::IntArray;
+}
+
+inline bool isVectorType(ValueType T) {
+    return T == ValueType::Vec2 or T == ValueType::Vec4 or
+           T == ValueType::Vec8;
+}
+
+// getVectorWidth - the number of lanes of a vector type
+inline unsigned getVectorWidth(ValueType T) {
+    assert(isVectorType(T));
+    return T == ValueType::Vec2 ? 2 : T == ValueType::Vec4 ? 4 : 8;
+}
+
+// getElementType - the type of the elements of an array type
+inline ValueType getElementType(ValueType T) {
+    assert(isArrayType(T));
+    return T == ValueType::DoubleArray ? ValueType::Double : ValueType::Int;
+}
+
+enum class ExprKind : uint8_t {
+    Number,    // A: index into the number literals
+    Variable,  // A: name
+    Unary,     // Op, A: operand
+    Binary,    // Op, A: lhs, B: rhs
+    Call,      // Op: builtin, A: callee, B: extra -> [NumArgs, Args...]
+    If,        // A: cond, B: extra -> [Then, Else]
+    For,       // A: loop variable, B: extra -> [Start, End, Step, Body, Type]
+    Var,       // A: body, B: extra -> [NumVars, (Name, Init, Type)...]
+    Subscript, // A: array or vector name, B: index
 };
 
-class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
+struct ExprNode {
+    ExprKind Kind;
+    char Op;
+    uint32_t A, B;
+};
 
-public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else)
-        : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else))
-    {}
+//
+// typed views of the nodes, handed out by value by ExprPool
+//
 
-    virtual llvm::Value *codegen() override;
+// expression class for numeric literals like 1.0
+struct NumberExprAST {
+    double Val;
+    ValueType Type;
 };
 
-class VarExprAST : public ExprAST {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
+struct VariableExprAST {
+    SymbolId Name;
+};
 
-public:
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-               std::unique_ptr<ExprAST> Body) 
-        : VarNames(std::move(VarNames)), Body(std::move(Body))
-    {}
+struct UnaryExprAST {
+    char Opcode;
+    ExprId Operand;
+};
 
-    virtual llvm::Value *codegen() override;
+struct BinaryExprAST {
+    char Op;
+    ExprId LHS, RHS;
 };
 
-class ForExprAST : public ExprAST {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+struct CallExprAST {
+    SymbolId Callee;
+    uint32_t const* ArgIds;
+    unsigned NumArgs;
 
-public:
-    ForExprAST(std::string const& VarName, std::unique_ptr<ExprAST> Start,
-               std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-          Step(std::move(Step)), Body(std::move(Body))
-    {}
+    // what type inference resolved the call to, None for a function
+    Builtin BuiltinFn;
 
-    llvm::Value *codegen() override;
+    ExprId getArg(unsigned I) const {
+        assert(I < NumArgs);
+        return ExprId(ArgIds[I]);
+    }
 };
 
-class UnaryExprAST : public ExprAST {
-    char Opcode;
-    std::unique_ptr<ExprAST> Operand;
+// an element of an array argument or a lane of a vector, a[i]
+struct SubscriptExprAST {
+    SymbolId Array;
+    ExprId Index;
+};
 
-public:
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-        : Opcode(Opcode), Operand(std::move(Operand)) 
-    {}
+struct IfExprAST {
+    ExprId Cond, Then, Else;
+};
 
-    virtual llvm::Value *codegen() override;
+struct ForExprAST {
+    SymbolId VarName;
+    ExprId Start, End, Step, Body;
+    ValueType VarType;
 };
 
-class VariableExprAST : public ExprAST {
-    std::string Name;
+// a var binding is a name, an optional initializer and the variable's type
+struct VarBinding {
+    SymbolId Name;
+    ExprId Init;
+    ValueType Type;
+};
 
-public:
-    VariableExprAST(std::string const& Name) : Name(Name) {}
-    virtual llvm::Value *codegen();
-    const std::string &getName() const { return Name; }
+struct VarExprAST {
+    uint32_t const* Bindings;
+    unsigned NumVars;
+    ExprId Body;
+
+    VarBinding getVar(unsigned I) const {
+        assert(I < NumVars);
+        return VarBinding{Bindings[3 * I], ExprId(Bindings[3 * I + 1]),
+                          ValueType(Bindings[3 * I + 2])};
+    }
 };
 
-class BinaryExprAST : public ExprAST {
-    char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+class ExprPool {
+    std::vector<ExprNode> Nodes;
+    std::vector<double> Numbers;
+    std::vector<uint32_t> Extra;
+
+    // Types[i] - the type of node i, filled in by type inference (types.h).
+    // a literal is a double until inference says otherwise
+    std::vector<ValueType> Types;
+
+    ExprId addNode(ExprKind Kind, char Op, uint32_t A, uint32_t B) {
+        Nodes.push_back(ExprNode{Kind, Op, A, B});
+        Types.push_back(Kind == ExprKind::Number ? ValueType::Double
+                                                 : ValueType::Unknown);
+        return ExprId(Nodes.size() - 1);
+    }
+
+    // visitChildSlots - calls Visit on the slot of every child E has, for
+    // both the const and the mutable walks
+    template <typename PoolT, typename FnT>
+    static void visitChildSlots(PoolT &Pool, ExprId E, FnT Visit) {
+        auto Slot = [&](auto &S) {
+            if (S != ~0u)
+                Visit(S);
+        };
+
+        auto &N = Pool.Nodes[E.getIndex()];
+        auto &Extra = Pool.Extra;
+        switch (N.Kind) {
+        case ExprKind::Number:
+        case ExprKind::Variable:
+            break;
+        case ExprKind::Unary:
+            Slot(N.A);
+            break;
+        case ExprKind::Binary:
+            Slot(N.A);
+            Slot(N.B);
+            break;
+        case ExprKind::Call:
+            for (uint32_t i = 0, e = Extra[N.B]; i != e; ++i)
+                Slot(Extra[N.B + 1 + i]);
+            break;
+        case ExprKind::If:
+            Slot(N.A);
+            Slot(Extra[N.B]);
+            Slot(Extra[N.B + 1]);
+            break;
+        case ExprKind::For:
+            for (uint32_t i = 0; i != 4; ++i)
+                Slot(Extra[N.B + i]);
+            break;
+        case ExprKind::Var:
+            Slot(N.A);
+            for (uint32_t i = 0, e = Extra[N.B]; i != e; ++i)
+                Slot(Extra[N.B + 2 + 3 * i]);
+            break;
+        case ExprKind::Subscript:
+            Slot(N.B);
+            break;
+        }
+    }
+
+    ExprNode const& getNode(ExprId E, ExprKind Kind) const {
+        assert(E and E.getIndex() < Nodes.size() and
+               Nodes[E.getIndex()].Kind == Kind and "bad expression id");
+        (void)Kind;
+        return Nodes[E.getIndex()];
+    }
 
 public:
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
-                  std::unique_ptr<ExprAST> RHS)
-        : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    ExprId addNumber(double Val) {
+        Numbers.push_back(Val);
+        return addNode(ExprKind::Number, 0, Numbers.size() - 1, 0);
+    }
+
+    ExprId addVariable(SymbolId Name) {
+        return addNode(ExprKind::Variable, 0, Name, 0);
+    }
+
+    ExprId addUnary(char Opcode, ExprId Operand) {
+        return addNode(ExprKind::Unary, Opcode, Operand.getIndex(), 0);
+    }
+
+    ExprId addBinary(char Op, ExprId LHS, ExprId RHS) {
+        return addNode(ExprKind::Binary, Op, LHS.getIndex(), RHS.getIndex());
+    }
+
+    ExprId addCall(SymbolId Callee, ExprId const* Args, unsigned NumArgs) {
+        uint32_t Ex = Extra.size();
+        Extra.push_back(NumArgs);
+        for (unsigned i = 0; i != NumArgs; ++i)
+            Extra.push_back(Args[i].getIndex());
+        return addNode(ExprKind::Call, 0, Callee, Ex);
+    }
+
+    ExprId addIf(ExprId Cond, ExprId Then, ExprId Else) {
+        uint32_t Ex = Extra.size();
+        Extra.push_back(Then.getIndex());
+        Extra.push_back(Else.getIndex());
+        return addNode(ExprKind::If, 0, Cond.getIndex(), Ex);
+    }
+
+    ExprId addFor(SymbolId VarName, ExprId Start, ExprId End, ExprId Step,
+                  ExprId Body, ValueType VarType = ValueType::Unknown) {
+        uint32_t Ex = Extra.size();
+        Extra.push_back(Start.getIndex());
+        Extra.push_back(End.getIndex());
+        Extra.push_back(Step.getIndex());
+        Extra.push_back(Body.getIndex());
+        Extra.push_back(uint32_t(VarType));
+        return addNode(ExprKind::For, 0, VarName, Ex);
+    }
 
-    virtual llvm::Value *codegen();
+    ExprId addVar(VarBinding const* Vars, unsigned NumVars, ExprId Body) {
+        uint32_t Ex = Extra.size();
+        Extra.push_back(NumVars);
+        for (unsigned i = 0; i != NumVars; ++i) {
+            Extra.push_back(Vars[i].Name);
+            Extra.push_back(Vars[i].Init.getIndex());
+            Extra.push_back(uint32_t(Vars[i].Type));
+        }
+        return addNode(ExprKind::Var, 0, Body.getIndex(), Ex);
+    }
+
+    ExprId addSubscript(SymbolId Array, ExprId Index) {
+        return addNode(ExprKind::Subscript, 0, Array, Index.getIndex());
+    }
+
+    // setNumber - turns E into the literal Val in place, for passes that
+    // fold an expression into a constant. E keeps its type
+    void setNumber(ExprId E, double Val) {
+        assert(E and E.getIndex() < Nodes.size() and "bad expression id");
+        Numbers.push_back(Val);
+        Nodes[E.getIndex()] = ExprNode{ExprKind::Number, 0,
+                                       uint32_t(Numbers.size() - 1), 0};
+    }
+
+    // mapChildren - replaces every child C of E with Fn(C). missing children
+    // (a for without a step, a var without an initializer) are left alone
+    template <typename FnT>
+    void mapChildren(ExprId E, FnT Fn) {
+        visitChildSlots(*this, E, [&](uint32_t &Slot) {
+            Slot = Fn(ExprId(Slot)).getIndex();
+        });
+    }
+
+    // forEachChild - calls Fn on every child of E
+    template <typename FnT>
+    void forEachChild(ExprId E, FnT Fn) const {
+        visitChildSlots(*this, E, [&](uint32_t const& Slot) {
+            Fn(ExprId(Slot));
+        });
+    }
+
+    // walk - calls Fn on E and on everything below it, parents first
+    template <typename FnT>
+    void walk(ExprId E, FnT &&Fn) const {
+        Fn(E);
+        forEachChild(E, [&](ExprId C) { walk(C, Fn); });
+    }
+
+    size_t size() const { return Nodes.size(); }
+
+    ValueType getType(ExprId E) const {
+        assert(E and E.getIndex() < Nodes.size() and "bad expression id");
+        return Types[E.getIndex()];
+    }
+
+    void setType(ExprId E, ValueType Type) {
+        assert(E and E.getIndex() < Nodes.size() and "bad expression id");
+        Types[E.getIndex()] = Type;
+    }
+
+    // setForVarType, setVarType - record the inferred type of a for loop's
+    // variable, or of the I'th variable of a var
+    void setForVarType(ExprId E, ValueType Type) {
+        Extra[getNode(E, ExprKind::For).B + 4] = uint32_t(Type);
+    }
+
+    void setVarType(ExprId E, unsigned I, ValueType Type) {
+        Extra[getNode(E, ExprKind::Var).B + 3 + 3 * I] = uint32_t(Type);
+    }
+
+    // setBuiltin - record that a call is one of a builtin
+    void setBuiltin(ExprId E, Builtin B) {
+        assert(getKind(E) == ExprKind::Call);
+        Nodes[E.getIndex()].Op = char(B);
+    }
+
+    ExprKind getKind(ExprId E) const {
+        assert(E and E.getIndex() < Nodes.size() and "bad expression id");
+        return Nodes[E.getIndex()].Kind;
+    }
+
+    NumberExprAST getNumber(ExprId E) const {
+        return NumberExprAST{Numbers[getNode(E, ExprKind::Number).A],
+                             getType(E)};
+    }
+
+    VariableExprAST getVariable(ExprId E) const {
+        return VariableExprAST{getNode(E, ExprKind::Variable).A};
+    }
+
+    UnaryExprAST getUnary(ExprId E) const {
+        auto &N = getNode(E, ExprKind::Unary);
+        return UnaryExprAST{N.Op, ExprId(N.A)};
+    }
+
+    BinaryExprAST getBinary(ExprId E) const {
+        auto &N = getNode(E, ExprKind::Binary);
+        return BinaryExprAST{N.Op, ExprId(N.A), ExprId(N.B)};
+    }
+
+    CallExprAST getCall(ExprId E) const {
+        auto &N = getNode(E, ExprKind::Call);
+        return CallExprAST{N.A, &Extra[N.B + 1], Extra[N.B], Builtin(N.Op)};
+    }
+
+    IfExprAST getIf(ExprId E) const {
+        auto &N = getNode(E, ExprKind::If);
+        return IfExprAST{ExprId(N.A), ExprId(Extra[N.B]),
+                         ExprId(Extra[N.B + 1])};
+    }
+
+    ForExprAST getFor(ExprId E) const {
+        auto &N = getNode(E, ExprKind::For);
+        return ForExprAST{N.A, ExprId(Extra[N.B]), ExprId(Extra[N.B + 1]),
+                          ExprId(Extra[N.B + 2]), ExprId(Extra[N.B + 3]),
+                          ValueType(Extra[N.B + 4])};
+    }
+
+    VarExprAST getVar(ExprId E) const {
+        auto &N = getNode(E, ExprKind::Var);
+        return VarExprAST{&Extra[N.B + 1], Extra[N.B], ExprId(N.A)};
+    }
+
+    SubscriptExprAST getSubscript(ExprId E) const {
+        auto &N = getNode(E, ExprKind::Subscript);
+        return SubscriptExprAST{N.A, ExprId(N.B)};
+    }
 };
 
-class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
-public:
-    CallExprAST(std::string const& Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args) 
-        : Callee(Callee), Args(std::move(Args)) 
-    {}
+class ConstEvaluator;
 
-    virtual llvm::Value *codegen();
+// isTrue - how a condition reads a double, like the 'fcmp one 0.0' emitted
+// for it: zero and NaN are false
+inline bool isTrue(double V) { return V < 0 or V > 0; }
+
+// attributes written before the name in a prototype, `def @fastmath f(x)`
+enum PrototypeFlags : unsigned {
+    PF_FastMath = 1 << 0, // fast-math flags on all floating point ops
+    PF_Extern = 1 << 1,   // declared by extern, not an attribute
+    PF_Pure = 1 << 2,     // pure, calls of it are memoized
 };
 
 // this class represents the prototype for a function
-// which captures its name, and its argument anmes (thus implicitly tne number of 
+// which captures its name, and its argument anmes (thus implicitly tne number of
 // arguments the function takes)
+//
+// names are interned, an operator also keeps its character (0 for a plain
+// function)
+//
+// arguments and the result are doubles unless annotated, `def f(n:int):bool`.
+// an array argument names the argument holding its length, `a:double[n]`
 class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
-    bool IsOperator;
+    SymbolId Name;
+    std::vector<SymbolId> Args;
+    char OperatorName;
     unsigned Precedence;
+    unsigned Flags;
+    std::vector<ValueType> ArgTypes;
+    ValueType ReturnType;
+
+    // ArrayLengths[i] - the index of the length of array argument i
+    std::vector<unsigned> ArrayLengths;
 
 public:
-    PrototypeAST(std::string const& name, std::vector<std::string> Args,
-                 bool IsOperator=false, unsigned Prec = 0)
-        : Name(name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec) {}
+    PrototypeAST(SymbolId Name, std::vector<SymbolId> Args,
+                 char OperatorName = 0, unsigned Prec = 0, unsigned Flags = 0,
+                 std::vector<ValueType> ArgTypes = {},
+                 ValueType ReturnType = ValueType::Double,
+                 std::vector<unsigned> ArrayLengths = {})
+        : Name(Name), Args(std::move(Args)), OperatorName(OperatorName),
+          Precedence(Prec), Flags(Flags), ArgTypes(std::move(ArgTypes)),
+          ReturnType(ReturnType), ArrayLengths(std::move(ArrayLengths)) {
+        this->ArgTypes.resize(this->Args.size(), ValueType::Double);
+        this->ArrayLengths.resize(this->Args.size(), ~0u);
+    }
 
-    std::string const& getName() const { return Name;}
+    SymbolId getName() const { return Name;}
+    std::vector<SymbolId> const& getArgs() const { return Args; }
+    ValueType getArgType(unsigned I) const { return ArgTypes[I]; }
+    ValueType getReturnType() const { return ReturnType; }
+
+    unsigned getArrayLength(unsigned I) const {
+        assert(isArrayType(ArgTypes[I]));
+        return ArrayLengths[I];
+    }
     llvm::Function *codegen();
 
-    bool isUnaryOp() const { return IsOperator and Args.size() == 1; }
-    bool isBinaryOp() const { return IsOperator and Args.size() == 2; }
+    bool isUnaryOp() const { return OperatorName and Args.size() == 1; }
+    bool isBinaryOp() const { return OperatorName and Args.size() == 2; }
 
     char getOperatorName() const {
         assert(isUnaryOp() or isBinaryOp());
-        return Name[Name.size() - 1];
+        return OperatorName;
     }
 
     unsigned getBinaryPrecedence() const { return Precedence; }
+    bool hasFlag(PrototypeFlags F) const { return Flags & F; }
+    void setFlag(PrototypeFlags F) { Flags |= F; }
+    void clearFlag(PrototypeFlags F) { Flags &= ~F; }
 };
 
-// this class represents a function definition itself
+// this class represents a function definition itself, the prototype plus the
+// pool holding the expressions of its body
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    ExprPool Pool;
+    ExprId Body;
+    bool Memoize = false;
 
 public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::unique_ptr<ExprAST> Body) 
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
-
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprPool Pool,
+                ExprId Body)
+        : Proto(std::move(Proto)), Pool(std::move(Pool)), Body(Body) {}
+
+    PrototypeAST const& getProto() const { return *Proto; }
+    ExprPool const& getPool() const { return Pool; }
+    ExprId getBody() const { return Body; }
+    bool isMemoized() const { return Memoize; }
+
+    // foldConstants - folds the constant parts of the body, see fold.h
+    void foldConstants(ConstEvaluator *Eval = nullptr);
+
+    // check - registers the prototype, then type checks and folds the
+    // body. emit - the IR of a checked function, into the current module.
+    // checking has to follow the order of the source, emitting does not
+    bool check();
+    llvm::Function *emit();
     llvm::Function *codegen();
 };
 
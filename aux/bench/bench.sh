@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# the vm against the jit. every program runs with kint -O0, kint -O2 and
+# kvm, the best wall time of a few runs is printed, and the peak resident
+# memory if GNU time is installed. repl.ks, many small definitions each
+# followed by an expression calling it, is generated. it is read from a
+# file like the others, not typed at a terminal. the programs pass their
+# arguments and sizes through a var, a call on literals would be evaluated
+# at compile time
+#
+#   make jit && make vm binary=kvm && aux/bench/bench.sh
+#
+# both targets build the drivers with -O2, so the front ends compare alike
+#
+# the binaries default to ./kint and ./kvm, RUNS to 5
+#
+KINT=${KINT:-./kint}
+KVM=${KVM:-./kvm}
+RUNS=${RUNS:-5}
+DIR=$(cd "$(dirname "$0")" && pwd)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+for i in $(seq 1 500); do
+    echo "def f$i(x) if x < $i then x * $i + 1 else f$i(x - $i);"
+    echo "var x = $((i * 3)) in f$i(x);"
+done > "$TMP/repl.ks"
+
+# best - the best wall time in seconds of RUNS runs of a command
+best() {
+    local Best= T
+    for _ in $(seq 1 "$RUNS"); do
+        T=$( { TIMEFORMAT=%R; time "$@" >/dev/null 2>&1; } 2>&1 )
+        if [ -z "$Best" ] || awk "BEGIN { exit !($T < $Best) }"; then
+            Best=$T
+        fi
+    done
+    echo "$Best"
+}
+
+# rss - the peak resident memory of a run in MB
+rss() {
+    if /usr/bin/time -f %M true 2>/dev/null; then
+        /usr/bin/time -f %M "$@" 2>&1 >/dev/null | tail -1 |
+            awk '{ printf "%.1f", $1 / 1024 }'
+    else
+        echo -
+    fi
+}
+
+printf "%-12s %10s %10s %10s %8s %8s %8s\n" program "kint -O0" "kint -O2" kvm \
+    "MB -O0" "MB -O2" "MB vm"
+for F in "$DIR"/startup.ks "$TMP"/repl.ks "$DIR"/fib.ks "$DIR"/mandel.ks \
+         "$DIR"/loop.ks "$DIR"/tail.ks "$DIR"/vec.ks; do
+    printf "%-12s %10s %10s %10s %8s %8s %8s\n" "$(basename "$F")" \
+        "$(best "$KINT" -O0 "$F")" "$(best "$KINT" -O2 "$F")" \
+        "$(best "$KVM" "$F")" "$(rss "$KINT" -O0 "$F")" \
+        "$(rss "$KINT" -O2 "$F")" "$(rss "$KVM" "$F")"
+done
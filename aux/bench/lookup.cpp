@@ -0,0 +1,200 @@
+//
+// the keyword and operator lookups of the front end, before and after the
+// perfect hash and the flat precedence table. the lexer used to run every
+// identifier through a chain of ten std::string compares, now it hashes it
+// with getKeywordToken. the parser used to look every token up in a
+// std::map<char, int>, now it indexes a flat table
+//
+// both lookups run on the same two token streams, an identifier heavy one
+// (short names, keywords and names like dxf or ihen that only differ from
+// a keyword in their middle) and an operator heavy one (long chains of
+// standard and user defined binary operators). the best of a few runs is
+// printed, per identifier or per token
+//
+//   g++ --std=c++17 -O2 -I. -o lookup aux/bench/lookup.cpp
+//   ./lookup [lines] [runs]
+//
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+
+// getKeywordTokenChain - the keyword lookup getKeywordToken replaced
+static int getKeywordTokenChain(std::string const& IdentifierStr) {
+    if (IdentifierStr == "def")
+        return tok_def;
+    if (IdentifierStr == "extern")
+        return tok_extern;
+    if (IdentifierStr == "if")
+        return tok_if;
+    if (IdentifierStr == "then")
+        return tok_then;
+    if (IdentifierStr == "else")
+        return tok_else;
+    if (IdentifierStr == "for")
+        return tok_for;
+    if (IdentifierStr == "in")
+        return tok_in;
+    if (IdentifierStr == "binary")
+        return tok_binary;
+    if (IdentifierStr == "unary")
+        return tok_unary;
+    if (IdentifierStr == "var")
+        return tok_var;
+    return tok_identifier;
+}
+
+// the precedences of a parser that read the two user operators of the
+// operator heavy stream, as a map and as the parser's flat table
+static std::map<char, int> makePrecedenceMap() {
+    std::map<char, int> Map;
+    Map['='] = 2;
+    Map['<'] = 10;
+    Map['+'] = 20;
+    Map['-'] = 30;
+    Map['*'] = 40;
+    Map['|'] = 5;
+    Map['&'] = 6;
+    return Map;
+}
+
+static std::array<int, 128> makePrecedenceTable() {
+    std::array<int, 128> Table;
+    Table.fill(-1);
+    for (auto &P : makePrecedenceMap())
+        Table[(unsigned char)P.first] = P.second;
+    return Table;
+}
+
+// getTokPrecedenceMap, getTokPrecedenceTable - Parser::GetTokPrecedence
+// before and after
+static int getTokPrecedenceMap(std::map<char, int> &Map, int Tok) {
+    if (!isascii(Tok))
+        return -1;
+    auto It = Map.find(Tok);
+    if (It == Map.end() or It->second <= 0)
+        return -1;
+    return It->second;
+}
+
+static int getTokPrecedenceTable(std::array<int, 128> const& Table, int Tok) {
+    if ((unsigned)Tok >= Table.size())
+        return -1;
+    return Table[Tok];
+}
+
+// TokenStream - the tokens of a source text, with the text of each
+// identifier and keyword
+struct TokenStream {
+    std::vector<int> Tokens;
+    std::vector<std::string> Identifiers;
+};
+
+// scan - splits Text into tokens the way the lexer does, identifiers and
+// keywords are tok_identifier here
+static TokenStream scan(std::string const& Text) {
+    TokenStream S;
+    for (size_t i = 0, e = Text.size(); i != e;) {
+        unsigned char C = Text[i];
+        if (isspace(C)) {
+            ++i;
+        } else if (isalpha(C)) {
+            size_t Start = i;
+            while (i != e and isalnum((unsigned char)Text[i]))
+                ++i;
+            S.Identifiers.push_back(Text.substr(Start, i - Start));
+            S.Tokens.push_back(tok_identifier);
+        } else if (isdigit(C) or C == '.') {
+            while (i != e and (isdigit((unsigned char)Text[i]) or Text[i] == '.'))
+                ++i;
+            S.Tokens.push_back(tok_number);
+        } else {
+            S.Tokens.push_back(C);
+            ++i;
+        }
+    }
+    return S;
+}
+
+// best - the best time of Runs runs of F over a stream of N items, in ns
+// per item. what F returns goes into Sink, so it is not optimized away
+template <typename Fn>
+static double best(int Runs, size_t N, Fn F) {
+    static volatile long Sink;
+    double Best = 0;
+    for (int i = 0; i < Runs; ++i) {
+        auto Start = std::chrono::steady_clock::now();
+        Sink = Sink + F();
+        std::chrono::duration<double, std::nano> T =
+            std::chrono::steady_clock::now() - Start;
+        if (i == 0 or T.count() < Best)
+            Best = T.count();
+    }
+    return Best / N;
+}
+
+static void run(char const* Name, std::string const& Text, int Runs) {
+    TokenStream S = scan(Text);
+
+    double Chain = best(Runs, S.Identifiers.size(), [&] {
+        long Sum = 0;
+        for (auto &Ident : S.Identifiers)
+            Sum += getKeywordTokenChain(Ident);
+        return Sum;
+    });
+    double Hash = best(Runs, S.Identifiers.size(), [&] {
+        long Sum = 0;
+        for (auto &Ident : S.Identifiers)
+            Sum += getKeywordToken(Ident);
+        return Sum;
+    });
+
+    auto Map = makePrecedenceMap();
+    auto Table = makePrecedenceTable();
+    double MapNs = best(Runs, S.Tokens.size(), [&] {
+        long Sum = 0;
+        for (int Tok : S.Tokens)
+            Sum += getTokPrecedenceMap(Map, Tok);
+        return Sum;
+    });
+    double TableNs = best(Runs, S.Tokens.size(), [&] {
+        long Sum = 0;
+        for (int Tok : S.Tokens)
+            Sum += getTokPrecedenceTable(Table, Tok);
+        return Sum;
+    });
+
+    printf("%s: %zu identifiers, %zu tokens\n", Name, S.Identifiers.size(),
+           S.Tokens.size());
+    printf("  keywords    string chain %6.2f ns  perfect hash %6.2f ns  %.1fx\n",
+           Chain, Hash, Chain / Hash);
+    printf("  precedence  std::map     %6.2f ns  flat table   %6.2f ns  %.1fx\n",
+           MapNs, TableNs, MapNs / TableNs);
+}
+
+int main(int argc, char **argv) {
+    int Lines = argc > 1 ? atoi(argv[1]) : 100000;
+    int Runs = argc > 2 ? atoi(argv[2]) : 5;
+
+    std::string Idents, Ops;
+    char Buf[256];
+    for (int i = 0; i < Lines; ++i) {
+        snprintf(Buf, sizeof(Buf),
+                 "def f%d(a b c dxf ihen) var x = a in for i = b, i < c in "
+                 "if x then dxf else ihen + f%d(a, b, c, x, i);\n", i, i);
+        Idents += Buf;
+        snprintf(Buf, sizeof(Buf),
+                 "def g%d(a b) a + 1 * b - 2 < a * b | 3 & a - b * 4 + "
+                 "(a - 5) * b | 6 + a < 7 & b;\n", i);
+        Ops += Buf;
+    }
+
+    run("identifier heavy", Idents, Runs);
+    run("operator heavy", Ops, Runs);
+    return 0;
+}
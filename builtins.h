@@ -0,0 +1,137 @@
+#ifndef builtins_h
+#define builtins_h
+
+#include <cmath>
+#include <cstdint>
+#include <string_view>
+
+//
+// builtins - functions the compiler knows, called like any other function.
+// a name is only a builtin as long as no function of that name has been
+// declared, so programs that define their own keep working. the math
+// builtins also stand in for the libm function an `extern sin(x)` declares
+//
+//   vec2(x) vec4(x) vec8(x)      x in every lane
+//   vec4(x0 x1 x2 x3) ...        one value per lane
+//   hsum(v) hmin(v) hmax(v)      sum, minimum, maximum of the lanes of v
+//
+//   sqrt fabs sin cos exp log floor (x)
+//   pow min max (x y)
+//   fma (x y z)                  math on doubles, lanewise on vectors
+//
+// the reductions combine the two halves of the vector lanewise until one
+// lane is left, so hsum adds pairwise, not left to right. the math
+// builtins are llvm intrinsics, which the optimizer folds and vectorizes,
+// min and max are C's fmin and fmax
+//
+enum class Builtin : uint8_t {
+    None,
+    Vec2,
+    Vec4,
+    Vec8,
+    HSum,
+    HMin,
+    HMax,
+
+    // math, see getMathArity
+    Sqrt,
+    Fabs,
+    Sin,
+    Cos,
+    Exp,
+    Log,
+    Floor,
+    Pow,
+    Min,
+    Max,
+    Fma,
+};
+
+// getBuiltin - the builtin called Name, None if there is none
+inline Builtin getBuiltin(std::string_view Name) {
+    static constexpr struct {
+        char const* Name;
+        Builtin B;
+    } Builtins[] = {
+        {"vec2", Builtin::Vec2},   {"vec4", Builtin::Vec4},
+        {"vec8", Builtin::Vec8},   {"hsum", Builtin::HSum},
+        {"hmin", Builtin::HMin},   {"hmax", Builtin::HMax},
+        {"sqrt", Builtin::Sqrt},   {"fabs", Builtin::Fabs},
+        {"sin", Builtin::Sin},     {"cos", Builtin::Cos},
+        {"exp", Builtin::Exp},     {"log", Builtin::Log},
+        {"floor", Builtin::Floor}, {"pow", Builtin::Pow},
+        {"min", Builtin::Min},     {"max", Builtin::Max},
+        {"fma", Builtin::Fma},
+    };
+    for (auto &Entry : Builtins)
+        if (Name == Entry.Name)
+            return Entry.B;
+    return Builtin::None;
+}
+
+// getMathArity - the number of arguments of a math builtin, 0 if B is not
+// one
+inline unsigned getMathArity(Builtin B) {
+    switch (B) {
+    case Builtin::Sqrt:
+    case Builtin::Fabs:
+    case Builtin::Sin:
+    case Builtin::Cos:
+    case Builtin::Exp:
+    case Builtin::Log:
+    case Builtin::Floor:
+        return 1;
+    case Builtin::Pow:
+    case Builtin::Min:
+    case Builtin::Max:
+        return 2;
+    case Builtin::Fma:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+// evaluateBuiltin - runs a math builtin on doubles at compile time, false
+// if B is not one
+inline bool evaluateBuiltin(Builtin B, double const* Args, double &Result) {
+    switch (B) {
+    case Builtin::Sqrt:
+        Result = std::sqrt(Args[0]);
+        return true;
+    case Builtin::Fabs:
+        Result = std::fabs(Args[0]);
+        return true;
+    case Builtin::Sin:
+        Result = std::sin(Args[0]);
+        return true;
+    case Builtin::Cos:
+        Result = std::cos(Args[0]);
+        return true;
+    case Builtin::Exp:
+        Result = std::exp(Args[0]);
+        return true;
+    case Builtin::Log:
+        Result = std::log(Args[0]);
+        return true;
+    case Builtin::Floor:
+        Result = std::floor(Args[0]);
+        return true;
+    case Builtin::Pow:
+        Result = std::pow(Args[0], Args[1]);
+        return true;
+    case Builtin::Min:
+        Result = std::fmin(Args[0], Args[1]);
+        return true;
+    case Builtin::Max:
+        Result = std::fmax(Args[0], Args[1]);
+        return true;
+    case Builtin::Fma:
+        Result = std::fma(Args[0], Args[1], Args[2]);
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif // builtins_h
@@ -0,0 +1,1053 @@
+#ifndef bytecode_h
+#define bytecode_h
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "builtins.h"
+#include "interner.h"
+#include "symtab.h"
+#include "types.h"
+
+//
+// the bytecode of the vm (vm.h). a function runs in a frame of registers,
+// 64 bits each, that holds a double, an i64, a bool as the int 0 or 1, or
+// the pointer an array argument is. a vector takes one register per lane.
+// the frame starts with the arguments, then come the constants of the
+// function, copied in on every call, then its variables and temporaries.
+// an instruction names registers by their index in the frame, so every
+// operand is a register and there is no stack of values to keep
+//
+// the code is a vector of 32-bit words, an opcode followed by its operands.
+// a jump target is the index of the instruction in the code. the types are
+// resolved when the function is compiled, there is an instruction for each
+// type an operation works on, and lanewise operations on vectors are one
+// instruction per lane
+//
+// a call passes its arguments in registers at the top of the caller's
+// frame, they are the start of the callee's frame
+//
+
+// the opcodes and the number of operands of each. A is the register written,
+// B and C the ones read, unless noted
+#define KS_OPCODES(X)                                                         \
+    X(Move, 2)           /* A = B */                                          \
+    X(Zero, 1)           /* A = 0, 0.0 or false */                            \
+    X(IntToDouble, 2)    /* A = double(B) */                                  \
+    X(AddD, 3)                                                                \
+    X(SubD, 3)                                                                \
+    X(MulD, 3)                                                                \
+    X(LessD, 3)          /* A = B < C or unordered, like fcmp ult */          \
+    X(AddI, 3)                                                                \
+    X(SubI, 3)                                                                \
+    X(MulI, 3)                                                                \
+    X(LessI, 3)                                                               \
+    X(LessLane, 3)       /* LessD giving 1.0 or 0.0, for a vector lane */     \
+    X(IncD, 1)           /* A = A + 1.0 */                                    \
+    X(IncI, 1)                                                                \
+    X(Sqrt, 2)                                                                \
+    X(Fabs, 2)                                                                \
+    X(Sin, 2)                                                                 \
+    X(Cos, 2)                                                                 \
+    X(Exp, 2)                                                                 \
+    X(Log, 2)                                                                 \
+    X(Floor, 2)                                                               \
+    X(Pow, 3)                                                                 \
+    X(Min, 3)            /* fmin, like llvm.minnum */                         \
+    X(Max, 3)                                                                 \
+    X(Fma, 4)                                                                 \
+    X(SelectLess, 3)     /* A = B < C ? B : C, for hmin */                    \
+    X(SelectGreater, 3)  /* A = B > C ? B : C, for hmax */                    \
+    X(Jump, 1)           /* to A */                                           \
+    X(JumpIfFalseD, 2)   /* to B unless A is true */                          \
+    X(JumpIfFalseI, 2)                                                        \
+    X(JumpIfTrueD, 2)    /* to B if A is true */                              \
+    X(JumpIfTrueI, 2)                                                         \
+    X(JumpIfNotLessD, 3) /* to C unless A < B */                              \
+    X(JumpIfNotLessI, 3)                                                      \
+    X(Load, 3)           /* A = B[C], B an array */                           \
+    X(Store, 3)          /* B[C] = A */                                       \
+    X(LoadLane, 4)       /* A = lane C of the vector B of D lanes */          \
+    X(StoreLane, 4)      /* lane C of the vector B of D lanes = A */          \
+    X(Check, 2)          /* fails unless 0 <= A < B */                        \
+    X(CheckLane, 2)      /* fails unless 0 <= A < the constant B */           \
+    X(Call, 3)           /* A = callee B on the arguments from C on */        \
+    X(TailCall, 3)       /* Call, reusing the frame if it can */              \
+    X(Return, 1)         /* returns A */
+
+enum class Opcode : uint32_t {
+#define KS_OPCODE_ENUM(Name, NumOperands) Name,
+    KS_OPCODES(KS_OPCODE_ENUM)
+#undef KS_OPCODE_ENUM
+};
+
+// getNumOperands - the number of words following opcode Op
+constexpr unsigned getNumOperands(Opcode Op) {
+    constexpr uint8_t NumOperands[] = {
+#define KS_OPCODE_OPERANDS(Name, NumOperands) NumOperands,
+        KS_OPCODES(KS_OPCODE_OPERANDS)
+#undef KS_OPCODE_OPERANDS
+    };
+    return NumOperands[uint32_t(Op)];
+}
+
+inline char const* getOpcodeName(Opcode Op) {
+    static char const* const Names[] = {
+#define KS_OPCODE_NAME(Name, NumOperands) #Name,
+        KS_OPCODES(KS_OPCODE_NAME)
+#undef KS_OPCODE_NAME
+    };
+    return Names[uint32_t(Op)];
+}
+
+// Register - a value in a frame
+union Register {
+    double D;
+    int64_t I;
+    void *P;
+};
+
+// BytecodeFunction - the code of a function and what its frame needs
+struct BytecodeFunction {
+    std::vector<uint32_t> Code;
+
+    // the constants, the registers from NumArgRegisters on
+    std::vector<Register> Constants;
+
+    // the functions the code calls, a Call names one by its index here
+    std::vector<SymbolId> Callees;
+
+    uint32_t NumArgRegisters = 0;
+    uint32_t NumRegisters = 0;
+    uint32_t ReturnWidth = 1;
+
+    // getSize - the bytes of code and constants
+    size_t getSize() const {
+        return Code.size() * sizeof(uint32_t) +
+               Constants.size() * sizeof(Register);
+    }
+};
+
+// getNumRegisters - the registers a value of type T takes
+inline uint32_t getNumRegisters(ValueType T) {
+    return isVectorType(T) ? getVectorWidth(T) : 1;
+}
+
+//
+// BytecodeCompiler - compiles a checked function, the types of its
+// expressions inferred and its constants folded, to bytecode. it walks the
+// ExprPool like ExprCodegen does and evaluates in the same order, so the
+// code computes what the IR would, bit for bit, calls of the math builtins
+// aside
+//
+// registers are handed out like a stack: an expression gets the register
+// its value goes to and takes the ones above Top for its temporaries and
+// variables, they are free again once it is compiled
+//
+class BytecodeCompiler {
+    static constexpr uint32_t NoRegister = ~0u;
+
+    ExprPool const& Pool;
+    PrototypeMap const& Protos;
+    StringInterner &Symbols;
+    bool BoundsCheck;
+
+    PrototypeAST const* Proto = nullptr;
+    bool Memoized = false;
+    std::unique_ptr<BytecodeFunction> F;
+
+    // a variable in scope, the length argument of an array in Length
+    struct Variable {
+        SymbolId Name;
+        uint32_t Reg;
+        ValueType Type;
+        uint32_t Length;
+    };
+    std::vector<Variable> Scope;
+    uint32_t Top = 0;
+
+    // ConstantRegs[E] - the register of literal E. Assigns[E] - whether E
+    // assigns a variable, or something below it does
+    std::vector<uint32_t> ConstantRegs;
+    std::vector<bool> Assigns;
+
+    // the index of a callee in F->Callees, plus one
+    SymbolIdMap<uint32_t> CalleeIndex;
+
+    uint32_t allocate(uint32_t NumRegs) {
+        uint32_t Reg = Top;
+        Top += NumRegs;
+        if (Top > F->NumRegisters)
+            F->NumRegisters = Top;
+        return Reg;
+    }
+
+    template <typename... Ts>
+    size_t emit(Opcode Op, Ts... Operands) {
+        static_assert(sizeof...(Ts) <= 4, "too many operands");
+        assert(sizeof...(Ts) == getNumOperands(Op) and "wrong operand count");
+        size_t At = F->Code.size();
+        F->Code.push_back(uint32_t(Op));
+        (F->Code.push_back(uint32_t(Operands)), ...);
+        return At;
+    }
+
+    // emitJump - a jump with the target to patch as its last operand,
+    // returns the index of that operand
+    template <typename... Ts>
+    size_t emitJump(Opcode Op, Ts... Operands) {
+        emit(Op, Operands..., 0u);
+        return F->Code.size() - 1;
+    }
+
+    // patch - makes the jump at Operand go to the code emitted next
+    void patch(size_t Operand) { F->Code[Operand] = F->Code.size(); }
+
+    Variable const* lookup(SymbolId Name) const {
+        for (size_t i = Scope.size(); i != 0; --i)
+            if (Scope[i - 1].Name == Name)
+                return &Scope[i - 1];
+        LogError("unknown variable name");
+        return nullptr;
+    }
+
+    uint32_t getCallee(SymbolId Name) {
+        uint32_t &Index = CalleeIndex[Name];
+        if (!Index) {
+            F->Callees.push_back(Name);
+            Index = F->Callees.size();
+        }
+        return Index - 1;
+    }
+
+    void emitMoves(uint32_t Dest, uint32_t Src, uint32_t NumRegs) {
+        if (Dest != Src)
+            for (uint32_t i = 0; i != NumRegs; ++i)
+                emit(Opcode::Move, Dest + i, Src + i);
+    }
+
+    void addConstants(ExprId Body);
+    void emitConversion(uint32_t Src, ValueType From, uint32_t Dest,
+                        ValueType To);
+
+    bool compile(ExprId E, uint32_t Dest);
+    bool compileAs(ExprId E, uint32_t Dest, ValueType T);
+    bool compileOperand(ExprId E, uint32_t &Reg, bool Copy = false);
+    bool compileOperandAs(ExprId E, ValueType T, uint32_t &Reg,
+                          bool Copy = false);
+    bool compileJumpIfFalse(ExprId Cond, size_t &Target);
+    bool compileReturn(ExprId E);
+
+    bool compileAssign(BinaryExprAST const& E, ValueType T, uint32_t Dest);
+    bool compileBinary(BinaryExprAST const& E, ValueType T, uint32_t Dest);
+    bool compileCall(SymbolId Name, uint32_t const* Args, unsigned NumArgs,
+                     uint32_t Dest, bool IsTailCall = false);
+    bool compileBuiltin(CallExprAST const& E, ValueType T, uint32_t Dest);
+    bool compileSubscript(SubscriptExprAST const& E, uint32_t Dest);
+    bool compileIf(IfExprAST const& E, ValueType T, uint32_t Dest);
+    bool compileFor(ForExprAST const& E, uint32_t Dest);
+    bool bindVars(VarExprAST const& E);
+
+public:
+    BytecodeCompiler(ExprPool const& Pool, PrototypeMap const& Protos,
+                     StringInterner &Symbols, bool BoundsCheck)
+        : Pool(Pool), Protos(Protos), Symbols(Symbols),
+          BoundsCheck(BoundsCheck) {}
+
+    // compile - the bytecode of the function P with body Body, null with
+    // an error message if it can not be compiled. the code of a memoized
+    // function makes no tail calls, the vm keeps its memo table
+    std::unique_ptr<BytecodeFunction> compile(PrototypeAST const& P,
+                                              ExprId Body, bool Memoize);
+};
+
+inline std::unique_ptr<BytecodeFunction>
+BytecodeCompiler::compile(PrototypeAST const& P, ExprId Body, bool Memoize) {
+    Proto = &P;
+    Memoized = Memoize;
+    F = std::make_unique<BytecodeFunction>();
+    F->ReturnWidth = getNumRegisters(P.getReturnType());
+
+    // the arguments, then the constants
+    std::vector<uint32_t> ArgRegs;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i)
+        ArgRegs.push_back(allocate(getNumRegisters(P.getArgType(i))));
+    F->NumArgRegisters = Top;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i) {
+        ValueType T = P.getArgType(i);
+        uint32_t Length = isArrayType(T) ? ArgRegs[P.getArrayLength(i)]
+                                         : NoRegister;
+        Scope.push_back({P.getArgs()[i], ArgRegs[i], T, Length});
+    }
+    addConstants(Body);
+
+    if (!compileReturn(Body))
+        return nullptr;
+    return std::move(F);
+}
+
+// addConstants - gives every literal in Body a register, equal ones share
+// it, and finds the expressions that assign variables
+inline void BytecodeCompiler::addConstants(ExprId Body) {
+    ConstantRegs.assign(Pool.size(), NoRegister);
+    std::unordered_map<uint64_t, uint32_t> Regs;
+    Pool.walk(Body, [&](ExprId E) {
+        if (Pool.getKind(E) != ExprKind::Number)
+            return;
+        NumberExprAST N = Pool.getNumber(E);
+        ValueType T = Pool.getType(E);
+        Register V;
+        if (T == ValueType::Int)
+            V.I = int64_t(N.Val);
+        else if (T == ValueType::Bool)
+            V.I = isTrue(N.Val);
+        else
+            V.D = N.Val;
+
+        auto It = Regs.emplace(uint64_t(V.I), F->NumArgRegisters + Regs.size());
+        if (It.second)
+            F->Constants.push_back(V);
+        ConstantRegs[E.getIndex()] = It.first->second;
+    });
+    allocate(F->Constants.size());
+
+    // children come before their parents in the pool
+    Assigns.assign(Pool.size(), false);
+    for (uint32_t i = 0, e = Pool.size(); i != e; ++i) {
+        ExprId E(i);
+        bool A = Pool.getKind(E) == ExprKind::Binary and
+                 Pool.getBinary(E).Op == '=';
+        Pool.forEachChild(E, [&](ExprId C) { A = A or Assigns[C.getIndex()]; });
+        Assigns[i] = A;
+    }
+}
+
+// emitConversion - the value in Src of type From as a To in Dest, widening
+// like convertValue in codegen: a bool is already the int 0 or 1, an int
+// converts to the nearest double, a scalar goes into every lane
+inline void BytecodeCompiler::emitConversion(uint32_t Src, ValueType From,
+                                             uint32_t Dest, ValueType To) {
+    if (isVectorType(To)) {
+        if (isVectorType(From)) {
+            emitMoves(Dest, Src, getVectorWidth(To));
+            return;
+        }
+        emitConversion(Src, From, Dest, ValueType::Double);
+        for (uint32_t i = 1, e = getVectorWidth(To); i != e; ++i)
+            emit(Opcode::Move, Dest + i, Dest);
+        return;
+    }
+    if (To == ValueType::Double and From != ValueType::Double)
+        emit(Opcode::IntToDouble, Dest, Src);
+    else if (Dest != Src)
+        emit(Opcode::Move, Dest, Src);
+}
+
+// compileAs - E converted to T into Dest
+inline bool BytecodeCompiler::compileAs(ExprId E, uint32_t Dest,
+                                        ValueType T) {
+    ValueType From = Pool.getType(E);
+    if (From == T or Dest == NoRegister)
+        return compile(E, Dest);
+
+    uint32_t Mark = Top;
+    uint32_t Reg;
+    if (!compileOperand(E, Reg))
+        return false;
+    emitConversion(Reg, From, Dest, T);
+    Top = Mark;
+    return true;
+}
+
+// compileOperand - E into a register of its own, or the register a literal
+// or a variable already is in. Copy says code that may assign the variable
+// runs before the value is used, it is copied then
+inline bool BytecodeCompiler::compileOperand(ExprId E, uint32_t &Reg,
+                                             bool Copy) {
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number:
+        Reg = ConstantRegs[E.getIndex()];
+        if (!isVectorType(Pool.getType(E)))
+            return true;
+        break;
+
+    case ExprKind::Variable:
+        if (Copy)
+            break;
+        if (auto *V = lookup(Pool.getVariable(E).Name)) {
+            Reg = V->Reg;
+            return true;
+        }
+        return false;
+
+    case ExprKind::Binary: {
+        // the value of x = v is x, unless it changes before it is used
+        BinaryExprAST B = Pool.getBinary(E);
+        if (Copy or B.Op != '=' or
+            Pool.getKind(B.LHS) != ExprKind::Variable)
+            break;
+        auto *V = lookup(Pool.getVariable(B.LHS).Name);
+        if (!V)
+            return false;
+        if (V->Type != Pool.getType(E))
+            break;
+        Reg = V->Reg;
+        return compileAssign(B, V->Type, NoRegister);
+    }
+
+    default:
+        break;
+    }
+
+    Reg = allocate(getNumRegisters(Pool.getType(E)));
+    return compile(E, Reg);
+}
+
+// compileOperandAs - compileOperand, converted to the scalar type T
+inline bool BytecodeCompiler::compileOperandAs(ExprId E, ValueType T,
+                                               uint32_t &Reg, bool Copy) {
+    ValueType From = Pool.getType(E);
+    if (From == T or (T == ValueType::Int and From == ValueType::Bool))
+        return compileOperand(E, Reg, Copy);
+
+    uint32_t Src;
+    if (!compileOperand(E, Src))
+        return false;
+    Reg = allocate(1);
+    emitConversion(Src, From, Reg, T);
+    return true;
+}
+
+inline bool BytecodeCompiler::compile(ExprId E, uint32_t Dest) {
+    ValueType T = Pool.getType(E);
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number:
+        if (Dest != NoRegister)
+            emitConversion(ConstantRegs[E.getIndex()],
+                           isVectorType(T) ? ValueType::Double : T, Dest, T);
+        return true;
+
+    case ExprKind::Variable: {
+        auto *V = lookup(Pool.getVariable(E).Name);
+        if (!V)
+            return false;
+        if (Dest != NoRegister)
+            emitMoves(Dest, V->Reg, getNumRegisters(T));
+        return true;
+    }
+
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (B.Op == '=')
+            return compileAssign(B, T, Dest);
+
+        // the builtin operators have no effect, an unused result of one
+        // needs no code but that of its operands
+        if (Dest == NoRegister and
+            (B.Op == '+' or B.Op == '-' or B.Op == '*' or B.Op == '<'))
+            return compile(B.LHS, NoRegister) and compile(B.RHS, NoRegister);
+        break;
+    }
+
+    case ExprKind::If:
+        return compileIf(Pool.getIf(E), T, Dest);
+
+    case ExprKind::For:
+        return compileFor(Pool.getFor(E), Dest);
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        uint32_t Mark = Top;
+        size_t Outer = Scope.size();
+        bool Ok = bindVars(V) and compile(V.Body, Dest);
+        Scope.resize(Outer);
+        Top = Mark;
+        return Ok;
+    }
+
+    default:
+        break;
+    }
+
+    // the rest has a value to put somewhere
+    uint32_t Mark = Top;
+    if (Dest == NoRegister)
+        Dest = allocate(getNumRegisters(T));
+
+    bool Ok;
+    switch (Pool.getKind(E)) {
+    case ExprKind::Unary: {
+        // the operand comes first, its errors are reported first
+        UnaryExprAST U = Pool.getUnary(E);
+        SymbolId Op = Symbols.internOperator(false, U.Opcode);
+        uint32_t Operand = U.Operand.getIndex();
+        if (!Protos.lookup(Op)) {
+            Ok = compile(U.Operand, NoRegister) and
+                 (LogError("unknown unary operator"), false);
+            break;
+        }
+        Ok = compileCall(Op, &Operand, 1, Dest);
+        break;
+    }
+
+    case ExprKind::Binary:
+        Ok = compileBinary(Pool.getBinary(E), T, Dest);
+        break;
+
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        Ok = C.BuiltinFn == Builtin::None
+                 ? compileCall(C.Callee, C.ArgIds, C.NumArgs, Dest)
+                 : compileBuiltin(C, T, Dest);
+        break;
+    }
+
+    case ExprKind::Subscript:
+        Ok = compileSubscript(Pool.getSubscript(E), Dest);
+        break;
+
+    default:
+        Ok = false;
+        break;
+    }
+    Top = Mark;
+    return Ok;
+}
+
+// compileAssign - x = v and a[i] = v, the value of either is v as stored
+inline bool BytecodeCompiler::compileAssign(BinaryExprAST const& E,
+                                            ValueType T, uint32_t Dest) {
+    if (Pool.getKind(E.LHS) == ExprKind::Variable) {
+        auto *V = lookup(Pool.getVariable(E.LHS).Name);
+        if (!V)
+            return false;
+
+        // the lanes of a vector are written one by one, the value may
+        // still read the ones it replaces
+        uint32_t Mark = Top;
+        ExprKind RHSKind = Pool.getKind(E.RHS);
+        if (isVectorType(V->Type) and RHSKind != ExprKind::Variable and
+            RHSKind != ExprKind::Number) {
+            uint32_t Reg = allocate(getNumRegisters(V->Type));
+            if (!compileAs(E.RHS, Reg, V->Type))
+                return false;
+            emitMoves(V->Reg, Reg, getNumRegisters(V->Type));
+        } else if (!compileAs(E.RHS, V->Reg, V->Type)) {
+            return false;
+        }
+        Top = Mark;
+        if (Dest != NoRegister)
+            emitConversion(V->Reg, V->Type, Dest, T);
+        return true;
+    }
+
+    if (Pool.getKind(E.LHS) != ExprKind::Subscript)
+        return LogError("destination of '=' must be a variable"), false;
+
+    // the value first, then the index, like in codegen
+    SubscriptExprAST S = Pool.getSubscript(E.LHS);
+    auto *V = lookup(S.Array);
+    if (!V)
+        return false;
+    bool IsVector = isVectorType(V->Type);
+    ValueType ElementType =
+        IsVector ? ValueType::Double : getElementType(V->Type);
+
+    uint32_t Mark = Top;
+    uint32_t Value, Index;
+    if (!compileOperandAs(E.RHS, ElementType, Value,
+                          Assigns[S.Index.getIndex()]) or
+        !compileOperand(S.Index, Index))
+        return false;
+
+    if (IsVector) {
+        uint32_t Lanes = getVectorWidth(V->Type);
+        if (BoundsCheck)
+            emit(Opcode::CheckLane, Index, Lanes);
+        emit(Opcode::StoreLane, Value, V->Reg, Index, Lanes);
+    } else {
+        if (BoundsCheck)
+            emit(Opcode::Check, Index, V->Length);
+        emit(Opcode::Store, Value, V->Reg, Index);
+    }
+    if (Dest != NoRegister)
+        emitConversion(Value, ElementType, Dest, T);
+    Top = Mark;
+    return true;
+}
+
+// compileBinary - the builtin operators work on ints when both sides are
+// ints or bools, lanewise when one side is a vector, and on doubles
+// otherwise. any other operator is a call of its function
+inline bool BytecodeCompiler::compileBinary(BinaryExprAST const& E,
+                                            ValueType T, uint32_t Dest) {
+    if (E.Op != '+' and E.Op != '-' and E.Op != '*' and E.Op != '<') {
+        uint32_t Ops[2] = {E.LHS.getIndex(), E.RHS.getIndex()};
+        return compileCall(Symbols.internOperator(true, E.Op), Ops, 2, Dest);
+    }
+
+    ValueType TL = Pool.getType(E.LHS), TR = Pool.getType(E.RHS);
+    bool Copy = Assigns[E.RHS.getIndex()];
+    uint32_t L, R;
+
+    if (isVectorType(TL) or isVectorType(TR)) {
+        if (!compileOperandAs(E.LHS, isVectorType(TL) ? TL : ValueType::Double,
+                              L, Copy) or
+            !compileOperandAs(E.RHS, isVectorType(TR) ? TR : ValueType::Double,
+                              R))
+            return false;
+        Opcode Op = E.Op == '+'   ? Opcode::AddD
+                    : E.Op == '-' ? Opcode::SubD
+                    : E.Op == '*' ? Opcode::MulD
+                                  : Opcode::LessLane;
+        for (uint32_t i = 0, e = getVectorWidth(T); i != e; ++i)
+            emit(Op, Dest + i, L + (isVectorType(TL) ? i : 0),
+                 R + (isVectorType(TR) ? i : 0));
+        return true;
+    }
+
+    bool IsInt = TL != ValueType::Double and TR != ValueType::Double;
+    ValueType OpType = IsInt ? ValueType::Int : ValueType::Double;
+    if (!compileOperandAs(E.LHS, OpType, L, Copy) or
+        !compileOperandAs(E.RHS, OpType, R))
+        return false;
+
+    Opcode Op;
+    switch (E.Op) {
+    case '+':
+        Op = IsInt ? Opcode::AddI : Opcode::AddD;
+        break;
+    case '-':
+        Op = IsInt ? Opcode::SubI : Opcode::SubD;
+        break;
+    case '*':
+        Op = IsInt ? Opcode::MulI : Opcode::MulD;
+        break;
+    default:
+        Op = IsInt ? Opcode::LessI : Opcode::LessD;
+        break;
+    }
+    emit(Op, Dest, L, R);
+    return true;
+}
+
+// compileCall - a call of the function Name, the user function of an
+// operator included. the arguments are converted to the types it takes in
+// the registers from Top on, where its frame will start
+inline bool BytecodeCompiler::compileCall(SymbolId Name, uint32_t const* Args,
+                                          unsigned NumArgs, uint32_t Dest,
+                                          bool IsTailCall) {
+    auto &Callee = Protos.lookup(Name);
+    if (!Callee)
+        return LogError("unknown function referenced"), false;
+    if (Callee->getArgs().size() != NumArgs)
+        return LogError("incorrect # arguments passed"), false;
+
+    uint32_t Mark = Top;
+    uint32_t Base = Top;
+    for (unsigned i = 0; i != NumArgs; ++i) {
+        ValueType T = Callee->getArgType(i);
+        if (!compileAs(ExprId(Args[i]), allocate(getNumRegisters(T)), T))
+            return false;
+    }
+
+    // an unused result may go where the arguments were
+    if (Dest == NoRegister) {
+        Dest = Base;
+        Top = Base;
+        allocate(getNumRegisters(Callee->getReturnType()));
+    }
+    emit(IsTailCall ? Opcode::TailCall : Opcode::Call, Dest, getCallee(Name),
+         Base);
+    Top = Mark;
+    return true;
+}
+
+// compileBuiltin - vectors are built and reduced lane by lane, the math
+// builtins work on doubles or lanewise, a scalar argument next to a vector
+// one goes into every lane
+inline bool BytecodeCompiler::compileBuiltin(CallExprAST const& E, ValueType T,
+                                             uint32_t Dest) {
+    switch (E.BuiltinFn) {
+    case Builtin::Vec2:
+    case Builtin::Vec4:
+    case Builtin::Vec8: {
+        uint32_t Lanes = getVectorWidth(T);
+        if (E.NumArgs != 1) {
+            for (uint32_t i = 0; i != Lanes; ++i)
+                if (!compileAs(E.getArg(i), Dest + i, ValueType::Double))
+                    return false;
+            return true;
+        }
+        uint32_t Reg;
+        if (!compileOperandAs(E.getArg(0), ValueType::Double, Reg))
+            return false;
+        for (uint32_t i = 0; i != Lanes; ++i)
+            emit(Opcode::Move, Dest + i, Reg);
+        return true;
+    }
+
+    case Builtin::HSum:
+    case Builtin::HMin:
+    case Builtin::HMax: {
+        // combine the two halves lanewise until one lane is left, like
+        // emitReduction
+        Opcode Op = E.BuiltinFn == Builtin::HSum   ? Opcode::AddD
+                    : E.BuiltinFn == Builtin::HMin ? Opcode::SelectLess
+                                                   : Opcode::SelectGreater;
+        uint32_t Reg;
+        if (!compileOperand(E.getArg(0), Reg))
+            return false;
+        uint32_t N = getVectorWidth(Pool.getType(E.getArg(0)));
+        uint32_t Half = allocate(N / 2);
+        for (; N != 2; N /= 2) {
+            for (uint32_t i = 0; i != N / 2; ++i)
+                emit(Op, Half + i, Reg + i, Reg + N / 2 + i);
+            Reg = Half;
+        }
+        emit(Op, Dest, Reg, Reg + 1);
+        return true;
+    }
+
+    default:
+        break;
+    }
+
+    Opcode Op;
+    switch (E.BuiltinFn) {
+    case Builtin::Sqrt:
+        Op = Opcode::Sqrt;
+        break;
+    case Builtin::Fabs:
+        Op = Opcode::Fabs;
+        break;
+    case Builtin::Sin:
+        Op = Opcode::Sin;
+        break;
+    case Builtin::Cos:
+        Op = Opcode::Cos;
+        break;
+    case Builtin::Exp:
+        Op = Opcode::Exp;
+        break;
+    case Builtin::Log:
+        Op = Opcode::Log;
+        break;
+    case Builtin::Floor:
+        Op = Opcode::Floor;
+        break;
+    case Builtin::Pow:
+        Op = Opcode::Pow;
+        break;
+    case Builtin::Min:
+        Op = Opcode::Min;
+        break;
+    case Builtin::Max:
+        Op = Opcode::Max;
+        break;
+    case Builtin::Fma:
+        Op = Opcode::Fma;
+        break;
+    default:
+        return LogError("unknown builtin"), false;
+    }
+
+    uint32_t Regs[3];
+    bool Lanewise[3];
+    for (unsigned i = 0; i != E.NumArgs; ++i) {
+        bool Copy = false;
+        for (unsigned j = i + 1; j != E.NumArgs; ++j)
+            Copy = Copy or Assigns[E.getArg(j).getIndex()];
+        ValueType AT = Pool.getType(E.getArg(i));
+        Lanewise[i] = isVectorType(AT);
+        if (!compileOperandAs(E.getArg(i), Lanewise[i] ? AT : ValueType::Double,
+                              Regs[i], Copy))
+            return false;
+    }
+
+    for (uint32_t Lane = 0, e = getNumRegisters(T); Lane != e; ++Lane) {
+        auto Arg = [&](unsigned i) { return Regs[i] + (Lanewise[i] ? Lane : 0); };
+        switch (E.NumArgs) {
+        case 1:
+            emit(Op, Dest + Lane, Arg(0));
+            break;
+        case 2:
+            emit(Op, Dest + Lane, Arg(0), Arg(1));
+            break;
+        default:
+            emit(Op, Dest + Lane, Arg(0), Arg(1), Arg(2));
+            break;
+        }
+    }
+    return true;
+}
+
+// compileSubscript - a lane of a vector or an element of an array. a lane
+// index out of range, unless -fbounds-check catches it, reads some lane
+inline bool BytecodeCompiler::compileSubscript(SubscriptExprAST const& E,
+                                               uint32_t Dest) {
+    auto *V = lookup(E.Array);
+    if (!V)
+        return false;
+
+    if (isVectorType(V->Type)) {
+        uint32_t Lanes = getVectorWidth(V->Type);
+        if (Pool.getKind(E.Index) == ExprKind::Number) {
+            double Lane = Pool.getNumber(E.Index).Val;
+            if (Lane >= 0 and Lane < Lanes) {
+                emit(Opcode::Move, Dest, V->Reg + uint32_t(Lane));
+                return true;
+            }
+        }
+        uint32_t Index;
+        if (!compileOperand(E.Index, Index))
+            return false;
+        if (BoundsCheck)
+            emit(Opcode::CheckLane, Index, Lanes);
+        emit(Opcode::LoadLane, Dest, V->Reg, Index, Lanes);
+        return true;
+    }
+
+    uint32_t Index;
+    if (!compileOperand(E.Index, Index))
+        return false;
+    if (BoundsCheck)
+        emit(Opcode::Check, Index, V->Length);
+    emit(Opcode::Load, Dest, V->Reg, Index);
+    return true;
+}
+
+// compileJumpIfFalse - jumps to Target, to be patched, unless Cond is true.
+// a comparison and the jump on it are one instruction
+inline bool BytecodeCompiler::compileJumpIfFalse(ExprId Cond, size_t &Target) {
+    uint32_t Mark = Top;
+    ValueType T = Pool.getType(Cond);
+    if (Pool.getKind(Cond) == ExprKind::Binary and
+        Pool.getBinary(Cond).Op == '<') {
+        BinaryExprAST B = Pool.getBinary(Cond);
+        ValueType TL = Pool.getType(B.LHS), TR = Pool.getType(B.RHS);
+        if (!isVectorType(TL) and !isVectorType(TR)) {
+            bool IsInt = TL != ValueType::Double and TR != ValueType::Double;
+            ValueType OpType = IsInt ? ValueType::Int : ValueType::Double;
+            uint32_t L, R;
+            if (!compileOperandAs(B.LHS, OpType, L, Assigns[B.RHS.getIndex()]) or
+                !compileOperandAs(B.RHS, OpType, R))
+                return false;
+            Target = emitJump(IsInt ? Opcode::JumpIfNotLessI
+                                    : Opcode::JumpIfNotLessD,
+                              L, R);
+            Top = Mark;
+            return true;
+        }
+    }
+
+    uint32_t Reg;
+    if (!compileOperand(Cond, Reg))
+        return false;
+    Target = emitJump(T == ValueType::Double ? Opcode::JumpIfFalseD
+                                             : Opcode::JumpIfFalseI,
+                      Reg);
+    Top = Mark;
+    return true;
+}
+
+inline bool BytecodeCompiler::compileIf(IfExprAST const& E, ValueType T,
+                                        uint32_t Dest) {
+    size_t Else, End;
+    if (!compileJumpIfFalse(E.Cond, Else) or !compileAs(E.Then, Dest, T))
+        return false;
+    End = emitJump(Opcode::Jump);
+    patch(Else);
+    if (!compileAs(E.Else, Dest, T))
+        return false;
+
+    // an else without code needs no jump over it
+    if (F->Code.size() == End + 1) {
+        F->Code.resize(End - 1);
+        patch(Else);
+    } else {
+        patch(End);
+    }
+    return true;
+}
+
+// compileFor - the same order as the emitted loop: body, step, end
+// condition, then the increment of the (possibly reassigned) loop variable.
+// the value of a for is 0
+inline bool BytecodeCompiler::compileFor(ForExprAST const& E, uint32_t Dest) {
+    if (isArrayType(E.VarType) or isVectorType(E.VarType))
+        return LogError("for loop variable must be a scalar"), false;
+    bool IsDouble = E.VarType == ValueType::Double;
+
+    // the start is evaluated without the variable in scope
+    uint32_t Mark = Top;
+    uint32_t Var = allocate(1);
+    if (!compileAs(E.Start, Var, E.VarType))
+        return false;
+    Scope.push_back({E.VarName, Var, E.VarType, NoRegister});
+
+    size_t Loop = F->Code.size();
+    uint32_t Step, End;
+    if (!compile(E.Body, NoRegister) or
+        (E.Step and !compileOperandAs(E.Step, E.VarType, Step,
+                                      Assigns[E.End.getIndex()])) or
+        !compileOperand(E.End, End))
+        return false;
+
+    // the increment must not change the condition
+    if (End == Var) {
+        End = allocate(1);
+        emit(Opcode::Move, End, Var);
+    }
+    if (E.Step)
+        emit(IsDouble ? Opcode::AddD : Opcode::AddI, Var, Var, Step);
+    else
+        emit(IsDouble ? Opcode::IncD : Opcode::IncI, Var);
+    emit(Pool.getType(E.End) == ValueType::Double ? Opcode::JumpIfTrueD
+                                                  : Opcode::JumpIfTrueI,
+         End, uint32_t(Loop));
+
+    Scope.pop_back();
+    Top = Mark;
+    if (Dest != NoRegister)
+        emit(Opcode::Zero, Dest);
+    return true;
+}
+
+// bindVars - the variables of a var, each initialized before the next is
+// bound. one without an initializer is 0
+inline bool BytecodeCompiler::bindVars(VarExprAST const& E) {
+    for (unsigned i = 0; i != E.NumVars; ++i) {
+        VarBinding B = E.getVar(i);
+        uint32_t Reg = allocate(getNumRegisters(B.Type));
+        if (B.Init) {
+            if (!compileAs(B.Init, Reg, B.Type))
+                return false;
+        } else {
+            for (uint32_t j = 0, e = getNumRegisters(B.Type); j != e; ++j)
+                emit(Opcode::Zero, Reg + j);
+        }
+        Scope.push_back({B.Name, Reg, B.Type, NoRegister});
+    }
+    return true;
+}
+
+// compileReturn - E is in tail position, and so are the branches of an if
+// and the body of a var in tail position, like codegenReturn. a call there
+// of a function returning the same type is a tail call, unless this
+// function is memoized, its result has to go into the table
+inline bool BytecodeCompiler::compileReturn(ExprId E) {
+    ValueType ReturnType = Proto->getReturnType();
+    uint32_t Mark = Top;
+
+    switch (Pool.getKind(E)) {
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        size_t Else;
+        if (!compileJumpIfFalse(If.Cond, Else) or !compileReturn(If.Then))
+            return false;
+        patch(Else);
+        return compileReturn(If.Else);
+    }
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        size_t Outer = Scope.size();
+        bool Ok = bindVars(V) and compileReturn(V.Body);
+        Scope.resize(Outer);
+        Top = Mark;
+        return Ok;
+    }
+
+    default:
+        break;
+    }
+
+    // the call, when the callee can not be tail called after all, returns
+    // here and the result is returned the usual way
+    SymbolId Callee = ~0u;
+    uint32_t Args[2];
+    uint32_t const* ArgIds = Args;
+    unsigned NumArgs = 0;
+    switch (Pool.getKind(E)) {
+    case ExprKind::Unary:
+        Callee = Symbols.internOperator(false, Pool.getUnary(E).Opcode);
+        Args[0] = Pool.getUnary(E).Operand.getIndex();
+        NumArgs = 1;
+        break;
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (B.Op == '=' or B.Op == '+' or B.Op == '-' or B.Op == '*' or
+            B.Op == '<')
+            break;
+        Callee = Symbols.internOperator(true, B.Op);
+        Args[0] = B.LHS.getIndex();
+        Args[1] = B.RHS.getIndex();
+        NumArgs = 2;
+        break;
+    }
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        if (C.BuiltinFn != Builtin::None)
+            break;
+        Callee = C.Callee;
+        ArgIds = C.ArgIds;
+        NumArgs = C.NumArgs;
+        break;
+    }
+    default:
+        break;
+    }
+    if (Callee != ~0u and !Memoized) {
+        auto &P = Protos.lookup(Callee);
+        if (P and P->getReturnType() == ReturnType) {
+            uint32_t Reg = allocate(F->ReturnWidth);
+            if (!compileCall(Callee, ArgIds, NumArgs, Reg, true))
+                return false;
+            emit(Opcode::Return, Reg);
+            Top = Mark;
+            return true;
+        }
+    }
+
+    uint32_t Reg;
+    if (Pool.getType(E) == ReturnType) {
+        if (!compileOperand(E, Reg))
+            return false;
+    } else {
+        Reg = allocate(F->ReturnWidth);
+        if (!compileAs(E, Reg, ReturnType))
+            return false;
+    }
+    emit(Opcode::Return, Reg);
+    Top = Mark;
+    return true;
+}
+
+// printBytecode - the code of F, one instruction a line
+inline void printBytecode(BytecodeFunction const& F, StringInterner &Symbols,
+                          FILE *Out) {
+    fprintf(Out, "  %u registers, %u arguments, %zu constants, %zu bytes\n",
+            F.NumRegisters, F.NumArgRegisters, F.Constants.size(),
+            F.getSize());
+    for (size_t PC = 0; PC < F.Code.size();) {
+        Opcode Op = Opcode(F.Code[PC]);
+        fprintf(Out, "  %4zu  %-14s", PC, getOpcodeName(Op));
+        for (unsigned i = 1; i <= getNumOperands(Op); ++i)
+            fprintf(Out, " %u", F.Code[PC + i]);
+        if (Op == Opcode::Call or Op == Opcode::TailCall) {
+            auto Name = Symbols.getName(F.Callees[F.Code[PC + 2]]);
+            fprintf(Out, "  ; %.*s", int(Name.size()), Name.data());
+        }
+        fprintf(Out, "\n");
+        PC += 1 + getNumOperands(Op);
+    }
+}
+
+#endif // bytecode_h
@@ -0,0 +1,105 @@
+#ifndef check_h
+#define check_h
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ast.h"
+#include "consteval.h"
+#include "fold.h"
+#include "interner.h"
+#include "options.h"
+#include "symtab.h"
+#include "types.h"
+
+//
+// what the backends share: the options, the symbols, the prototypes of
+// every function declared so far and the pure functions to evaluate at
+// compile time. check() is how a definition gets there, it needs nothing of
+// LLVM, so a backend without it (vm.h) checks definitions the same way the
+// jit and the object driver do
+//
+static CompilerOptions TheOptions;
+static PrototypeMap FunctionProtos;
+static StringInterner TheSymbols;
+
+// the pure functions defined so far, for evaluating calls at compile time
+static ConstEvaluator TheEvaluator(TheSymbols);
+
+// the memo tables of memoized functions, emitMemoTable in codegen.h and
+// MemoTable in vm.h. a table has MemoSlots slots, a lookup probes up to
+// MemoProbes of them
+static constexpr unsigned MemoBits = 12;
+static constexpr uint64_t MemoSlots = 1 << MemoBits;
+static constexpr uint64_t MemoProbes = 8;
+
+// the memoized functions, for printMemoStats. each is listed once, as its
+// latest definition, the one whose counters count
+static std::vector<SymbolId> MemoFunctions;
+
+// countSelfCalls - how many calls of the function Self a body has
+static unsigned countSelfCalls(ExprPool const& Pool, SymbolId Self) {
+    unsigned N = 0;
+    for (uint32_t i = 0, e = Pool.size(); i != e; ++i)
+        if (Pool.getKind(ExprId(i)) == ExprKind::Call and
+            Pool.getCall(ExprId(i)).Callee == Self)
+            ++N;
+    return N;
+}
+
+// shouldMemoize - whether the function P defines gets a memo table: it is
+// declared @pure, or -fmemoize is on and it calls itself more than once,
+// the recursion that takes exponential time. a function calling itself
+// once gains little, and a tail call would no longer be one. it has to be
+// pure and take and return scalars
+static bool shouldMemoize(PrototypeAST const& P, ExprPool const& Pool) {
+    if (!P.hasFlag(PF_Pure) and
+        !(TheOptions.Memoize and countSelfCalls(Pool, P.getName()) > 1))
+        return false;
+
+    auto IsScalar = [](ValueType T) {
+        return !isArrayType(T) and !isVectorType(T);
+    };
+    if (!IsScalar(P.getReturnType()))
+        return false;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i)
+        if (!IsScalar(P.getArgType(i)))
+            return false;
+    return TheEvaluator.isPure(Pool, P.getName());
+}
+
+bool FunctionAST::check() {
+    // the prototypes are shared, this function keeps its own
+    auto &P = *Proto;
+    FunctionProtos[P.getName()] = std::make_unique<PrototypeAST>(P);
+
+    // calls in the body, of itself among others, must not be evaluated with
+    // the body this definition replaces
+    TheEvaluator.removeFunction(P.getName());
+
+    // infer the types of the body, then fold what can be folded before
+    // emitting anything
+    if (!TypeChecker(Pool, FunctionProtos, TheSymbols).checkFunction(P, Body))
+        return false;
+
+    // only a pure function of scalars can be memoized
+    Memoize = shouldMemoize(P, Pool);
+    if (P.hasFlag(PF_Pure) and !Memoize) {
+        LogError("@pure function must only call pure functions and take "
+                 "and return scalars");
+        return false;
+    }
+    // a redefinition replaces the table and counters of the function, or
+    // drops them
+    MemoFunctions.erase(std::remove(MemoFunctions.begin(), MemoFunctions.end(),
+                                    P.getName()),
+                        MemoFunctions.end());
+    if (Memoize)
+        MemoFunctions.push_back(P.getName());
+    foldConstants(&TheEvaluator);
+    return true;
+}
+
+#endif // check_h
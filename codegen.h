@@ -5,18 +5,31 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 
+#include "llvm/MC/SubtargetFeature.h"
+
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
@@ -26,68 +39,367 @@
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
 #include <system_error>
 #include <utility>
 #include <cctype>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <thread>
 
+#include "check.h"
+#include "fold.h"
+#include "interp.h"
+#include "options.h"
 #include "parser.h"
+#include "symtab.h"
+#include "types.h"
 
-llvm::Function *getFunction(std::string Name);
+llvm::Function *getFunction(SymbolId Name);
 
 using namespace llvm;
 using namespace llvm::orc;
 
-static llvm::LLVMContext TheContext;
-static llvm::IRBuilder<> Builder(TheContext);
-static std::unique_ptr<llvm::Module> TheModule;
-static std::map<std::string, llvm::AllocaInst*> NamedValues;
-static std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
+//
+// the state of emitting a module is per thread, the jit compiles
+// definitions on worker threads, each in a context of its own (see
+// compileDefinitions). what parsing and checking keep, the prototypes,
+// symbols and pure functions (check.h), is shared, and only changes while
+// no worker runs
+//
+static thread_local llvm::LLVMContext TheContext;
+static thread_local llvm::IRBuilder<> Builder(TheContext);
+static thread_local std::unique_ptr<llvm::Module> TheModule;
+static thread_local ScopedSymbolTable<llvm::AllocaInst> NamedValues;
+static thread_local std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
 static std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+// the target code is generated for, owned by the driver: the jit's own or
+// the one the object file is written with. a worker thread has its own
+static thread_local llvm::TargetMachine *TheTargetMachine = nullptr;
+
+// the functions declared in TheModule, by name. starts out empty with every
+// new module
+static thread_local SymbolIdMap<llvm::Function*> ModuleFunctions;
+
+// the length arguments of the array arguments of the function being
+// emitted, by array name, for -fbounds-check
+static thread_local SymbolIdMap<llvm::Value*> ArrayLengths;
 
 llvm::Value *LogErrorV(char const* Str) {
     LogError(Str);
     return nullptr;
 }
 
-llvm::Value *NumberExprAST::codegen() {
-    return llvm::ConstantFP::get(TheContext, llvm::APFloat(Val));
+// getSymbolName - the name an interned SymbolId stands for
+static llvm::StringRef getSymbolName(SymbolId Id) {
+    std::string_view Name = TheSymbols.getName(Id);
+    return llvm::StringRef(Name.data(), Name.size());
+}
+
+// getOperatorFunction - the function implementing a user defined operator
+static llvm::Function *getOperatorFunction(bool IsBinary, char Op) {
+    return getFunction(TheSymbols.internOperator(IsBinary, Op));
+}
+
+// createCall - a call of F in F's calling convention, fastcc for the body of
+// a kaleidoscope function, C for an extern
+static llvm::CallInst *createCall(llvm::Function *F,
+                                  llvm::ArrayRef<llvm::Value*> Args,
+                                  llvm::Twine const& Name) {
+    llvm::CallInst *Call = Builder.CreateCall(F, Args, Name);
+    Call->setCallingConv(F->getCallingConv());
+    return Call;
+}
+
+static llvm::Type *getLLVMType(ValueType T) {
+    switch (T) {
+    case ValueType::Int:
+        return llvm::Type::getInt64Ty(TheContext);
+    case ValueType::Bool:
+        return llvm::Type::getInt1Ty(TheContext);
+    case ValueType::DoubleArray:
+        return llvm::Type::getDoublePtrTy(TheContext);
+    case ValueType::IntArray:
+        return llvm::Type::getInt64PtrTy(TheContext);
+    case ValueType::Vec2:
+    case ValueType::Vec4:
+    case ValueType::Vec8:
+        return llvm::VectorType::get(llvm::Type::getDoubleTy(TheContext),
+                                     getVectorWidth(T));
+    default:
+        return llvm::Type::getDoubleTy(TheContext);
+    }
+}
+
+// getNumLanes - the number of lanes of a vector type
+static unsigned getNumLanes(llvm::Type *Ty) {
+    return llvm::cast<llvm::VectorType>(Ty)->getNumElements();
+}
+
+// convertValue - widens V to the type To, type inference made sure it is
+// not narrower
+static llvm::Value *convertValue(llvm::Value *V, llvm::Type *To) {
+    llvm::Type *From = V->getType();
+    if (From == To)
+        return V;
+    if (To->isVectorTy()) {
+        // a scalar goes into every lane
+        V = convertValue(V, To->getScalarType());
+        return Builder.CreateVectorSplat(getNumLanes(To), V, "splat");
+    }
+    if (To->isDoubleTy()) {
+        if (From->isIntegerTy(1))
+            return Builder.CreateUIToFP(V, To, "conv");
+        return Builder.CreateSIToFP(V, To, "conv");
+    }
+    assert(From->isIntegerTy(1) and To->isIntegerTy(64) and
+           "narrowing conversion");
+    return Builder.CreateZExt(V, To, "conv");
+}
+
+// toCondition - V as an i1, true when it is not zero (or NaN)
+static llvm::Value *toCondition(llvm::Value *V, llvm::Twine const& Name) {
+    llvm::Type *Ty = V->getType();
+    if (Ty->isIntegerTy(1))
+        return V;
+    if (Ty->isDoubleTy())
+        return Builder.CreateFCmpONE(V, ConstantFP::get(Ty, 0.0), Name);
+    return Builder.CreateICmpNE(V, ConstantInt::get(Ty, 0), Name);
+}
+
+//
+// ExprCodegen - emits IR for the expressions of one function body. it walks
+// the function's ExprPool and dispatches on the node kind, one overload per
+// kind of node
+//
+class ExprCodegen {
+    ExprPool const& Pool;
+
+    llvm::Value *codegen(NumberExprAST const& E);
+    llvm::Value *codegen(VariableExprAST const& E);
+    llvm::Value *codegen(UnaryExprAST const& E);
+    llvm::Value *codegen(BinaryExprAST const& E);
+    llvm::Value *codegen(CallExprAST const& E);
+    llvm::Value *codegen(IfExprAST const& E);
+    llvm::Value *codegen(ForExprAST const& E);
+    llvm::Value *codegen(VarExprAST const& E);
+    llvm::Value *codegen(SubscriptExprAST const& E);
+
+    bool bindVars(VarExprAST const& E);
+
+    llvm::Value *codegenIndex(ExprId Index, llvm::Value *Length);
+    llvm::Value *getElementAddress(SubscriptExprAST const& E);
+    llvm::Value *codegenBuiltin(Builtin B, CallExprAST const& E);
+
+    // a for loop that counts an integer up by a literal step, see
+    // getCountedLoop
+    struct CountedLoop {
+        int64_t Start, Step;
+        ExprId Bound;
+    };
+
+    bool getCountedLoop(ForExprAST const& E, CountedLoop &L) const;
+    llvm::Value *codegenCountedLoop(ForExprAST const& E, CountedLoop const& L,
+                                    llvm::AllocaInst *Alloca);
+    llvm::Value *codegenLoop(ForExprAST const& E, llvm::AllocaInst *Alloca);
+
+public:
+    explicit ExprCodegen(ExprPool const& Pool) : Pool(Pool) {}
+
+    // codegenReturn - emits E and returns its value from the function
+    bool codegenReturn(ExprId E);
+
+    // codegenResume - emits for loop E from its body on, with the variable
+    // in Alloca already: the rest of a loop tier 0 was running
+    bool codegenResume(ExprId E, llvm::AllocaInst *Alloca) {
+        return codegenLoop(Pool.getFor(E), Alloca);
+    }
+
+    llvm::Value *codegen(ExprId E) {
+        switch (Pool.getKind(E)) {
+        case ExprKind::Number:
+            return codegen(Pool.getNumber(E));
+        case ExprKind::Variable:
+            return codegen(Pool.getVariable(E));
+        case ExprKind::Unary:
+            return codegen(Pool.getUnary(E));
+        case ExprKind::Binary:
+            return codegen(Pool.getBinary(E));
+        case ExprKind::Call:
+            return codegen(Pool.getCall(E));
+        case ExprKind::If:
+            return codegen(Pool.getIf(E));
+        case ExprKind::For:
+            // a for is always 0, of the type inference gave it
+            if (!codegen(Pool.getFor(E)))
+                return nullptr;
+            return Constant::getNullValue(getLLVMType(Pool.getType(E)));
+        case ExprKind::Var:
+            return codegen(Pool.getVar(E));
+        case ExprKind::Subscript:
+            return codegen(Pool.getSubscript(E));
+        }
+        llvm_unreachable("unknown expression kind");
+    }
+};
+
+llvm::Value *ExprCodegen::codegen(NumberExprAST const& E) {
+    switch (E.Type) {
+    case ValueType::Int:
+        return llvm::ConstantInt::get(Type::getInt64Ty(TheContext),
+                                      (int64_t)E.Val, true);
+    case ValueType::Bool:
+        return llvm::ConstantInt::get(Type::getInt1Ty(TheContext),
+                                      isTrue(E.Val));
+    default:
+        return llvm::ConstantFP::get(TheContext, llvm::APFloat(E.Val));
+    }
 }
 
 static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction, 
-                                                std::string const& VarName) {
+                                                llvm::StringRef VarName,
+                                                llvm::Type *Ty) {
     llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                            TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), 0, VarName.c_str());
+    return TmpB.CreateAlloca(Ty, 0, VarName);
 }
 
-llvm::Value *VariableExprAST::codegen() {
+llvm::Value *ExprCodegen::codegen(VariableExprAST const& E) {
     // look this variable up in the function
-    llvm::Value *V = NamedValues[Name];
+    llvm::Value *V = NamedValues.lookup(E.Name);
+    if (!V)
+        return LogErrorV("unknown variable name");
+    return Builder.CreateLoad(V, getSymbolName(E.Name));
+}
+
+// emitBoundsCheck - traps unless 0 <= Index < Length
+static void emitBoundsCheck(llvm::Value *Index, llvm::Value *Length) {
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock *TrapBB =
+        llvm::BasicBlock::Create(TheContext, "outofbounds", TheFunction);
+    llvm::BasicBlock *OkBB =
+        llvm::BasicBlock::Create(TheContext, "inbounds", TheFunction);
+
+    // a negative index is a huge unsigned one
+    Builder.CreateCondBr(Builder.CreateICmpULT(Index, Length, "inbounds"),
+                         OkBB, TrapBB);
+
+    Builder.SetInsertPoint(TrapBB);
+    Builder.CreateCall(
+        llvm::Intrinsic::getDeclaration(TheModule.get(), llvm::Intrinsic::trap));
+    Builder.CreateUnreachable();
+
+    Builder.SetInsertPoint(OkBB);
+}
+
+// codegenIndex - an index as an i64, checked against Length under
+// -fbounds-check
+llvm::Value *ExprCodegen::codegenIndex(ExprId Index, llvm::Value *Length) {
+    llvm::Value *V = codegen(Index);
     if (!V)
-        LogErrorV("unknown variable name");
-    return Builder.CreateLoad(V, Name.c_str());
+        return nullptr;
+    V = convertValue(V, Type::getInt64Ty(TheContext));
+    if (TheOptions.BoundsCheck)
+        emitBoundsCheck(V, Length);
+    return V;
+}
+
+// getLaneCount - the number of lanes of a vector type as an index
+static llvm::Value *getLaneCount(llvm::Type *VecTy) {
+    return ConstantInt::get(Type::getInt64Ty(TheContext), getNumLanes(VecTy));
+}
+
+// getElementAddress - the address of an element of an array argument
+llvm::Value *ExprCodegen::getElementAddress(SubscriptExprAST const& E) {
+    llvm::AllocaInst *Array = NamedValues.lookup(E.Array);
+    if (!Array)
+        return LogErrorV("unknown variable name");
+
+    llvm::Value *Index = codegenIndex(E.Index, ArrayLengths.lookup(E.Array));
+    if (!Index)
+        return nullptr;
+
+    llvm::Type *PtrTy = Array->getAllocatedType();
+    llvm::Value *Ptr = Builder.CreateLoad(PtrTy, Array, getSymbolName(E.Array));
+    return Builder.CreateInBoundsGEP(PtrTy->getPointerElementType(), Ptr,
+                                     Index, "elemaddr");
 }
 
-llvm::Value *ForExprAST::codegen() {
+llvm::Value *ExprCodegen::codegen(SubscriptExprAST const& E) {
+    // a lane of a vector variable
+    llvm::AllocaInst *Var = NamedValues.lookup(E.Array);
+    if (Var and Var->getAllocatedType()->isVectorTy()) {
+        llvm::Type *VecTy = Var->getAllocatedType();
+        llvm::Value *Index = codegenIndex(E.Index, getLaneCount(VecTy));
+        if (!Index)
+            return nullptr;
+        llvm::Value *Vec = Builder.CreateLoad(VecTy, Var, getSymbolName(E.Array));
+        return Builder.CreateExtractElement(Vec, Index, "lane");
+    }
+
+    llvm::Value *Addr = getElementAddress(E);
+    if (!Addr)
+        return nullptr;
+    return Builder.CreateLoad(Addr->getType()->getPointerElementType(), Addr,
+                              "elem");
+}
+
+llvm::Value *ExprCodegen::codegen(ForExprAST const& E) {
     // make the new basic block for the loop header, inserting after current
     // block.
     llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
-    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    llvm::StringRef VarName = getSymbolName(E.VarName);
+    llvm::Type *VarTy = getLLVMType(E.VarType);
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+                                                      VarTy);
     
     // emit the start code first, without variable in scope
-    llvm::Value *StartVal = Start->codegen();
+    llvm::Value *StartVal = codegen(E.Start);
     if (!StartVal)
         return nullptr;
 
     // store the value in the alloca
-    Builder.CreateStore(StartVal, Alloca);
+    Builder.CreateStore(convertValue(StartVal, VarTy), Alloca);
+
+    // the end condition is checked after the body, so when it is a literal
+    // false the body runs once and there is no loop to emit
+    if (Pool.getKind(E.End) == ExprKind::Number and
+        !isTrue(Pool.getNumber(E.End).Val)) {
+        auto Scope = NamedValues.enterScope();
+        NamedValues.bind(E.VarName, Alloca);
+        bool Ok = codegen(E.Body) and (!E.Step or codegen(E.Step));
+        NamedValues.leaveScope(Scope);
+        if (!Ok)
+            return nullptr;
+        return Constant::getNullValue(Type::getDoubleTy(TheContext));
+    }
+
+    // a loop that counts up to a fixed bound gets an integer induction
+    // variable, so LLVM knows its trip count
+    CountedLoop L;
+    if (getCountedLoop(E, L))
+        return codegenCountedLoop(E, L, Alloca);
+    return codegenLoop(E, Alloca);
+}
+
+// codegenLoop - the loop of a for, its variable in Alloca: the body, the
+// step, the end condition, then the increment
+llvm::Value *ExprCodegen::codegenLoop(ForExprAST const& E,
+                                      llvm::AllocaInst *Alloca) {
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::StringRef VarName = getSymbolName(E.VarName);
+    llvm::Type *VarTy = Alloca->getAllocatedType();
 
     // 
     //llvm::BasicBlock *PreheaderBB = Builder.GetInsertBlock();
@@ -109,41 +421,45 @@ llvm::Value *ForExprAST::codegen() {
     //NamedValues[VarName] = Variable;
 
     // within the loop, the variable is idefined equal to the PHI node. If it shadows
-    // an existing variable, we have to restore it, so save it now
-    AllocaInst *OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
+    // an existing variable, we have to restore it, the scope remembers it
+    auto Scope = NamedValues.enterScope();
+    NamedValues.bind(E.VarName, Alloca);
 
     // emit the body of the loop. This, like any other expr, can change the 
     // current BB. Note that we ignore the value computed by the body, but don't 
     // allow an error
-    if (!Body->codegen())
+    if (!codegen(E.Body))
         return nullptr;
 
     // emit the step value
     llvm::Value *StepVal = nullptr;
-    if (Step) {
-        StepVal = Step->codegen();
+    if (E.Step) {
+        StepVal = codegen(E.Step);
         if (!StepVal)
             return nullptr;
-    } else {
+        StepVal = convertValue(StepVal, VarTy);
+    } else if (VarTy->isDoubleTy()) {
         // if not specified, use 1.0
         StepVal = ConstantFP::get(TheContext, APFloat(1.0));
+    } else {
+        StepVal = ConstantInt::get(VarTy, 1);
     }
 
     // compute the end condition
-    llvm::Value *EndCond = End->codegen();
+    llvm::Value *EndCond = codegen(E.End);
     if (!EndCond)
         return nullptr;
     
     // reload, increment, and restore the alloca. This handles the case where
     // the body of the loop mutates the variable
-    llvm::Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-    llvm::Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
+    llvm::Value *CurVar = Builder.CreateLoad(Alloca, VarName);
+    llvm::Value *NextVar = VarTy->isDoubleTy()
+                               ? Builder.CreateFAdd(CurVar, StepVal, "nextvar")
+                               : Builder.CreateAdd(CurVar, StepVal, "nextvar");
     Builder.CreateStore(NextVar, Alloca);
 
-    // convert condition to a bool by comparing non-equal to 0.0
-    EndCond = Builder.CreateFCmpONE(EndCond, ConstantFP::get(TheContext, APFloat(0.0)),
-        "loopcond");
+    // convert condition to a bool by comparing non-equal to 0
+    EndCond = toCondition(EndCond, "loopcond");
 
     // create the after looop block and insert it
     llvm::BasicBlock *AfterBB = 
@@ -156,79 +472,310 @@ llvm::Value *ForExprAST::codegen() {
     Builder.SetInsertPoint(AfterBB);
 
     // restore the unshadowed variable
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    NamedValues.leaveScope(Scope);
 
     // for expr always returns 0.0
     return Constant::getNullValue(Type::getDoubleTy(TheContext));
 }
 
-llvm::Value *UnaryExprAST::codegen() {
-    llvm::Value *OperandV = Operand->codegen();
+//
+// getCountedLoop - whether a for loop is of the form
+//
+//   for i = <integer>, i < <bound>, <positive integer> in <body>
+//
+// where the body never assigns i and the bound can not change while the
+// loop runs: it makes no calls (user operators are calls too), assigns
+// nothing, reads no array and no variable the body assigns. such a loop only
+// depends on the bound evaluated once, before it. a bound that is an int
+// already gives the generic loop a trip count, only a double bound is
+// worth it
+//
+bool ExprCodegen::getCountedLoop(ForExprAST const& E, CountedLoop &L) const {
+    // integers a double holds exactly
+    auto isExactInt = [](double V) {
+        return V == std::trunc(V) and std::fabs(V) < 0x1p53;
+    };
+
+    double Start, Step = 1.0;
+    if (Pool.getKind(E.Start) != ExprKind::Number)
+        return false;
+    Start = Pool.getNumber(E.Start).Val;
+    if (E.Step) {
+        if (Pool.getKind(E.Step) != ExprKind::Number)
+            return false;
+        Step = Pool.getNumber(E.Step).Val;
+    }
+    if (!isExactInt(Start) or !isExactInt(Step) or Step <= 0)
+        return false;
+
+    if (Pool.getKind(E.End) != ExprKind::Binary)
+        return false;
+    BinaryExprAST Cond = Pool.getBinary(E.End);
+    if (Cond.Op != '<' or Pool.getKind(Cond.LHS) != ExprKind::Variable or
+        Pool.getVariable(Cond.LHS).Name != E.VarName or
+        Pool.getType(Cond.RHS) != ValueType::Double)
+        return false;
+
+    // the variables the body assigns
+    std::vector<SymbolId> Assigned;
+    Pool.walk(E.Body, [&](ExprId N) {
+        if (Pool.getKind(N) != ExprKind::Binary)
+            return;
+        BinaryExprAST B = Pool.getBinary(N);
+        if (B.Op == '=' and Pool.getKind(B.LHS) == ExprKind::Variable)
+            Assigned.push_back(Pool.getVariable(B.LHS).Name);
+    });
+    auto isAssigned = [&](SymbolId Name) {
+        return std::find(Assigned.begin(), Assigned.end(), Name) !=
+               Assigned.end();
+    };
+    if (isAssigned(E.VarName))
+        return false;
+
+    bool Invariant = true;
+    Pool.walk(Cond.RHS, [&](ExprId N) {
+        switch (Pool.getKind(N)) {
+        case ExprKind::Call:
+        case ExprKind::Unary:
+        case ExprKind::Subscript:
+            Invariant = false;
+            break;
+        case ExprKind::Binary: {
+            char Op = Pool.getBinary(N).Op;
+            if (Op != '+' and Op != '-' and Op != '*' and Op != '<')
+                Invariant = false;
+            break;
+        }
+        case ExprKind::Variable: {
+            SymbolId Name = Pool.getVariable(N).Name;
+            if (Name == E.VarName or isAssigned(Name))
+                Invariant = false;
+            break;
+        }
+        default:
+            break;
+        }
+    });
+    if (!Invariant)
+        return false;
+
+    L.Start = Start;
+    L.Step = Step;
+    L.Bound = Cond.RHS;
+    return true;
+}
+
+//
+// codegenCountedLoop - emits a counted loop with an i64 induction variable
+//
+//   preheader: limit = the bound, rounded up to an integer
+//   loop:      iv = phi [start, preheader], [iv + step, latch]
+//              i = iv, converted to double unless i is an int
+//              body
+//   latch:     br iv < limit, loop, afterloop
+//
+// the body still runs before the first check, like in any for loop, and i
+// takes the same values as in the double loop: for an integer iv, iv < n
+// is the same as iv < ceil(n)
+//
+llvm::Value *ExprCodegen::codegenCountedLoop(ForExprAST const& E,
+                                             CountedLoop const& L,
+                                             llvm::AllocaInst *Alloca) {
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::Type *DoubleTy = Type::getDoubleTy(TheContext);
+    llvm::Type *Int64Ty = Type::getInt64Ty(TheContext);
+
+    llvm::Value *Bound = codegen(L.Bound);
+    if (!Bound)
+        return nullptr;
+
+    // clamp the bound to +-2^62 so it converts, and so that adding the step
+    // can not overflow. NaN compares unordered and so becomes the upper
+    // clamp: the loop ends in neither case
+    llvm::Function *Ceil = llvm::Intrinsic::getDeclaration(
+        TheModule.get(), llvm::Intrinsic::ceil, DoubleTy);
+    llvm::Value *Max = ConstantFP::get(DoubleTy, 0x1p62);
+    llvm::Value *Min = ConstantFP::get(DoubleTy, -0x1p62);
+    llvm::Value *Limit = Builder.CreateCall(Ceil, Bound, "bound");
+    Limit = Builder.CreateSelect(Builder.CreateFCmpOLT(Limit, Max), Limit, Max);
+    Limit = Builder.CreateSelect(Builder.CreateFCmpOGT(Limit, Min), Limit, Min);
+    Limit = Builder.CreateFPToSI(Limit, Int64Ty, "limit");
+
+    llvm::BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+    llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(TheContext, "loop", TheFunction);
+    Builder.CreateBr(LoopBB);
+    Builder.SetInsertPoint(LoopBB);
+
+    llvm::StringRef VarName = getSymbolName(E.VarName);
+    llvm::PHINode *IV = Builder.CreatePHI(Int64Ty, 2, VarName);
+    IV->addIncoming(ConstantInt::get(Int64Ty, L.Start), PreheaderBB);
+    Builder.CreateStore(convertValue(IV, Alloca->getAllocatedType()), Alloca);
+
+    auto Scope = NamedValues.enterScope();
+    NamedValues.bind(E.VarName, Alloca);
+    llvm::Value *BodyVal = codegen(E.Body);
+    NamedValues.leaveScope(Scope);
+    if (!BodyVal)
+        return nullptr;
+
+    llvm::Value *NextIV = Builder.CreateNSWAdd(
+        IV, ConstantInt::get(Int64Ty, L.Step), "nextvar");
+    llvm::Value *LoopCond = Builder.CreateICmpSLT(IV, Limit, "loopcond");
+
+    llvm::BasicBlock *LatchBB = Builder.GetInsertBlock();
+    llvm::BasicBlock *AfterBB =
+        llvm::BasicBlock::Create(TheContext, "afterloop", TheFunction);
+    Builder.CreateCondBr(LoopCond, LoopBB, AfterBB);
+    IV->addIncoming(NextIV, LatchBB);
+
+    Builder.SetInsertPoint(AfterBB);
+
+    // for expr always returns 0.0
+    return Constant::getNullValue(DoubleTy);
+}
+
+llvm::Value *ExprCodegen::codegen(UnaryExprAST const& E) {
+    llvm::Value *OperandV = codegen(E.Operand);
     if (!OperandV)
         return nullptr;
 
-    llvm::Function *F = getFunction(std::string("unary") + Opcode);
+    llvm::Function *F = getOperatorFunction(false, E.Opcode);
     if (!F)
         return LogErrorV("unknown unary operator");
 
-    return Builder.CreateCall(F, OperandV, "unop");
+    OperandV = convertValue(OperandV, F->getFunctionType()->getParamType(0));
+    return createCall(F, OperandV, "unop");
 }
 
-llvm::Value *VarExprAST::codegen() {
-    std::vector<AllocaInst*> OldBindings;
-
+// bindVars - emits the initializers of a var and binds its variables in
+// the current scope
+bool ExprCodegen::bindVars(VarExprAST const& E) {
     llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
     // register all variables and emit their initializer
-    for (unsigned i=0, e=VarNames.size(); i!=e; ++i) {
-        std::string const& VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+    for (unsigned i=0, e=E.NumVars; i!=e; ++i) {
+        VarBinding Var = E.getVar(i);
+        llvm::Type *VarTy = getLLVMType(Var.Type);
 
         llvm::Value *InitVal;
-        if (Init) {
-            InitVal = Init->codegen();
+        if (Var.Init) {
+            InitVal = codegen(Var.Init);
             if (!InitVal)
-                return nullptr;
+                return false;
+            InitVal = convertValue(InitVal, VarTy);
         } else {
-            // if not specified, use 0.0
-            InitVal = ConstantFP::get(TheContext, APFloat(0.0));
+            // if not specified, use 0
+            InitVal = Constant::getNullValue(VarTy);
         }
 
-        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+        llvm::AllocaInst *Alloca =
+            CreateEntryBlockAlloca(TheFunction, getSymbolName(Var.Name), VarTy);
         Builder.CreateStore(InitVal, Alloca);
 
-        // remember the old variable binding so that we can restore the binding
-        // when we unrecurse.
-        OldBindings.push_back(NamedValues[VarName]);
-
-        // remember this binding
-        NamedValues[VarName] = Alloca;
+        // remember this binding, the scope keeps the one it shadows so that
+        // we can restore it when we unrecurse
+        NamedValues.bind(Var.Name, Alloca);
     }
+    return true;
+}
+
+llvm::Value *ExprCodegen::codegen(VarExprAST const& E) {
+    auto Scope = NamedValues.enterScope();
+    if (!bindVars(E))
+        return nullptr;
 
     // codegen the body, now that all vars are in scope
-    llvm::Value *BodyVal = Body->codegen();
+    llvm::Value *BodyVal = codegen(E.Body);
     if (!BodyVal)
         return nullptr;
 
     // pop all our variables from scope
-    for (unsigned i = 0, e = VarNames.size(); i!=e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    NamedValues.leaveScope(Scope);
 
     // return the body computation
     return BodyVal;
 }
 
-llvm::Value *IfExprAST::codegen() {
-    llvm::Value *CondV = Cond->codegen();
+// markTailCall - marks a call whose result the function returns. a call of
+// a function of the caller's type and convention must be a tail call, so
+// it can not overflow the stack even without optimization, others may be.
+// with -tailcallopt semantics (see getTargetOptions) the backend makes any
+// fastcc call in tail position one
+static void markTailCall(llvm::CallInst *Call, llvm::Function *Caller) {
+    llvm::Function *Callee = Call->getCalledFunction();
+    if (!Callee or Callee->isIntrinsic())
+        return;
+    if (Callee->getFunctionType() == Caller->getFunctionType() and
+        Callee->getCallingConv() == Caller->getCallingConv() and
+        Call == &Call->getParent()->back())
+        Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    else
+        Call->setTailCall();
+}
+
+//
+// codegenReturn - E is in tail position, and so are the branches of an if
+// and the body of a var in tail position. those return from their own
+// blocks instead of joining in a phi, so a call there is directly followed
+// by the ret and can be a tail call
+//
+bool ExprCodegen::codegenReturn(ExprId E) {
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+    switch (Pool.getKind(E)) {
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        llvm::Value *CondV = codegen(If.Cond);
+        if (!CondV)
+            return false;
+        CondV = toCondition(CondV, "ifcond");
+
+        llvm::BasicBlock *ThenBB =
+            llvm::BasicBlock::Create(TheContext, "then", TheFunction);
+        llvm::BasicBlock *ElseBB =
+            llvm::BasicBlock::Create(TheContext, "else", TheFunction);
+        Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+
+        Builder.SetInsertPoint(ThenBB);
+        if (!codegenReturn(If.Then))
+            return false;
+        Builder.SetInsertPoint(ElseBB);
+        return codegenReturn(If.Else);
+    }
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        auto Scope = NamedValues.enterScope();
+        if (!bindVars(V) or !codegenReturn(V.Body))
+            return false;
+        NamedValues.leaveScope(Scope);
+        return true;
+    }
+
+    default:
+        break;
+    }
+
+    llvm::Value *V = codegen(E);
+    if (!V)
+        return false;
+    if (auto *Call = llvm::dyn_cast<llvm::CallInst>(V))
+        markTailCall(Call, TheFunction);
+    Builder.CreateRet(convertValue(V, TheFunction->getReturnType()));
+    return true;
+}
+
+llvm::Value *ExprCodegen::codegen(IfExprAST const& E) {
+    llvm::Value *CondV = codegen(E.Cond);
     if (!CondV)
         return nullptr;
 
-    // convert condition to a bool by comparing non-equal to 0.0
-    CondV = Builder.CreateFCmpONE(
-        CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+    // convert condition to a bool by comparing non-equal to 0
+    CondV = toCondition(CondV, "ifcond");
+
+    // both branches give the wider of their types
+    llvm::Type *Ty = getLLVMType(
+        getCommonType(Pool.getType(E.Then), Pool.getType(E.Else)));
 
     llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
@@ -243,9 +790,10 @@ llvm::Value *IfExprAST::codegen() {
     // emit then value
     Builder.SetInsertPoint(ThenBB);
 
-    llvm::Value *ThenV = Then->codegen();
+    llvm::Value *ThenV = codegen(E.Then);
     if (!ThenV)
         return nullptr;
+    ThenV = convertValue(ThenV, Ty);
 
     Builder.CreateBr(MergeBB);
     // codegen of 'Then' can cahnge the current block, update ThenBB for the PHI
@@ -255,9 +803,10 @@ llvm::Value *IfExprAST::codegen() {
     TheFunction->getBasicBlockList().push_back(ElseBB);
     Builder.SetInsertPoint(ElseBB);
 
-    llvm::Value *ElseV = Else->codegen();
+    llvm::Value *ElseV = codegen(E.Else);
     if (!ElseV)
         return nullptr;
+    ElseV = convertValue(ElseV, Ty);
 
     Builder.CreateBr(MergeBB);
     // codegen of 'Else' can change the current block, update ElseBB for the PHI
@@ -266,228 +815,1387 @@ llvm::Value *IfExprAST::codegen() {
     // emit merge block
     TheFunction->getBasicBlockList().push_back(MergeBB);
     Builder.SetInsertPoint(MergeBB);
-    PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+    PHINode *PN = Builder.CreatePHI(Ty, 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
     return PN;
 }
 
-llvm::Value *BinaryExprAST::codegen() {
+llvm::Value *ExprCodegen::codegen(BinaryExprAST const& E) {
     // special case '=' because we don't want to emit the LHS as an expression
-    if (Op == '=') {
-        VariableExprAST *LHSE = dynamic_cast<VariableExprAST*>(LHS.get());
-        if (!LHSE)
+    if (E.Op == '=') {
+        // a[i] = v stores to the element, or the lane of a vector
+        if (Pool.getKind(E.LHS) == ExprKind::Subscript) {
+            SubscriptExprAST S = Pool.getSubscript(E.LHS);
+            llvm::Value *Val = codegen(E.RHS);
+            if (!Val)
+                return nullptr;
+
+            llvm::AllocaInst *Var = NamedValues.lookup(S.Array);
+            if (Var and Var->getAllocatedType()->isVectorTy()) {
+                llvm::Type *VecTy = Var->getAllocatedType();
+                llvm::Value *Index = codegenIndex(S.Index, getLaneCount(VecTy));
+                if (!Index)
+                    return nullptr;
+                Val = convertValue(Val, VecTy->getScalarType());
+                llvm::Value *Vec =
+                    Builder.CreateLoad(VecTy, Var, getSymbolName(S.Array));
+                Vec = Builder.CreateInsertElement(Vec, Val, Index, "lane");
+                Builder.CreateStore(Vec, Var);
+                return Val;
+            }
+
+            llvm::Value *Addr = getElementAddress(S);
+            if (!Addr)
+                return nullptr;
+            Val = convertValue(Val, Addr->getType()->getPointerElementType());
+            Builder.CreateStore(Val, Addr);
+            return Val;
+        }
+
+        if (Pool.getKind(E.LHS) != ExprKind::Variable)
             return LogErrorV("destination of '=' must be a variable");
+        VariableExprAST LHSE = Pool.getVariable(E.LHS);
 
         // codegen the RHS
-        llvm::Value *Val = RHS->codegen();
+        llvm::Value *Val = codegen(E.RHS);
         if (!Val)
             return nullptr;
 
         // loop up the naem
-        auto *Variable = NamedValues[LHSE->getName()];
+        auto *Variable = NamedValues.lookup(LHSE.Name);
         if (!Variable)
             return LogErrorV("unknown variable name");
 
+        Val = convertValue(Val, Variable->getAllocatedType());
         Builder.CreateStore(Val, Variable);
         return Val;
     }
 
-    llvm::Value *L = LHS->codegen();
-    llvm::Value *R = RHS->codegen();
+    llvm::Value *L = codegen(E.LHS);
+    llvm::Value *R = codegen(E.RHS);
 
     if (!L or !R)
         return nullptr;
 
-    switch (Op) {
-    case '+':
-        return Builder.CreateFAdd(L, R, "addtmp");
-    case '-':
-        return Builder.CreateFSub(L, R, "subtmp");
-    case '*':
-        return Builder.CreateFMul(L, R, "multmp");
-    case '<':
-        L = Builder.CreateFCmpULT(L, R, "cmptmp");
-        return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext),
-                                    "booltmp");
-    default:
-        break;
+    if (E.Op == '+' or E.Op == '-' or E.Op == '*' or E.Op == '<') {
+        // the builtin operators work on ints when both sides are ints or
+        // bools, lanewise when one side is a vector, and on doubles
+        // otherwise
+        bool IsInt = L->getType()->isIntegerTy() and R->getType()->isIntegerTy();
+        llvm::Type *Ty = IsInt ? Type::getInt64Ty(TheContext)
+                               : Type::getDoubleTy(TheContext);
+        if (L->getType()->isVectorTy())
+            Ty = L->getType();
+        else if (R->getType()->isVectorTy())
+            Ty = R->getType();
+        L = convertValue(L, Ty);
+        R = convertValue(R, Ty);
+
+        switch (E.Op) {
+        case '+':
+            return IsInt ? Builder.CreateAdd(L, R, "addtmp")
+                         : Builder.CreateFAdd(L, R, "addtmp");
+        case '-':
+            return IsInt ? Builder.CreateSub(L, R, "subtmp")
+                         : Builder.CreateFSub(L, R, "subtmp");
+        case '*':
+            return IsInt ? Builder.CreateMul(L, R, "multmp")
+                         : Builder.CreateFMul(L, R, "multmp");
+        default:
+            if (IsInt)
+                return Builder.CreateICmpSLT(L, R, "cmptmp");
+            llvm::Value *Cmp = Builder.CreateFCmpULT(L, R, "cmptmp");
+            // lanes compare to 1.0 or 0.0
+            if (Ty->isVectorTy())
+                return Builder.CreateUIToFP(Cmp, Ty, "booltmp");
+            return Cmp;
+        }
     }
 
     // if it was not a builtin binary operator, it must be a user defined one. 
     // emit a call to it.
-    llvm::Function *F = getFunction(std::string("binary") + Op);
+    llvm::Function *F = getOperatorFunction(true, E.Op);
     assert(F and "binary operator not found");
 
-    llvm::Value *Ops[2] = {L, R};
-    return Builder.CreateCall(F, Ops, "binop");
+    llvm::Value *Ops[2] = {
+        convertValue(L, F->getFunctionType()->getParamType(0)),
+        convertValue(R, F->getFunctionType()->getParamType(1))};
+    return createCall(F, Ops, "binop");
 }
 
-llvm::Function *getFunction(std::string Name) {
+llvm::Function *getFunction(SymbolId Name) {
     // first, see if the function has already been added to the current module
-    if (auto *F = TheModule->getFunction(Name))
+    if (auto *F = ModuleFunctions.lookup(Name))
         return F;
 
     // if not, check whether we can codegen the decl from some existing proto
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+    if (auto &Proto = FunctionProtos.lookup(Name))
+        return Proto->codegen();
 
     // if no existing proto exists, return null
     return nullptr;
 }
 
-llvm::Value *CallExprAST::codegen() {
+// emitReduction - combines the two halves of the vector V lanewise until
+// one lane is left
+static llvm::Value *emitReduction(Builtin B, llvm::Value *V) {
+    for (unsigned N = getNumLanes(V->getType()); N != 1; N /= 2) {
+        std::vector<uint32_t> LoLanes, HiLanes;
+        for (unsigned i = 0; i != N / 2; ++i) {
+            LoLanes.push_back(i);
+            HiLanes.push_back(N / 2 + i);
+        }
+        llvm::Value *Undef = UndefValue::get(V->getType());
+        llvm::Value *Lo = Builder.CreateShuffleVector(
+            V, Undef, ConstantDataVector::get(TheContext, LoLanes), "lo");
+        llvm::Value *Hi = Builder.CreateShuffleVector(
+            V, Undef, ConstantDataVector::get(TheContext, HiLanes), "hi");
+
+        switch (B) {
+        case Builtin::HSum:
+            V = Builder.CreateFAdd(Lo, Hi, "hsum");
+            break;
+        case Builtin::HMin:
+            V = Builder.CreateSelect(Builder.CreateFCmpOLT(Lo, Hi), Lo, Hi,
+                                     "hmin");
+            break;
+        default:
+            V = Builder.CreateSelect(Builder.CreateFCmpOGT(Lo, Hi), Lo, Hi,
+                                     "hmax");
+            break;
+        }
+    }
+    return Builder.CreateExtractElement(V, uint64_t(0), "reduce");
+}
+
+llvm::Value *ExprCodegen::codegenBuiltin(Builtin B, CallExprAST const& E) {
+    llvm::Type *DoubleTy = Type::getDoubleTy(TheContext);
+    std::vector<llvm::Value *> ArgsV;
+    for (unsigned i = 0; i != E.NumArgs; ++i) {
+        llvm::Value *Arg = codegen(E.getArg(i));
+        if (!Arg)
+            return nullptr;
+        ArgsV.push_back(Arg);
+    }
+
+    switch (B) {
+    case Builtin::Vec2:
+    case Builtin::Vec4:
+    case Builtin::Vec8: {
+        unsigned N = B == Builtin::Vec2 ? 2 : B == Builtin::Vec4 ? 4 : 8;
+        if (ArgsV.size() == 1)
+            return Builder.CreateVectorSplat(
+                N, convertValue(ArgsV[0], DoubleTy), "vec");
+        llvm::Value *V = UndefValue::get(llvm::VectorType::get(DoubleTy, N));
+        for (unsigned i = 0; i != N; ++i)
+            V = Builder.CreateInsertElement(
+                V, convertValue(ArgsV[i], DoubleTy), uint64_t(i), "vec");
+        return V;
+    }
+    case Builtin::HSum:
+    case Builtin::HMin:
+    case Builtin::HMax:
+        return emitReduction(B, ArgsV[0]);
+    default:
+        break;
+    }
+
+    // math is an intrinsic on doubles or on vectors, lanewise
+    llvm::Intrinsic::ID ID;
+    switch (B) {
+    case Builtin::Sqrt:
+        ID = llvm::Intrinsic::sqrt;
+        break;
+    case Builtin::Fabs:
+        ID = llvm::Intrinsic::fabs;
+        break;
+    case Builtin::Sin:
+        ID = llvm::Intrinsic::sin;
+        break;
+    case Builtin::Cos:
+        ID = llvm::Intrinsic::cos;
+        break;
+    case Builtin::Exp:
+        ID = llvm::Intrinsic::exp;
+        break;
+    case Builtin::Log:
+        ID = llvm::Intrinsic::log;
+        break;
+    case Builtin::Floor:
+        ID = llvm::Intrinsic::floor;
+        break;
+    case Builtin::Pow:
+        ID = llvm::Intrinsic::pow;
+        break;
+    case Builtin::Min:
+        ID = llvm::Intrinsic::minnum;
+        break;
+    case Builtin::Max:
+        ID = llvm::Intrinsic::maxnum;
+        break;
+    case Builtin::Fma:
+        ID = llvm::Intrinsic::fma;
+        break;
+    default:
+        llvm_unreachable("not a builtin");
+    }
+
+    llvm::Type *Ty = DoubleTy;
+    for (llvm::Value *Arg : ArgsV)
+        if (Arg->getType()->isVectorTy())
+            Ty = Arg->getType();
+    for (llvm::Value *&Arg : ArgsV)
+        Arg = convertValue(Arg, Ty);
+    llvm::Function *F = Intrinsic::getDeclaration(TheModule.get(), ID, Ty);
+    return Builder.CreateCall(F, ArgsV, "calltmp");
+}
+
+llvm::Value *ExprCodegen::codegen(CallExprAST const& E) {
+    // type inference found which calls are builtins
+    if (E.BuiltinFn != Builtin::None)
+        return codegenBuiltin(E.BuiltinFn, E);
+
     // look up the name in the global module table
-    llvm::Function *CalleeF = getFunction(Callee);
+    llvm::Function *CalleeF = getFunction(E.Callee);
 //    llvm::Function *CalleeF = TheModule->getFunction(Callee);
     if (!CalleeF)
         return LogErrorV("unknown function referenced");
 
     // if argument mismatch error
-    if (CalleeF->arg_size() != Args.size())
+    if (CalleeF->arg_size() != E.NumArgs)
         return LogErrorV("incorrect # arguments passed");
 
     std::vector<llvm::Value *> ArgsV;
-    for (unsigned i=0, e=Args.size(); i!=e; i++) {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
+    for (unsigned i=0, e=E.NumArgs; i!=e; i++) {
+        llvm::Value *Arg = codegen(E.getArg(i));
+        if (!Arg)
             return nullptr;
+        ArgsV.push_back(
+            convertValue(Arg, CalleeF->getFunctionType()->getParamType(i)));
     }
 
-    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+    return createCall(CalleeF, ArgsV, "calltmp");
 }
 
-llvm::Function *PrototypeAST::codegen() {
-    // make the function type: double(double, double) etc
-    std::vector<llvm::Type*> Doubles(Args.size(), 
-                               llvm::Type::getDoubleTy(TheContext));
+// getFunctionType - the type of the function a prototype declares,
+// double(double, double) unless it has annotations
+static llvm::FunctionType *getFunctionType(PrototypeAST const& Proto) {
+    std::vector<llvm::Type*> ArgTypes;
+    for (unsigned i = 0, e = Proto.getArgs().size(); i != e; ++i)
+        ArgTypes.push_back(getLLVMType(Proto.getArgType(i)));
+    return llvm::FunctionType::get(getLLVMType(Proto.getReturnType()),
+                                   ArgTypes, false);
+}
 
-    llvm::FunctionType *FT = 
-        llvm::FunctionType::get(llvm::Type::getDoubleTy(TheContext), Doubles, false);
+//
+// a function defined in kaleidoscope is two functions: its body, "f.fast",
+// which kaleidoscope code calls in the fast calling convention, and the C
+// entry point "f" calling it, for hosts and for calls through an extern
+// declaration. an extern is a C function
+//
+llvm::Function *PrototypeAST::codegen() {
+    llvm::FunctionType *FT = getFunctionType(*this);
 
-    llvm::Function *F = 
-        llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, 
-                               TheModule.get());
+    llvm::Function *F;
+    if (hasFlag(PF_Extern)) {
+        F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+                                   getSymbolName(Name), TheModule.get());
+    } else {
+        F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+                                   getSymbolName(Name) + ".fast",
+                                   TheModule.get());
+        F->setCallingConv(llvm::CallingConv::Fast);
+    }
+    ModuleFunctions[Name] = F;
 
     // set names for all arguments
     unsigned Idx = 0;
     for (auto &Arg: F->args())
-        Arg.setName(Args[Idx++]);
+        Arg.setName(getSymbolName(Args[Idx++]));
 
     return F;
 }
 
-llvm::Function *FunctionAST::codegen() {
-    // first, check for an existing function from a previous 'extern' declaration
-//    llvm::Function *TheFunction = TheModule->getFunction(Proto->getName());
+// setFastMath - makes the floating point ops emitted from here on fast-math
+// or strict, a fast-math function also gets the matching attributes for the
+// backend
+static void setFastMath(llvm::Function *F, bool Enable) {
+    llvm::FastMathFlags FMF;
+    if (Enable) {
+        FMF.setFast();
+        F->addFnAttr("unsafe-fp-math", "true");
+        F->addFnAttr("no-infs-fp-math", "true");
+        F->addFnAttr("no-nans-fp-math", "true");
+        F->addFnAttr("no-signed-zeros-fp-math", "true");
+    }
+    Builder.setFastMathFlags(FMF);
+}
 
-    auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
-    llvm::Function *TheFunction = getFunction(P.getName());
+// redirectCalls - makes the calls of Entry, made through an extern
+// declaration before the function was defined, calls of its Body. a C
+// entry can not tail call the fastcc body, so mutual recursion declared
+// with an extern would otherwise grow the stack. an object file is one
+// module, the jit tells its externs apart in HandleExtern
+static void redirectCalls(llvm::Function *Entry, llvm::Function *Body) {
+    for (auto UI = Entry->use_begin(), UE = Entry->use_end(); UI != UE;) {
+        llvm::Use &U = *UI++;
+        auto *Call = llvm::dyn_cast<llvm::CallInst>(U.getUser());
+        if (!Call or Call->getCalledFunction() != Entry)
+            continue;
+        Call->setCalledFunction(Body);
+        Call->setCallingConv(Body->getCallingConv());
+    }
+}
 
-//    if (!TheFunction)
-//        TheFunction = Proto->codegen();
+//
+// memoization - a memoized function f keeps its results in the table
+// f.memo. its body f.fast looks the arguments up and only calls f.eval,
+// which evaluates f, on a miss, so recursive calls go through the table
+// too. the table is open addressing on the bits of the arguments, a lookup
+// probes up to MemoProbes slots and a miss that finds none free takes the
+// first. f.memo.hits and f.memo.misses count the lookups. the table sizes
+// and shouldMemoize are in check.h
+//
 
-    if (!TheFunction)
-        return nullptr;
+// getMemoKey - the bits of an argument, as the table keeps them
+static llvm::Value *getMemoKey(llvm::Value *Arg) {
+    if (Arg->getType()->isDoubleTy())
+        return Builder.CreateBitCast(Arg, Builder.getInt64Ty(), "key");
+    return Builder.CreateZExt(Arg, Builder.getInt64Ty(), "key");
+}
+
+// createCounter - an i64 global starting at zero
+static llvm::GlobalVariable *createCounter(llvm::Twine const& Name) {
+    return new llvm::GlobalVariable(
+        *TheModule, Builder.getInt64Ty(), false,
+        llvm::GlobalValue::ExternalLinkage, Builder.getInt64(0), Name);
+}
 
-    if (!TheFunction->empty())
+static void incrementCounter(llvm::GlobalVariable *Counter) {
+    llvm::Value *N =
+        Builder.CreateLoad(Counter->getValueType(), Counter, "count");
+    Builder.CreateStore(Builder.CreateAdd(N, Builder.getInt64(1)), Counter);
+}
+
+// emitMemoTable - moves the body of F to the new function f.eval and makes
+// F look its arguments up in a memo table, calling f.eval on a miss.
+// returns f.eval
+static llvm::Function *emitMemoTable(PrototypeAST const& P,
+                                     llvm::Function *F) {
+    std::string Name = getSymbolName(P.getName()).str();
+    llvm::Function *Eval = llvm::Function::Create(
+        F->getFunctionType(), llvm::Function::InternalLinkage,
+        Name + ".eval", TheModule.get());
+    Eval->copyAttributesFrom(F);
+    Eval->getBasicBlockList().splice(Eval->end(), F->getBasicBlockList());
+
+    std::vector<llvm::Value*> Args;
+    for (auto A = F->arg_begin(), EA = Eval->arg_begin(); A != F->arg_end();
+         ++A, ++EA) {
+        EA->setName(A->getName());
+        A->replaceAllUsesWith(&*EA);
+        Args.push_back(&*A);
+    }
+
+    // an entry is {keys, result, full}
+    llvm::Type *I64 = Builder.getInt64Ty();
+    llvm::Type *ResultTy = F->getReturnType();
+    llvm::StructType *EntryTy = llvm::StructType::get(
+        TheContext, {llvm::ArrayType::get(I64, Args.size()), ResultTy,
+                     Builder.getInt1Ty()});
+    llvm::ArrayType *TableTy = llvm::ArrayType::get(EntryTy, MemoSlots);
+    auto *Table = new llvm::GlobalVariable(
+        *TheModule, TableTy, false, llvm::GlobalValue::InternalLinkage,
+        llvm::ConstantAggregateZero::get(TableTy), Name + ".memo");
+    auto *Hits = createCounter(Name + ".memo.hits");
+    auto *Misses = createCounter(Name + ".memo.misses");
+
+    llvm::BasicBlock *EntryBB = llvm::BasicBlock::Create(TheContext, "entry", F);
+    llvm::BasicBlock *ProbeBB = llvm::BasicBlock::Create(TheContext, "probe", F);
+    llvm::BasicBlock *CompareBB = llvm::BasicBlock::Create(TheContext, "compare", F);
+    llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(TheContext, "hit", F);
+    llvm::BasicBlock *NextBB = llvm::BasicBlock::Create(TheContext, "next", F);
+    llvm::BasicBlock *MissBB = llvm::BasicBlock::Create(TheContext, "miss", F);
+
+    // hash the argument bits to the first slot to probe. the slot is the top
+    // bits of the product, the low ones of a small integral double are all
+    // zero
+    Builder.SetInsertPoint(EntryBB);
+    std::vector<llvm::Value*> Keys;
+    llvm::Value *Hash = Builder.getInt64(0);
+    for (auto *Arg : Args) {
+        Keys.push_back(getMemoKey(Arg));
+        Hash = Builder.CreateMul(Builder.CreateXor(Hash, Keys.back()),
+                                 Builder.getInt64(0x9e3779b97f4a7c15), "hash");
+    }
+    llvm::Value *Home = Builder.CreateLShr(Hash, 64 - MemoBits, "home");
+    Builder.CreateBr(ProbeBB);
+
+    auto GetEntry = [&](llvm::Value *Slot) {
+        return Builder.CreateInBoundsGEP(TableTy, Table,
+                                         {Builder.getInt64(0), Slot}, "entry");
+    };
+    auto GetKey = [&](llvm::Value *Entry, unsigned I) {
+        return Builder.CreateInBoundsGEP(
+            EntryTy, Entry,
+            {Builder.getInt32(0), Builder.getInt32(0), Builder.getInt32(I)},
+            "keyptr");
+    };
+
+    // an empty slot ends the probe with a miss
+    Builder.SetInsertPoint(ProbeBB);
+    llvm::PHINode *Slot = Builder.CreatePHI(I64, 2, "slot");
+    llvm::PHINode *Probe = Builder.CreatePHI(I64, 2, "probe");
+    Slot->addIncoming(Home, EntryBB);
+    Probe->addIncoming(Builder.getInt64(0), EntryBB);
+    llvm::Value *Entry = GetEntry(Slot);
+    llvm::Value *Full = Builder.CreateLoad(
+        Builder.getInt1Ty(), Builder.CreateStructGEP(EntryTy, Entry, 2),
+        "full");
+    Builder.CreateCondBr(Full, CompareBB, MissBB);
+
+    Builder.SetInsertPoint(CompareBB);
+    llvm::Value *Match = Builder.getTrue();
+    for (unsigned i = 0, e = Keys.size(); i != e; ++i) {
+        llvm::Value *Key = Builder.CreateLoad(I64, GetKey(Entry, i), "key");
+        Match = Builder.CreateAnd(Match, Builder.CreateICmpEQ(Key, Keys[i]),
+                                  "match");
+    }
+    Builder.CreateCondBr(Match, HitBB, NextBB);
+
+    Builder.SetInsertPoint(HitBB);
+    incrementCounter(Hits);
+    Builder.CreateRet(Builder.CreateLoad(
+        ResultTy, Builder.CreateStructGEP(EntryTy, Entry, 1), "result"));
+
+    // after MemoProbes full slots the miss takes the first one
+    Builder.SetInsertPoint(NextBB);
+    llvm::Value *NextProbe = Builder.CreateAdd(Probe, Builder.getInt64(1));
+    llvm::Value *NextSlot = Builder.CreateAnd(
+        Builder.CreateAdd(Slot, Builder.getInt64(1)), MemoSlots - 1);
+    Slot->addIncoming(NextSlot, NextBB);
+    Probe->addIncoming(NextProbe, NextBB);
+    Builder.CreateCondBr(
+        Builder.CreateICmpULT(NextProbe, Builder.getInt64(MemoProbes)),
+        ProbeBB, MissBB);
+
+    // evaluate, then fill the slot. the evaluation may have filled it
+    // already, with the same result
+    Builder.SetInsertPoint(MissBB);
+    llvm::PHINode *Free = Builder.CreatePHI(I64, 2, "free");
+    Free->addIncoming(Slot, ProbeBB);
+    Free->addIncoming(Home, NextBB);
+    incrementCounter(Misses);
+    llvm::Value *Result = createCall(Eval, Args, "result");
+    Entry = GetEntry(Free);
+    for (unsigned i = 0, e = Keys.size(); i != e; ++i)
+        Builder.CreateStore(Keys[i], GetKey(Entry, i));
+    Builder.CreateStore(Result, Builder.CreateStructGEP(EntryTy, Entry, 1));
+    Builder.CreateStore(Builder.getTrue(),
+                        Builder.CreateStructGEP(EntryTy, Entry, 2));
+    Builder.CreateRet(Result);
+    return Eval;
+}
+
+#ifdef KINIT_JIT
+// printMemoStats - the hit and miss counts of the memoized functions
+static void printMemoStats() {
+    for (SymbolId Name : MemoFunctions) {
+        std::string Base = getSymbolName(Name).str();
+        auto Hits = TheJIT->findSymbol(Base + ".memo.hits");
+        auto Misses = TheJIT->findSymbol(Base + ".memo.misses");
+        if (!Hits or !Misses)
+            continue;
+        fprintf(stderr, "memo %s: %lld hits, %lld misses\n", Base.c_str(),
+                (long long)*(int64_t*)cantFail(Hits.getAddress()),
+                (long long)*(int64_t*)cantFail(Misses.getAddress()));
+    }
+}
+#endif
+
+// emitEntryPoint - the C entry point of a function, calling its body.
+// Entry is its declaration by an extern, if there was one
+static void emitEntryPoint(PrototypeAST const& P, llvm::Function *Body,
+                           llvm::Function *Entry) {
+    if (!Entry)
+        Entry = llvm::Function::Create(Body->getFunctionType(),
+                                       llvm::Function::ExternalLinkage,
+                                       getSymbolName(P.getName()),
+                                       TheModule.get());
+
+    std::vector<llvm::Value*> Args;
+    unsigned Idx = 0;
+    for (auto &Arg : Entry->args()) {
+        Arg.setName(getSymbolName(P.getArgs()[Idx++]));
+        Args.push_back(&Arg);
+    }
+
+    Builder.SetInsertPoint(
+        llvm::BasicBlock::Create(TheContext, "entry", Entry));
+    llvm::CallInst *Call = createCall(Body, Args, "body");
+    Call->setTailCall();
+    Builder.CreateRet(Call);
+}
+
+// loadTier0Value - the Value at index I of Values as a Ty: the bits of a
+// double, an i64, or an i1 as 0 or 1
+static llvm::Value *loadTier0Value(llvm::Value *Values, unsigned I,
+                                   llvm::Type *Ty) {
+    llvm::Type *I64 = Builder.getInt64Ty();
+    llvm::Value *Bits =
+        Builder.CreateLoad(I64, Builder.CreateConstGEP1_32(I64, Values, I));
+    return Ty->isDoubleTy() ? Builder.CreateBitCast(Bits, Ty)
+                            : Builder.CreateTrunc(Bits, Ty);
+}
+
+// storeTier0Value - stores V as the Value at index I of Values
+static void storeTier0Value(llvm::Value *V, llvm::Value *Values, unsigned I) {
+    llvm::Type *I64 = Builder.getInt64Ty();
+    V = V->getType()->isDoubleTy() ? Builder.CreateBitCast(V, I64)
+                                   : Builder.CreateZExt(V, I64);
+    Builder.CreateStore(V, Builder.CreateConstGEP1_32(I64, Values, I));
+}
+
+// emitTier0Entry - f.tier0, the entry point tier 0 calls a compiled function
+// through, see NativeEntry in interp.h. the function takes and returns
+// scalars
+static void emitTier0Entry(PrototypeAST const& P, llvm::Function *Body) {
+    llvm::Type *I64 = Builder.getInt64Ty();
+    llvm::Type *PtrTy = I64->getPointerTo();
+    auto *FT = llvm::FunctionType::get(Builder.getVoidTy(), {PtrTy, PtrTy},
+                                       false);
+    auto *Entry = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+                                         getSymbolName(P.getName()) + ".tier0",
+                                         TheModule.get());
+    llvm::Value *Args = &*Entry->arg_begin();
+    llvm::Value *Result = &*std::next(Entry->arg_begin());
+    Builder.SetInsertPoint(
+        llvm::BasicBlock::Create(TheContext, "entry", Entry));
+
+    std::vector<llvm::Value*> ArgsV;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i)
+        ArgsV.push_back(loadTier0Value(Args, i, getLLVMType(P.getArgType(i))));
+    storeTier0Value(createCall(Body, ArgsV, "body"), Result, 0);
+    Builder.CreateRetVoid();
+}
+
+llvm::Function *FunctionAST::emit() {
+    auto &P = *Proto;
+
+    // an extern of it in this module declared the entry point, the body is
+    // a function of its own
+    llvm::Function *TheFunction = ModuleFunctions.lookup(P.getName());
+    if (!TheFunction or
+        TheFunction->getCallingConv() != llvm::CallingConv::Fast)
+        TheFunction = P.codegen();
+
+    llvm::Function *Entry = TheModule->getFunction(getSymbolName(P.getName()));
+    if (!TheFunction->empty() or (Entry and !Entry->empty()))
         return (llvm::Function*)LogErrorV("function can not be redefined.");
 
-    // if this is an opaertor, insatll it
-    if (P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    // an extern of it in this module may have declared other types
+    if (TheFunction->getFunctionType() != getFunctionType(P) or
+        (Entry and Entry->getFunctionType() != getFunctionType(P)))
+        return (llvm::Function*)LogErrorV("function redefined with different types");
 
     // create a new basic block to start insertion into
     llvm::BasicBlock *BB = llvm::BasicBlock::Create(TheContext, "entry", TheFunction);
     Builder.SetInsertPoint(BB);
+    setFastMath(TheFunction, TheOptions.FastMath or P.hasFlag(PF_FastMath));
 
     // record the function arguments in the NamedValues map
     NamedValues.clear();
+    ArrayLengths.clear();
+    unsigned Idx = 0;
     for (auto &Arg : TheFunction->args()) {
         // create an alloca for this variable
-        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(),
+                                                          Arg.getType());
 
         // store the initial value into the alloca
         Builder.CreateStore(&Arg, Alloca);
 
         // add arguments to variable symbol table
-        NamedValues[Arg.getName()] = Alloca;
+        if (isArrayType(P.getArgType(Idx)))
+            ArrayLengths[P.getArgs()[Idx]] =
+                TheFunction->arg_begin() + P.getArrayLength(Idx);
+        NamedValues.bind(P.getArgs()[Idx++], Alloca);
     }
 
-    if (llvm::Value *RetVal = Body->codegen()) {
-        // finish off the function
-        Builder.CreateRet(RetVal);
-
+    if (ExprCodegen(Pool).codegenReturn(Body)) {
         // validate the generated code ,checking for consistency
         llvm::verifyFunction(*TheFunction);
 
+        if (Memoize)
+            TheFPM->run(*emitMemoTable(P, TheFunction));
+
         // run the optimization passes
         TheFPM->run(*TheFunction);
 
+        if (Entry)
+            redirectCalls(Entry, TheFunction);
+        emitEntryPoint(P, TheFunction, Entry);
+        if (TheOptions.Tiered and isScalarPrototype(P))
+            emitTier0Entry(P, TheFunction);
         return TheFunction;
     }
 
     // error reading body remove function
+    ModuleFunctions[P.getName()] = nullptr;
     TheFunction->eraseFromParent();
     return nullptr;
 }
 
+llvm::Function *FunctionAST::codegen() {
+    return check() ? emit() : nullptr;
+}
+
+//
+// target selection
+//
+
+// getTargetCPU - the -mcpu name, native is the cpu we are running on
+static std::string getTargetCPU() {
+    if (TheOptions.CPU == "native")
+        return llvm::sys::getHostCPUName().str();
+    return TheOptions.CPU;
+}
+
+// getTargetOptions - the options code is generated with. a fastcc call in
+// tail position is always a tail call, like with llc -tailcallopt
+static llvm::TargetOptions getTargetOptions() {
+    llvm::TargetOptions Options;
+    Options.GuaranteedTailCallOpt = true;
+    return Options;
+}
+
+// getTargetFeatures - the -mattr features, native is the features of the
+// cpu we are running on
+static std::string getTargetFeatures() {
+    if (TheOptions.Features != "native")
+        return TheOptions.Features;
+
+    llvm::SubtargetFeatures Features;
+    llvm::StringMap<bool> HostFeatures;
+    if (llvm::sys::getHostCPUFeatures(HostFeatures))
+        for (auto &F : HostFeatures)
+            Features.AddFeature(F.first(), F.second);
+    return Features.getString();
+}
+
 //
 // optimization passes
 //
+
+static llvm::CodeGenOpt::Level getCodeGenOptLevel() {
+    switch (TheOptions.OptLevel) {
+    case 0:
+        return llvm::CodeGenOpt::None;
+    case 1:
+        return llvm::CodeGenOpt::Less;
+    case 2:
+        return llvm::CodeGenOpt::Default;
+    default:
+        return llvm::CodeGenOpt::Aggressive;
+    }
+}
+
+// populatePassManagerBuilder - LLVM's standard pipelines for -O<OptLevel>, with
+// the inliner, loop unrolling and both vectorizers from -O2 on
+static void populatePassManagerBuilder(llvm::PassManagerBuilder &PMB) {
+    unsigned OptLevel = TheOptions.OptLevel;
+    PMB.OptLevel = OptLevel;
+    PMB.SizeLevel = 0;
+    PMB.LibraryInfo = new llvm::TargetLibraryInfoImpl(
+        TheTargetMachine->getTargetTriple());
+    if (OptLevel > 1)
+        PMB.Inliner = llvm::createFunctionInliningPass(OptLevel, 0, false);
+    PMB.DisableUnrollLoops = OptLevel == 0;
+    PMB.LoopVectorize = OptLevel > 1;
+    PMB.SLPVectorize = OptLevel > 1;
+    TheTargetMachine->adjustPassManager(PMB);
+}
+
+// addModulePasses - the module pipeline, run once a module is complete
+static void addModulePasses(llvm::legacy::PassManager &MPM) {
+    MPM.add(llvm::createTargetTransformInfoWrapperPass(
+        TheTargetMachine->getTargetIRAnalysis()));
+
+    llvm::PassManagerBuilder PMB;
+    populatePassManagerBuilder(PMB);
+    PMB.populateModulePassManager(MPM);
+}
+
+static void optimizeModule(llvm::Module &M) {
+    llvm::legacy::PassManager MPM;
+    addModulePasses(MPM);
+    MPM.run(M);
+}
+
 void InitializeModuleAndPassManager(void) {
     // open a new module
     TheModule = std::make_unique<llvm::Module>("my cool jit", TheContext);
-#ifdef KINIT_JIT
-    TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+    ModuleFunctions.clear();
+    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
 
-    // create a new pass manager attached to itc
+    // create a new pass manager attached to it, it cleans up each function
+    // as it is emitted, the module pipeline does the rest
     TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-    
-    // promote allocas to registers
-    TheFPM->add(createPromoteMemoryToRegisterPass());
+    TheFPM->add(llvm::createTargetTransformInfoWrapperPass(
+        TheTargetMachine->getTargetIRAnalysis()));
+
+    llvm::PassManagerBuilder PMB;
+    populatePassManagerBuilder(PMB);
+    PMB.populateFunctionPassManager(*TheFPM);
+
+    TheFPM->doInitialization();
+}
+
+#ifdef KINIT_JIT
+//
+// tiered execution - with -tiered a definition tier 0 can run is not
+// compiled when it is read, the interpreter (interp.h) runs it until it
+// gets hot. it is then emitted on the main thread, together with the
+// interpreted functions it calls, and handed over as bitcode to a thread
+// that optimizes and compiles it in a context of its own. the main thread
+// adds the code to the jit at the next call tier 0 makes, in the order the
+// functions got hot. a loop that got hot is compiled the same way, as a
+// function finishing it (see emitLoopEntry). a definition tier 0 can not
+// run is compiled like without -tiered, together with the interpreted
+// functions it calls
+//
+static Interpreter TheInterpreter(TheSymbols);
+
+// isTier0Extern - whether tier 0 calls the C function P declares itself:
+// it takes up to four doubles and returns one
+static bool isTier0Extern(PrototypeAST const& P) {
+    if (P.getArgs().size() > 4 or P.getReturnType() != ValueType::Double)
+        return false;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i)
+        if (P.getArgType(i) != ValueType::Double)
+            return false;
+    return true;
+}
 
+// emitLoopEntry - Name, the rest of hot loop Loop of F, see LoopEntry in
+// interp.h. the variables in scope are loaded from the frame and stored
+// back after the loop
+static bool emitLoopEntry(Tier0Function const& F, unsigned Loop,
+                          std::string const& Name) {
+    auto &L = F.Loops[Loop];
+    auto *FT = llvm::FunctionType::get(
+        Builder.getVoidTy(), {Builder.getInt64Ty()->getPointerTo()}, false);
+    auto *Fn = llvm::Function::Create(FT, llvm::Function::ExternalLinkage,
+                                      Name, TheModule.get());
+    llvm::Value *Frame = &*Fn->arg_begin();
+    Builder.SetInsertPoint(llvm::BasicBlock::Create(TheContext, "entry", Fn));
+    setFastMath(Fn, TheOptions.FastMath or
+                        F.Proto.hasFlag(PF_FastMath));
 
-    // simple "peephole" optimizations and bit-twiddling opts
-    TheFPM->add(createInstructionCombiningPass());
+    NamedValues.clear();
+    ArrayLengths.clear();
+    std::vector<llvm::AllocaInst*> Allocas;
+    for (auto &V : L.Scope) {
+        llvm::Type *Ty = getLLVMType(F.SlotTypes[V.second]);
+        llvm::AllocaInst *Alloca =
+            CreateEntryBlockAlloca(Fn, getSymbolName(V.first), Ty);
+        Builder.CreateStore(loadTier0Value(Frame, V.second, Ty), Alloca);
+        NamedValues.bind(V.first, Alloca);
+        Allocas.push_back(Alloca);
+    }
 
-    // reassociate exprs
-    TheFPM->add(createReassociatePass());
+    if (!ExprCodegen(F.AST->getPool()).codegenResume(L.Loop, Allocas.back())) {
+        Fn->eraseFromParent();
+        return false;
+    }
+    for (size_t i = 0, e = L.Scope.size(); i != e; ++i)
+        storeTier0Value(Builder.CreateLoad(Allocas[i]->getAllocatedType(),
+                                           Allocas[i]),
+                        Frame, L.Scope[i].second);
+    Builder.CreateRetVoid();
+
+    llvm::verifyFunction(*Fn);
+    TheFPM->run(*Fn);
+    return true;
+}
 
-    // eliminate common sub exprs
-    TheFPM->add(createGVNPass());
+// isTier0Candidate - whether tier 0 may run a checked function, if it can:
+// not one that is memoized, and not with fast-math, which leaves the
+// results of floating point to the compiled code
+static bool isTier0Candidate(FunctionAST const& F) {
+    return !F.isMemoized() and !TheOptions.FastMath and
+           !F.getProto().hasFlag(PF_FastMath);
+}
 
-    // simplify control flow graph (deleting unreachable blocks)
-    TheFPM->add(createCFGSimplificationPass());
+// TierUpCompiler - how tier 0 gets native code
+class TierUpCompiler : public Interpreter::TierUp {
+    // TierUpJob - functions that got hot, as bitcode, and the object code
+    // the thread made of them
+    struct TierUpJob {
+        std::vector<Tier0Function*> Functions;
+        Tier0Function::HotLoop *Loop = nullptr;
+        std::string LoopName;
+        llvm::SmallVector<char, 0> Bitcode;
+        KaleidoscopeJIT::ObjectPtr Object;
+    };
+
+    std::thread Thread;
+    std::unique_ptr<llvm::TargetMachine> Machine;
+
+    // the jobs waiting for the thread and the ones it is done with. InFlight
+    // counts all of them that were not installed yet
+    std::mutex Mutex;
+    std::condition_variable Wakeup, Done;
+    std::deque<std::unique_ptr<TierUpJob>> Queue, Ready;
+    size_t InFlight = 0;
+    bool Stopping = false;
+
+    unsigned NumPromoted = 0;
+    unsigned NumCompiledNow = 0;
+    unsigned NumLoops = 0;
+
+    void collect(Tier0Function *F, std::vector<Tier0Function*> &Fns);
+    void collectCallees(ExprPool const& Pool, std::vector<Tier0Function*> &Fns);
+    bool emitFunctions(std::vector<Tier0Function*> const& Fns);
+    bool compileFunctions(std::vector<Tier0Function*> const& Fns);
+    void submit(std::unique_ptr<TierUpJob> Job, bool Emitted);
+    void run();
+
+public:
+    void promote(Tier0Function &F) override;
+    void promoteLoop(Tier0Function &F, unsigned Loop) override;
+    bool compileNow(Tier0Function &F) override;
+    void installReady() override;
+    bool link(Tier0Function &F) override;
+
+    // drain - waits for the thread to finish the jobs it has and installs
+    // them
+    void drain();
+
+    // compileCallees - compiles the interpreted functions the code in Pools
+    // calls, before that is compiled itself
+    void compileCallees(std::vector<ExprPool const*> const& Pools);
+
+    // stop - lets the thread go, dropping what it did not compile yet
+    void stop();
+
+    unsigned getNumPromoted() const { return NumPromoted; }
+    unsigned getNumCompiledNow() const { return NumCompiledNow; }
+    unsigned getNumLoops() const { return NumLoops; }
+};
+
+static TierUpCompiler TheTierUp;
+
+// collect - F, if it is interpreted, and the interpreted functions it
+// calls, each once
+void TierUpCompiler::collect(Tier0Function *F,
+                             std::vector<Tier0Function*> &Fns) {
+    if (!F or F->State != Tier0Function::Interpreted or
+        std::find(Fns.begin(), Fns.end(), F) != Fns.end())
+        return;
+    Fns.push_back(F);
+    collectCallees(F->AST->getPool(), Fns);
+}
 
-    TheFPM->doInitialization();
+void TierUpCompiler::collectCallees(ExprPool const& Pool,
+                                    std::vector<Tier0Function*> &Fns) {
+    Interpreter::forEachCallee(TheSymbols, Pool, [&](SymbolId Name) {
+        collect(TheInterpreter.getFunction(Name), Fns);
+    });
+}
+
+// emitFunctions - Fns in a new module, they are Queued from now on
+bool TierUpCompiler::emitFunctions(std::vector<Tier0Function*> const& Fns) {
+    InitializeModuleAndPassManager();
+    for (auto *F : Fns) {
+        F->State = Tier0Function::Queued;
+        if (!F->AST->emit())
+            return false;
+    }
+    return true;
+}
+
+void TierUpCompiler::promote(Tier0Function &F) {
+    auto Job = std::make_unique<TierUpJob>();
+    collect(&F, Job->Functions);
+    NumPromoted += Job->Functions.size();
+    bool Ok = emitFunctions(Job->Functions);
+    submit(std::move(Job), Ok);
+}
+
+// promoteLoop - the rest of the loop comes with the interpreted functions
+// F calls, and F itself unless it is a top-level expression
+void TierUpCompiler::promoteLoop(Tier0Function &F, unsigned Loop) {
+    auto Job = std::make_unique<TierUpJob>();
+    if (TheInterpreter.getFunction(F.Proto.getName()) == &F)
+        collect(&F, Job->Functions);
+    collectCallees(F.AST->getPool(), Job->Functions);
+    NumPromoted += Job->Functions.size();
+    Job->Loop = &F.Loops[Loop];
+    Job->LoopName = getSymbolName(F.Proto.getName()).str() + ".loop" +
+                    std::to_string(NumLoops++);
+    bool Ok = emitFunctions(Job->Functions) and
+              emitLoopEntry(F, Loop, Job->LoopName);
+    submit(std::move(Job), Ok);
+}
+
+// submit - hands the module a job was emitted into to the thread. what
+// failed to emit stays interpreted
+void TierUpCompiler::submit(std::unique_ptr<TierUpJob> Job, bool Emitted) {
+    if (Emitted) {
+        llvm::raw_svector_ostream OS(Job->Bitcode);
+        llvm::WriteBitcodeToFile(TheModule.get(), OS);
+    }
+    InitializeModuleAndPassManager();
+    if (!Emitted) {
+        for (auto *Fn : Job->Functions)
+            Fn->State = Tier0Function::Interpreted;
+        return;
+    }
+
+    if (!Thread.joinable()) {
+        Machine = TheJIT->createTargetMachine();
+        Machine->setOptLevel(getCodeGenOptLevel());
+        Thread = std::thread([this] { run(); });
+    }
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Queue.push_back(std::move(Job));
+    ++InFlight;
+    Wakeup.notify_one();
+}
+
+// run - the thread: reads the bitcode of a job into its context, optimizes
+// and compiles it
+void TierUpCompiler::run() {
+    TheTargetMachine = Machine.get();
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (1) {
+        Wakeup.wait(Lock, [this] { return Stopping or !Queue.empty(); });
+        if (Stopping)
+            return;
+        auto Job = std::move(Queue.front());
+        Queue.pop_front();
+        Lock.unlock();
+
+        llvm::MemoryBufferRef Buffer(
+            llvm::StringRef(Job->Bitcode.data(), Job->Bitcode.size()),
+            "tier-up");
+        if (auto M = llvm::parseBitcodeFile(Buffer, TheContext)) {
+            optimizeModule(**M);
+            Job->Object = TheJIT->compile(*TheTargetMachine, **M);
+        } else {
+            llvm::consumeError(M.takeError());
+        }
+
+        Lock.lock();
+        Ready.push_back(std::move(Job));
+        Done.notify_all();
+        TheInterpreter.notifyNativeReady();
+    }
+}
+
+void TierUpCompiler::installReady() {
+    std::deque<std::unique_ptr<TierUpJob>> Jobs;
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Jobs.swap(Ready);
+        InFlight -= Jobs.size();
+    }
+    for (auto &Job : Jobs) {
+        bool Compiled = bool(Job->Object);
+        if (Compiled)
+            TheJIT->addObject(std::move(Job->Object));
+        for (auto *F : Job->Functions)
+            F->State = Compiled ? Tier0Function::Compiled
+                                : Tier0Function::Interpreted;
+        if (Compiled and Job->Loop)
+            if (auto Sym = TheJIT->findSymbol(Job->LoopName))
+                Job->Loop->Native =
+                    (LoopEntry)(intptr_t)cantFail(Sym.getAddress());
+    }
+}
+
+void TierUpCompiler::drain() {
+    {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        Done.wait(Lock, [this] { return Ready.size() == InFlight; });
+    }
+    installReady();
+}
+
+// compileFunctions - compiles Fns on the main thread, for code that calls
+// them now
+bool TierUpCompiler::compileFunctions(std::vector<Tier0Function*> const& Fns) {
+    if (Fns.empty())
+        return true;
+
+    KaleidoscopeJIT::ObjectPtr Object;
+    if (emitFunctions(Fns)) {
+        optimizeModule(*TheModule);
+        Object = TheJIT->compile(*TheTargetMachine, *TheModule);
+    }
+    InitializeModuleAndPassManager();
+
+    if (!Object) {
+        for (auto *F : Fns)
+            F->State = Tier0Function::Interpreted;
+        return false;
+    }
+    TheJIT->addObject(std::move(Object));
+    for (auto *F : Fns)
+        F->State = Tier0Function::Compiled;
+    NumCompiledNow += Fns.size();
+    return true;
+}
+
+// compileNow - a function tier 0 would recurse too deep into. code being
+// compiled in the background is added first, it may call that
+bool TierUpCompiler::compileNow(Tier0Function &F) {
+    drain();
+    std::vector<Tier0Function*> Fns;
+    collect(&F, Fns);
+    if (compileFunctions(Fns))
+        return true;
+    LogError("could not compile a function tier 0 recursed too deep into");
+    return false;
+}
+
+void TierUpCompiler::compileCallees(
+    std::vector<ExprPool const*> const& Pools) {
+    std::vector<Tier0Function*> Fns;
+    for (auto *Pool : Pools)
+        collectCallees(*Pool, Fns);
+    if (Fns.empty())
+        return;
+    drain();
+    compileFunctions(Fns);
+}
+
+bool TierUpCompiler::link(Tier0Function &F) {
+    auto Sym = TheJIT->findSymbol(getSymbolName(F.Proto.getName()).str() +
+                                  ".tier0");
+    if (!Sym)
+        return false;
+    F.Native = (NativeEntry)(intptr_t)cantFail(Sym.getAddress());
+    return true;
+}
+
+void TierUpCompiler::stop() {
+    if (!Thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Stopping = true;
+        Wakeup.notify_one();
+    }
+    Thread.join();
+}
+
+// evaluateTier0 - checks a top-level expression and evaluates it if tier 0
+// can run it. false if it is left to compile, after what it calls
+static bool evaluateTier0(std::unique_ptr<FunctionAST> &FnAST) {
+    if (!FnAST->check())
+        return true;
+    auto Expr = isTier0Candidate(*FnAST)
+                    ? TheInterpreter.prepare(FnAST, FunctionProtos)
+                    : nullptr;
+    if (Expr) {
+        double Result;
+        if (TheInterpreter.run(std::move(Expr), Result))
+            fprintf(stderr, "evaluated to %f\n", Result);
+        return true;
+    }
+    TheTierUp.compileCallees({&FnAST->getPool()});
+    return false;
+}
+
+// printTierStats - what ran in which tier
+static void printTierStats() {
+    fprintf(stderr, "tiers: %llu calls interpreted, %u functions and %u "
+            "loops compiled in the background, %u functions on demand\n",
+            (unsigned long long)TheInterpreter.getNumCalls(),
+            TheTierUp.getNumPromoted(), TheTierUp.getNumLoops(),
+            TheTierUp.getNumCompiledNow());
+}
 #endif
+
+#ifdef KINIT_JIT
+//
+// parallel compilation - unless -lazy, the jit checks a definition when it
+// is read, in the order of the source, and keeps it pending until something
+// may call it: a top-level expression, an extern, a redefinition or the end
+// of the input. the pending definitions are then compiled together, by up
+// to -j threads that each emit, optimize and compile definitions in a
+// context of their own, and the object code is added to the jit in source
+// order
+//
+static std::vector<std::unique_ptr<FunctionAST>> PendingDefinitions;
+
+// the pending definitions by name
+static SymbolIdMap<FunctionAST*> PendingNames;
+
+// the target machines of the worker threads, one each
+static std::vector<std::unique_ptr<llvm::TargetMachine>> WorkerMachines;
+
+// CompiledDefinition - what a worker made of a definition: its IR as text,
+// for the log, and its object code, none if emitting it failed
+struct CompiledDefinition {
+    std::string IR;
+    KaleidoscopeJIT::ObjectPtr Object;
+};
+
+// compileDefinition - emits a definition into a module of its own,
+// optimizes the module as a whole and compiles it
+static CompiledDefinition compileDefinition(FunctionAST &FnAST) {
+    CompiledDefinition Result;
+    InitializeModuleAndPassManager();
+    if (auto *FnIR = FnAST.emit()) {
+        optimizeModule(*TheModule);
+        llvm::raw_string_ostream OS(Result.IR);
+        FnIR->print(OS);
+        OS.flush();
+        Result.Object = TheJIT->compile(*TheTargetMachine, *TheModule);
+    }
+
+    // the module goes before the context of the thread does
+    TheFPM.reset();
+    TheModule.reset();
+    return Result;
+}
+
+// compileDefinitions - compiles the pending definitions and adds them to
+// the jit
+static void compileDefinitions() {
+    size_t N = PendingDefinitions.size();
+    if (N == 0)
+        return;
+
+    if (TheOptions.Tiered) {
+        std::vector<ExprPool const*> Pools;
+        for (auto &FnAST : PendingDefinitions)
+            Pools.push_back(&FnAST->getPool());
+        TheTierUp.compileCallees(Pools);
+    }
+
+    unsigned NumThreads = TheOptions.Threads;
+    if (NumThreads == 0)
+        NumThreads = std::max(1u, std::thread::hardware_concurrency());
+    NumThreads = std::min<size_t>(NumThreads, N);
+    while (WorkerMachines.size() < NumThreads) {
+        WorkerMachines.push_back(TheJIT->createTargetMachine());
+        WorkerMachines.back()->setOptLevel(getCodeGenOptLevel());
+    }
+
+    std::vector<CompiledDefinition> Results(N);
+    std::atomic<size_t> Next(0);
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i != NumThreads; ++i)
+        Workers.emplace_back([&, i] {
+            TheTargetMachine = WorkerMachines[i].get();
+            for (size_t j; (j = Next++) < N;)
+                Results[j] = compileDefinition(*PendingDefinitions[j]);
+        });
+    for (auto &W : Workers)
+        W.join();
+
+    for (auto &R : Results) {
+        if (!R.Object)
+            continue;
+        fprintf(stderr, "Read function definition:%s\n", R.IR.c_str());
+        TheJIT->addObject(std::move(R.Object));
+    }
+    PendingDefinitions.clear();
+    PendingNames.clear();
 }
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
+// takesWideVectors - whether F gets a vector wider than 128 bits in a
+// register. the jit's lazy compile callback only saves the xmm halves of
+// the argument registers, the first call through a stub would lose the
+// upper lanes
+static bool takesWideVectors(llvm::Function const& F) {
+    for (auto &Arg : F.args())
+        if (Arg.getType()->isVectorTy() and
+            Arg.getType()->getPrimitiveSizeInBits() > 128)
+            return true;
+    return false;
+}
+
+//
+// top-level expressions - one that folded to a literal is not compiled, its
+// value is the result. the others are emitted into the current module and,
+// unless the input is interactive, kept pending with it until anything but
+// a top-level expression is read or MaxPendingExpressions are. the module
+// is then compiled once and the expressions are called in source order, so
+// the errors of a later expression show before the results of earlier ones
+// like they do for pending definitions. -tiered evaluates each expression
+// on its own, tier 0 is the cheap path there
+//
+struct PendingExpression {
+    llvm::Function *Body; // the body emitted, none for a literal
+    double Value;         // the literal
+};
+static std::vector<PendingExpression> PendingExpressions;
+
+static constexpr size_t MaxPendingExpressions = 256;
+
+// getExpressionName - the name of the I-th pending expression, reused once
+// its module is gone
+static std::string getExpressionName(size_t I) {
+    return I == 0 ? "__anon_expr" : "__anon_expr." + std::to_string(I);
+}
+
+// evaluateExpressions - compiles the pending expressions and prints their
+// results
+static void evaluateExpressions() {
+    size_t N = PendingExpressions.size();
+    if (N == 0)
+        return;
+
+    // the IR as text, the module goes to the jit before the results are
+    // printed
+    std::vector<std::string> IR(N);
+    llvm::Optional<KaleidoscopeJIT::ModuleHandleT> H;
+    if (std::any_of(PendingExpressions.begin(), PendingExpressions.end(),
+                    [](PendingExpression const& E) { return E.Body; })) {
+        optimizeModule(*TheModule);
+        for (size_t i = 0; i != N; ++i) {
+            if (!PendingExpressions[i].Body)
+                continue;
+            llvm::raw_string_ostream OS(IR[i]);
+            PendingExpressions[i].Body->print(OS);
+        }
+
+        // jit the module containing the anonymous exprs, keeping a handle
+        // to free it later
+        H = TheJIT->addModule(std::move(TheModule));
+        InitializeModuleAndPassManager();
+    }
+
+    for (size_t i = 0; i != N; ++i) {
+        double Result = PendingExpressions[i].Value;
+        if (PendingExpressions[i].Body) {
+            fprintf(stderr, "read top-level expresssion: %s\n", IR[i].c_str());
+
+            // search the jit for the symbol of the expression
+            auto ExprSymbol = TheJIT->findSymbol(getExpressionName(i));
+            assert(ExprSymbol && "function not found");
+
+            // get the symbol's address and cast it to the right type
+            double (*FP)() =
+                (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
+            Result = FP();
+        }
+        fprintf(stderr, "evaluated to %f\n", Result);
+    }
+
+    if (H)
+        TheJIT->removeModule(*H);
+    PendingExpressions.clear();
+}
+#endif
+
+static void HandleDefinition(Parser &P) {
+#ifdef KINIT_JIT
+    // the pending expressions call what is defined so far
+    evaluateExpressions();
+#endif
+    if (auto FnAST = P.ParseDefinition()) {
+        // if this is an operator, install it before codegen so that a later
+        // use of it parses with the right precedence
+        auto &Proto = FnAST->getProto();
+        if (Proto.isBinaryOp())
+            P.setBinopPrecedence(Proto.getOperatorName(),
+                                 Proto.getBinaryPrecedence());
+
+#ifdef KINIT_JIT
+        // -lazy: the module is only optimized and compiled when one of its
+        // functions is first called, all that is left to do now is emit it.
+        // one taking wide vectors is compiled right away
+        if (TheOptions.Lazy) {
+            if (auto *FnIR = FnAST->codegen()) {
+                TheEvaluator.addFunction(Proto, FnAST->getPool(),
+                                         FnAST->getBody());
+
+                fprintf(stderr, "Read function definition:");
+                FnIR->print(llvm::errs());
+                fprintf(stderr, "\n");
+                if (takesWideVectors(*FnIR)) {
+                    optimizeModule(*TheModule);
+                    TheJIT->addModule(std::move(TheModule));
+                } else {
+                    TheJIT->addLazyModule(std::move(TheModule));
+                }
+                InitializeModuleAndPassManager();
+            }
+            return;
+        }
+
+        // the pending calls of a function were checked against the
+        // prototype a redefinition replaces. so was the code being compiled
+        // in the background
+        if (PendingNames.lookup(Proto.getName()))
+            compileDefinitions();
+        if (auto *F = TheInterpreter.getFunction(Proto.getName()))
+            if (F->State == Tier0Function::Queued)
+                TheTierUp.drain();
+
+        if (FnAST->check()) {
+            // keep the body of a pure function, later calls of it with
+            // literal arguments are evaluated at compile time
+            TheEvaluator.addFunction(Proto, FnAST->getPool(), FnAST->getBody());
+
+            // -tiered: tier 0 takes what it can run, it has to be compiled
+            // otherwise
+            if (TheOptions.Tiered) {
+                auto F = isTier0Candidate(*FnAST)
+                             ? TheInterpreter.prepare(FnAST, FunctionProtos)
+                             : nullptr;
+                if (F) {
+                    fprintf(stderr, "Read function definition: %s (tier 0)\n",
+                            getSymbolName(F->Proto.getName()).str().c_str());
+                    TheInterpreter.addFunction(std::move(F));
+                    return;
+                }
+                TheInterpreter.addCompiled(Proto);
+            }
+            PendingNames[Proto.getName()] = FnAST.get();
+            PendingDefinitions.push_back(std::move(FnAST));
+        }
+#else
         if (auto *FnIR = FnAST->codegen()) {
+            TheEvaluator.addFunction(Proto, FnAST->getPool(), FnAST->getBody());
+
             fprintf(stderr, "Read function definition:");
             FnIR->print(llvm::errs());
             fprintf(stderr, "\n");
-#ifdef KINIT_JIT
-            TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPassManager();
-#else
-            return;
-#endif
         }
+#endif
     } else {
         // skip token for error recovery
-        getNextToken();
+        P.getNextToken();
     }
 }
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
+static void HandleExtern(Parser &P) {
+    if (auto ProtoAST = P.ParseExtern()) {
+#ifdef KINIT_JIT
+        evaluateExpressions();
+        compileDefinitions();
+
+        // the process has every C function an extern can name, anything
+        // else is a kaleidoscope function, defined before or after. calls
+        // of it call its body, so mutual recursion through the extern
+        // stays a chain of tail calls
+        void *Address = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+            getSymbolName(ProtoAST->getName()).str());
+        if (!Address)
+            ProtoAST->clearFlag(PF_Extern);
+        else if (TheOptions.Tiered and isTier0Extern(*ProtoAST))
+            TheInterpreter.addExtern(*ProtoAST, Address);
+#endif
         if (auto *FnIR = ProtoAST->codegen()) {
             fprintf(stderr, "read extern: ");
             FnIR->print(llvm::errs());
@@ -497,60 +2205,79 @@ static void HandleExtern() {
         }
     } else {
         // skip token for error recovery
-        getNextToken();
+        P.getNextToken();
     }
 }
 
-static void HandleTopLevelExpression() {
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (auto *FnIR = FnAST->codegen()) {
-#ifdef KINIT_JIT  
-            fprintf(stderr, "read top-level expresssion: ");
-            FnIR->print(llvm::errs());
-            fprintf(stderr, "\n");
-
-            // jit the module containing the anonymous expr, 
-            // keeping a handle to free it later
-            auto H = TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPassManager();
-
-            // search the jit for __anon_expr symbol
-            auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-            assert(ExprSymbol && "function not found");
-
-            // get the symbol's address and cast it to the right type
-            double (*FP)() = (double (*)())(intptr_t)cantFail(ExprSymbol.getAddress());
-            fprintf(stderr, "evaluated to %f\n", FP());
-
-            TheJIT->removeModule(H);
+static void HandleTopLevelExpression(Parser &P) {
+#ifdef KINIT_JIT
+    // the expressions compiled together need names of their own
+    auto FnAST = P.ParseTopLevelExpr(getExpressionName(PendingExpressions.size()));
 #else
-            return;
+    auto FnAST = P.ParseTopLevelExpr();
 #endif
-        }
-    } else {
+    if (!FnAST) {
         // skip token for error recovery
-        getNextToken();
+        P.getNextToken();
+        return;
+    }
+
+#ifdef KINIT_JIT
+    compileDefinitions();
+    if (TheOptions.Tiered) {
+        if (evaluateTier0(FnAST))
+            return;
+        if (auto *FnIR = FnAST->emit()) {
+            PendingExpressions.push_back({FnIR, 0});
+            evaluateExpressions();
+        }
+        return;
     }
+
+    if (!FnAST->check())
+        return;
+    auto &Pool = FnAST->getPool();
+    if (Pool.getKind(FnAST->getBody()) == ExprKind::Number)
+        PendingExpressions.push_back(
+            {nullptr, Pool.getNumber(FnAST->getBody()).Val});
+    else if (auto *FnIR = FnAST->emit())
+        PendingExpressions.push_back({FnIR, 0});
+
+    // someone at a terminal is waiting on the result
+    if (P.isInteractive() or PendingExpressions.size() == MaxPendingExpressions)
+        evaluateExpressions();
+#else
+    FnAST->codegen();
+#endif
 }
 
 // top ::= definition | external | expression | ';'
-static  void MainLoop() {
+static  void MainLoop(Parser &P) {
     while (1) {
         fprintf(stderr, "ready> ");
-        switch (CurTok) {
+        switch (P.getCurTok()) {
         case tok_eof:
+#ifdef KINIT_JIT
+            evaluateExpressions();
+            compileDefinitions();
+            if (TheOptions.Tiered) {
+                TheTierUp.stop();
+                printTierStats();
+            }
+            printMemoStats();
+#endif
             return;
         case ';':
-            getNextToken();
+            P.getNextToken();
             break;
         case tok_def:
-            HandleDefinition();
+            HandleDefinition(P);
             break;
         case tok_extern:
-            HandleExtern();
+            HandleExtern(P);
             break;
         default:
-            HandleTopLevelExpression();
+            HandleTopLevelExpression(P);
             break;
         }
     }
@@ -0,0 +1,303 @@
+#ifndef consteval_h
+#define consteval_h
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "interner.h"
+#include "symtab.h"
+
+//
+// ConstEvaluator - runs pure user functions at compile time. a function is
+// pure when it only calls pure functions, operators and math builtins,
+// itself included, so it has no effect but its result (all variables are
+// local). externs like printd are never pure. a call to a pure function
+// with literal arguments can then be replaced by the literal it returns
+//
+// the evaluator keeps a copy of the body of every pure function defined so
+// far. evaluation is bounded, a call that recurses too deep or runs too
+// long is left to run at runtime
+//
+// values of every type are held in a double: a bool is 0 or 1, an int is
+// exact as long as it stays below 2^53, and evaluation gives up on an int
+// that does not, as it would no longer wrap like the i64 it stands for.
+// vectors are not held at all, evaluation gives up on them too
+//
+class ConstEvaluator {
+    static constexpr unsigned MaxDepth = 256;
+    static constexpr uint64_t MaxSteps = 1 << 20;
+
+    struct PureFunction {
+        std::vector<SymbolId> Params;
+        ExprPool Pool;
+        ExprId Body;
+    };
+
+    StringInterner &Symbols;
+    SymbolIdMap<std::unique_ptr<PureFunction>> Functions;
+
+    // the variables of the running calls, innermost last. a call only sees
+    // the variables from its FrameBase on
+    std::vector<std::pair<SymbolId, double>> Env;
+    size_t FrameBase = 0;
+    unsigned Depth = 0;
+    uint64_t Steps = 0;
+
+    bool isPureCallee(SymbolId Callee, unsigned NumArgs, SymbolId Self) const {
+        if (Callee == Self)
+            return true;
+        auto &F = Functions.lookup(Callee);
+        return F and F->Params.size() == NumArgs;
+    }
+
+    bool isPureBody(ExprPool const& Pool, SymbolId Self);
+
+    double *lookup(SymbolId Name) {
+        for (size_t i = Env.size(); i != FrameBase; --i)
+            if (Env[i - 1].first == Name)
+                return &Env[i - 1].second;
+        return nullptr;
+    }
+
+    bool call(SymbolId Callee, double const* Args, unsigned NumArgs,
+              double &Result);
+    bool eval(ExprPool const& Pool, ExprId E, double &Result);
+    bool evalNode(ExprPool const& Pool, ExprId E, double &Result);
+
+public:
+    explicit ConstEvaluator(StringInterner &Symbols) : Symbols(Symbols) {}
+
+    // isPure - whether a body calls nothing but pure functions and Self
+    bool isPure(ExprPool const& Pool, SymbolId Self) {
+        return isPureBody(Pool, Self);
+    }
+
+    // addFunction - records a function that was just defined, if it is pure.
+    // the body of an earlier definition of it is forgotten either way
+    void addFunction(PrototypeAST const& Proto, ExprPool const& Pool,
+                     ExprId Body);
+
+    // removeFunction - forgets the body of a function being redefined
+    void removeFunction(SymbolId Name) { Functions[Name].reset(); }
+
+    // evaluate - runs a pure function on literal arguments, returns false if
+    // Callee is not pure or the evaluation gave up
+    bool evaluate(SymbolId Callee, double const* Args, unsigned NumArgs,
+                  double &Result) {
+        if (!isPureCallee(Callee, NumArgs, ~0u))
+            return false;
+        Steps = 0;
+        return call(Callee, Args, NumArgs, Result);
+    }
+
+    // evaluateOperator - like evaluate, for a user defined operator
+    bool evaluateOperator(bool IsBinary, char Op, double const* Args,
+                          double &Result) {
+        return evaluate(Symbols.internOperator(IsBinary, Op), Args,
+                        IsBinary ? 2 : 1, Result);
+    }
+};
+
+inline bool ConstEvaluator::isPureBody(ExprPool const& Pool, SymbolId Self) {
+    for (uint32_t i = 0, e = Pool.size(); i != e; ++i) {
+        ExprId E(i);
+        switch (Pool.getKind(E)) {
+        case ExprKind::Call: {
+            CallExprAST C = Pool.getCall(E);
+            if (C.BuiltinFn != Builtin::None)
+                break;
+            if (!isPureCallee(C.Callee, C.NumArgs, Self))
+                return false;
+            break;
+        }
+        case ExprKind::Unary: {
+            SymbolId Callee = Symbols.internOperator(false, Pool.getUnary(E).Opcode);
+            if (!isPureCallee(Callee, 1, Self))
+                return false;
+            break;
+        }
+        case ExprKind::Binary: {
+            char Op = Pool.getBinary(E).Op;
+            if (Op == '=' or Op == '+' or Op == '-' or Op == '*' or Op == '<')
+                break;
+            if (!isPureCallee(Symbols.internOperator(true, Op), 2, Self))
+                return false;
+            break;
+        }
+        case ExprKind::Subscript:
+            // memory is only known when the function runs
+            return false;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+inline void ConstEvaluator::addFunction(PrototypeAST const& Proto,
+                                        ExprPool const& Pool, ExprId Body) {
+    removeFunction(Proto.getName());
+    if (!isPureBody(Pool, Proto.getName()))
+        return;
+    Functions[Proto.getName()].reset(
+        new PureFunction{Proto.getArgs(), Pool, Body});
+}
+
+inline bool ConstEvaluator::call(SymbolId Callee, double const* Args,
+                                 unsigned NumArgs, double &Result) {
+    PureFunction const* F = Functions.lookup(Callee).get();
+    if (!F or F->Params.size() != NumArgs or Depth == MaxDepth)
+        return false;
+
+    // the arguments are the first variables of the new frame
+    size_t OldBase = FrameBase;
+    size_t NewBase = Env.size();
+    for (unsigned i = 0; i != NumArgs; ++i)
+        Env.emplace_back(F->Params[i], Args[i]);
+
+    FrameBase = NewBase;
+    ++Depth;
+    bool Ok = eval(F->Pool, F->Body, Result);
+    --Depth;
+    FrameBase = OldBase;
+    Env.resize(NewBase);
+    return Ok;
+}
+
+inline bool ConstEvaluator::eval(ExprPool const& Pool, ExprId E,
+                                 double &Result) {
+    if (++Steps > MaxSteps or isVectorType(Pool.getType(E)) or
+        !evalNode(Pool, E, Result))
+        return false;
+    return Pool.getType(E) != ValueType::Int or std::fabs(Result) < 0x1p53;
+}
+
+inline bool ConstEvaluator::evalNode(ExprPool const& Pool, ExprId E,
+                                     double &Result) {
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number:
+        Result = Pool.getNumber(E).Val;
+        return true;
+
+    case ExprKind::Variable: {
+        double *V = lookup(Pool.getVariable(E).Name);
+        if (!V)
+            return false;
+        Result = *V;
+        return true;
+    }
+
+    case ExprKind::Unary: {
+        UnaryExprAST U = Pool.getUnary(E);
+        double Operand;
+        if (!eval(Pool, U.Operand, Operand))
+            return false;
+        return call(Symbols.internOperator(false, U.Opcode), &Operand, 1,
+                    Result);
+    }
+
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (B.Op == '=') {
+            if (Pool.getKind(B.LHS) != ExprKind::Variable)
+                return false;
+            double *V = lookup(Pool.getVariable(B.LHS).Name);
+            if (!V or !eval(Pool, B.RHS, Result))
+                return false;
+            *V = Result;
+            return true;
+        }
+
+        double Ops[2];
+        if (!eval(Pool, B.LHS, Ops[0]) or !eval(Pool, B.RHS, Ops[1]))
+            return false;
+        switch (B.Op) {
+        case '+':
+            Result = Ops[0] + Ops[1];
+            return true;
+        case '-':
+            Result = Ops[0] - Ops[1];
+            return true;
+        case '*':
+            Result = Ops[0] * Ops[1];
+            return true;
+        case '<':
+            Result = !(Ops[0] >= Ops[1]) ? 1.0 : 0.0;
+            return true;
+        default:
+            return call(Symbols.internOperator(true, B.Op), Ops, 2, Result);
+        }
+    }
+
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        std::vector<double> Args(C.NumArgs);
+        for (unsigned i = 0; i != C.NumArgs; ++i)
+            if (!eval(Pool, C.getArg(i), Args[i]))
+                return false;
+        if (C.BuiltinFn != Builtin::None)
+            return evaluateBuiltin(C.BuiltinFn, Args.data(), Result);
+        return call(C.Callee, Args.data(), C.NumArgs, Result);
+    }
+
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        double Cond;
+        if (!eval(Pool, If.Cond, Cond))
+            return false;
+        return eval(Pool, isTrue(Cond) ? If.Then : If.Else, Result);
+    }
+
+    case ExprKind::For: {
+        // same order as the emitted loop: body, step, end condition, then
+        // the increment of the (possibly reassigned) loop variable
+        ForExprAST F = Pool.getFor(E);
+        double Start;
+        if (!eval(Pool, F.Start, Start))
+            return false;
+
+        size_t Scope = Env.size();
+        Env.emplace_back(F.VarName, Start);
+        while (1) {
+            double Body, Step = 1.0, End;
+            if (!eval(Pool, F.Body, Body) or
+                (F.Step and !eval(Pool, F.Step, Step)) or
+                !eval(Pool, F.End, End)) {
+                Env.resize(Scope);
+                return false;
+            }
+            Env[Scope].second += Step;
+            if (!isTrue(End))
+                break;
+        }
+        Env.resize(Scope);
+        Result = 0.0;
+        return true;
+    }
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        size_t Scope = Env.size();
+        bool Ok = true;
+        for (unsigned i = 0; Ok and i != V.NumVars; ++i) {
+            double Init = 0.0;
+            if (V.getVar(i).Init)
+                Ok = eval(Pool, V.getVar(i).Init, Init);
+            Env.emplace_back(V.getVar(i).Name, Init);
+        }
+        Ok = Ok and eval(Pool, V.Body, Result);
+        Env.resize(Scope);
+        return Ok;
+    }
+
+    case ExprKind::Subscript:
+        return false;
+    }
+    return false;
+}
+
+#endif // consteval_h
@@ -26,6 +26,17 @@ extern "C" DLLEXPORT double printd(double X) {
 }
 
 int main(int argc, char **argv) {
+    if (!parseCommandLine(argc, argv, TheOptions))
+        return 1;
+    if (!TheOptions.Clones.empty()) {
+        fprintf(stderr, "-mclones is only supported for object output\n");
+        return 1;
+    }
+    if (TheOptions.Lazy and TheOptions.Tiered) {
+        fprintf(stderr, "-lazy and -tiered can not be combined\n");
+        return 1;
+    }
+
     //
     // native stuff
     //
@@ -36,27 +47,42 @@ int main(int argc, char **argv) {
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
 
-    // 
-    // install binary ops precedence
     //
-    BinopPrecedence['='] = 2;
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 30;
-    BinopPrecedence['*'] = 40;
+    // read the source from the file named on the command line, or from stdin
+    //
+    auto Source = TheOptions.InputFile ? SourceBuffer::getFile(TheOptions.InputFile)
+                                       : SourceBuffer::getSTDIN();
+    if (!Source) {
+        fprintf(stderr, "could not read %s\n",
+                TheOptions.InputFile ? TheOptions.InputFile : "stdin");
+        return 1;
+    }
+    Parser P(*Source, TheSymbols);
 
 #ifdef KINIT_DEBUG
     std::cout << "setup the term and get the next token" << std::endl;
 #endif
     fprintf(stderr, "ready> ");
-    getNextToken();
+    P.getNextToken();
 
     // make the module, which holds all the code
 //    TheModule = std::make_unique<llvm::Module>("my cool jit", TheContext);
 #ifdef KINIT_DEBUG
     std::cout << "initializing the jit" << std::endl;
 #endif
-    TheJIT = std::make_unique<KaleidoscopeJIT>();
+    TheJIT = std::make_unique<KaleidoscopeJIT>(
+        getTargetCPU(), llvm::SubtargetFeatures(getTargetFeatures()).getFeatures(),
+        getTargetOptions());
+    TheTargetMachine = &TheJIT->getTargetMachine();
+    TheTargetMachine->setOptLevel(getCodeGenOptLevel());
+    if (TheOptions.Lazy)
+        TheJIT->setOptimizer([](llvm::Module &M) { optimizeModule(M); });
+    if (TheOptions.Tiered)
+        TheInterpreter.setTierUp(&TheTierUp);
+    if (!TheOptions.CacheDir.empty() and
+        !TheJIT->openObjectCache(TheOptions.CacheDir, TheOptions.CacheSize))
+        fprintf(stderr, "could not open the object cache %s\n",
+                TheOptions.CacheDir.c_str());
 
 #ifdef KINIT_DEBUG
     std::cout << "initialize module and pass manager" << std::endl;
@@ -67,7 +93,16 @@ int main(int argc, char **argv) {
 #ifdef KINIT_DEBUG
     std::cout << "start main loop" << std::endl;
 #endif
-    MainLoop();
+    MainLoop(P);
+
+    // the objects used least recently go if the cache grew too big
+    auto &Cache = TheJIT->getObjectCache();
+    if (Cache.isOpen()) {
+        Cache.prune();
+        fprintf(stderr, "object cache: %u hits, %u misses, %u objects, "
+                "%llu bytes\n", Cache.getHits(), Cache.getMisses(),
+                Cache.getNumFiles(), (unsigned long long)Cache.getSize());
+    }
 
     // dump the codegen stuff
  //   TheModule->print(llvm::errs(), nullptr);
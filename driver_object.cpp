@@ -2,6 +2,7 @@
 
 #include "parser.h"
 #include "codegen.h"
+#include "multiversion.h"
 
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
@@ -26,34 +27,35 @@ extern "C" DLLEXPORT double printd(double X) {
 }
 
 int main(int argc, char **argv) {
-    // 
-    // install binary ops precedence
-    //
-    BinopPrecedence['='] = 2;
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 30;
-    BinopPrecedence['*'] = 40;
-
-#ifdef KINIT_DEBUG
-    std::cout << "setup the term and get the next token" << std::endl;
-#endif
-    fprintf(stderr, "ready> ");
-    getNextToken();
+    if (!parseCommandLine(argc, argv, TheOptions))
+        return 1;
+    if (TheOptions.Lazy) {
+        fprintf(stderr, "-lazy is only supported by the jit\n");
+        return 1;
+    }
+    if (TheOptions.Tiered) {
+        fprintf(stderr, "-tiered is only supported by the jit\n");
+        return 1;
+    }
+    if (!TheOptions.CacheDir.empty()) {
+        fprintf(stderr, "-cache-dir is only supported by the jit\n");
+        return 1;
+    }
 
-#ifdef KINIT_DEBUG
-    std::cout << "initialize module and pass manager" << std::endl;
-#endif
-    InitializeModuleAndPassManager(); 
-    
-    // run the main interpreter
-#ifdef KINIT_DEBUG
-    std::cout << "start main loop" << std::endl;
-#endif
-    MainLoop();
+    //
+    // read the source from the file named on the command line, or from stdin
+    //
+    auto Source = TheOptions.InputFile ? SourceBuffer::getFile(TheOptions.InputFile)
+                                       : SourceBuffer::getSTDIN();
+    if (!Source) {
+        fprintf(stderr, "could not read %s\n",
+                TheOptions.InputFile ? TheOptions.InputFile : "stdin");
+        return 1;
+    }
+    Parser P(*Source, TheSymbols);
 
     //
-    // native stuff
+    // native stuff, the target machine is needed by the pass managers
     //
 #ifdef KINIT_DEBUG
     std::cout << "initialize various native targets" << std::endl;
@@ -65,7 +67,6 @@ int main(int argc, char **argv) {
     InitializeAllAsmPrinters();
 
     auto TargetTriple = llvm::sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
 
     std::string Error;
     auto Target = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
@@ -78,15 +79,42 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    auto CPU = "generic";
-    auto Features = "";
+    // -mcpu/-mattr, the host cpu unless told otherwise
+    std::string CPU = getTargetCPU();
+    std::string Features = getTargetFeatures();
 
     // 
-    llvm::TargetOptions opt;
+    llvm::TargetOptions opt = getTargetOptions();
     auto RM = llvm::Optional<Reloc::Model>();
-    auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt,
-                                                        RM);
-    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    std::unique_ptr<llvm::TargetMachine> TM(
+        Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM,
+                                    llvm::None, getCodeGenOptLevel()));
+    TheTargetMachine = TM.get();
+
+#ifdef KINIT_DEBUG
+    std::cout << "setup the term and get the next token" << std::endl;
+#endif
+    fprintf(stderr, "ready> ");
+    P.getNextToken();
+
+#ifdef KINIT_DEBUG
+    std::cout << "initialize module and pass manager" << std::endl;
+#endif
+    InitializeModuleAndPassManager(); 
+    
+    // run the main interpreter
+#ifdef KINIT_DEBUG
+    std::cout << "start main loop" << std::endl;
+#endif
+    MainLoop(P);
+
+    // -mclones, cpu specialized copies of every function and a dispatcher
+    if (!TheOptions.Clones.empty() and
+        !emitFunctionClones(*TheModule, *Target, CPU, Features,
+                            TheOptions.Clones, Error)) {
+        errs() << Error << "\n";
+        return 1;
+    }
 
     auto Filename = "output.o";
     std::error_code EC;
@@ -97,8 +125,9 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    //
+    // the module pipeline, then code generation
     llvm::legacy::PassManager pass;
+    addModulePasses(pass);
     auto FileType = TargetMachine::CGFT_ObjectFile;
     if (TheTargetMachine->addPassesToEmitFile(pass, dest, FileType)) {
         errs() << "TheTargetMachine can not emit a file of this type";
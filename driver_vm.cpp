@@ -0,0 +1,69 @@
+#include <iostream>
+
+#include "parser.h"
+#include "vm.h"
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+    fputc((char)X, stderr);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (!parseCommandLine(argc, argv, TheOptions))
+        return 1;
+
+    // the options of the code generator, -O, -ffast-math and -mcpu among
+    // them, mean nothing to the vm and are ignored
+    if (!TheOptions.Clones.empty()) {
+        fprintf(stderr, "-mclones is only supported for object output\n");
+        return 1;
+    }
+    if (TheOptions.Lazy) {
+        fprintf(stderr, "-lazy is only supported by the jit\n");
+        return 1;
+    }
+    if (TheOptions.Tiered) {
+        fprintf(stderr, "-tiered is only supported by the jit\n");
+        return 1;
+    }
+    if (!TheOptions.CacheDir.empty()) {
+        fprintf(stderr, "-cache-dir is only supported by the jit\n");
+        return 1;
+    }
+
+    //
+    // read the source from the file named on the command line, or from stdin
+    //
+    auto Source = TheOptions.InputFile ? SourceBuffer::getFile(TheOptions.InputFile)
+                                       : SourceBuffer::getSTDIN();
+    if (!Source) {
+        fprintf(stderr, "could not read %s\n",
+                TheOptions.InputFile ? TheOptions.InputFile : "stdin");
+        return 1;
+    }
+    Parser P(*Source, TheSymbols);
+
+    fprintf(stderr, "ready> ");
+    P.getNextToken();
+
+    // run the main interpreter
+    MainLoop(P);
+    return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef fold_h
+#define fold_h
+
+#include <cmath>
+#include <vector>
+
+#include "ast.h"
+#include "consteval.h"
+
+//
+// ExprFolder - folds the constant parts of a function body before any IR
+// is emitted for it. builtin operators on literals become literals, an if
+// with a literal condition becomes the branch it takes, and identities like
+// x*1 and x-0 drop the operation. math builtins on literals are evaluated,
+// with the libm the compiler runs on like LLVM's own constant folding.
+// given a ConstEvaluator, calls of pure functions and operators on literals
+// become the literal they return. only rewrites that give bit for bit the
+// same result as the emitted code are done
+//
+// folding runs after type inference and never changes the type of an
+// expression: a node is only replaced by a child of the same type, and an
+// int is only folded while a double holds it exactly
+//
+// children precede their parents in the pool, so one forward walk folds
+// everything: when a node is visited its children are folded already
+//
+class ExprFolder {
+    ExprPool &Pool;
+    ConstEvaluator *Eval;
+
+    // Folded[i] - what node i was folded into, itself or one of its
+    // descendants, so ids stay smaller than those of their parents
+    std::vector<ExprId> Folded;
+
+    bool getConstant(ExprId E, double &Val) const {
+        if (Pool.getKind(E) != ExprKind::Number)
+            return false;
+        Val = Pool.getNumber(E).Val;
+        return true;
+    }
+
+    // replace - what E folds into when it is the same as Child
+    ExprId replace(ExprId E, ExprId Child) const {
+        return Pool.getType(E) == Pool.getType(Child) ? Child : E;
+    }
+
+    // setConstant - turns E into the literal Val, if its type can hold it
+    void setConstant(ExprId E, double Val) {
+        if (Pool.getType(E) != ValueType::Int or std::fabs(Val) < 0x1p53)
+            Pool.setNumber(E, Val);
+    }
+
+    // scratch space for the arguments of a call
+    std::vector<double> Args;
+
+    ExprId foldUnary(ExprId E);
+    ExprId foldBinary(ExprId E);
+    ExprId foldCall(ExprId E);
+    ExprId foldIf(ExprId E);
+    ExprId foldVar(ExprId E);
+
+public:
+    explicit ExprFolder(ExprPool &Pool, ConstEvaluator *Eval = nullptr)
+        : Pool(Pool), Eval(Eval) {}
+
+    // fold - folds the whole pool, returns what Root was folded into
+    ExprId fold(ExprId Root);
+};
+
+inline ExprId ExprFolder::fold(ExprId Root) {
+    Folded.resize(Pool.size());
+    for (uint32_t i = 0, e = Pool.size(); i != e; ++i) {
+        ExprId E(i);
+        Pool.mapChildren(E, [&](ExprId C) { return Folded[C.getIndex()]; });
+
+        switch (Pool.getKind(E)) {
+        case ExprKind::Unary:
+            Folded[i] = foldUnary(E);
+            break;
+        case ExprKind::Binary:
+            Folded[i] = foldBinary(E);
+            break;
+        case ExprKind::Call:
+            Folded[i] = foldCall(E);
+            break;
+        case ExprKind::If:
+            Folded[i] = foldIf(E);
+            break;
+        case ExprKind::Var:
+            Folded[i] = foldVar(E);
+            break;
+        default:
+            Folded[i] = E;
+            break;
+        }
+    }
+    return Folded[Root.getIndex()];
+}
+
+inline ExprId ExprFolder::foldUnary(ExprId E) {
+    UnaryExprAST U = Pool.getUnary(E);
+    double Operand, Result;
+    if (Eval and getConstant(U.Operand, Operand) and
+        Eval->evaluateOperator(false, U.Opcode, &Operand, Result))
+        setConstant(E, Result);
+    return E;
+}
+
+inline ExprId ExprFolder::foldBinary(ExprId E) {
+    BinaryExprAST B = Pool.getBinary(E);
+    double L = 0, R = 0;
+    bool LConst = getConstant(B.LHS, L);
+    bool RConst = getConstant(B.RHS, R);
+
+    if (LConst and RConst) {
+        switch (B.Op) {
+        case '+':
+            setConstant(E, L + R);
+            return E;
+        case '-':
+            setConstant(E, L - R);
+            return E;
+        case '*':
+            setConstant(E, L * R);
+            return E;
+        case '<':
+            // fcmp ult, true when unordered
+            setConstant(E, !(L >= R) ? 1.0 : 0.0);
+            return E;
+        case '=':
+            return E;
+        default: {
+            // a user defined operator
+            double Ops[2] = {L, R}, Result;
+            if (Eval and Eval->evaluateOperator(true, B.Op, Ops, Result))
+                setConstant(E, Result);
+            return E;
+        }
+        }
+    }
+
+    // identities, x+0 is not one of them since -0+0 is +0
+    if (B.Op == '*' and RConst and R == 1.0)
+        return replace(E, B.LHS);
+    if (B.Op == '*' and LConst and L == 1.0)
+        return replace(E, B.RHS);
+    if (B.Op == '-' and RConst and R == 0.0 and !std::signbit(R))
+        return replace(E, B.LHS);
+    return E;
+}
+
+inline ExprId ExprFolder::foldCall(ExprId E) {
+    CallExprAST C = Pool.getCall(E);
+    if (!Eval and C.BuiltinFn == Builtin::None)
+        return E;
+
+    Args.resize(C.NumArgs);
+    for (unsigned i = 0; i != C.NumArgs; ++i)
+        if (!getConstant(C.getArg(i), Args[i]))
+            return E;
+
+    double Result;
+    if (C.BuiltinFn != Builtin::None) {
+        if (evaluateBuiltin(C.BuiltinFn, Args.data(), Result))
+            setConstant(E, Result);
+    } else if (Eval->evaluate(C.Callee, Args.data(), C.NumArgs, Result)) {
+        setConstant(E, Result);
+    }
+    return E;
+}
+
+inline ExprId ExprFolder::foldIf(ExprId E) {
+    IfExprAST If = Pool.getIf(E);
+    double Cond;
+    if (!getConstant(If.Cond, Cond))
+        return E;
+    return replace(E, isTrue(Cond) ? If.Then : If.Else);
+}
+
+inline ExprId ExprFolder::foldVar(ExprId E) {
+    // var a = 1 in 2 is 2, as long as no initializer can have an effect
+    VarExprAST V = Pool.getVar(E);
+    if (Pool.getKind(V.Body) != ExprKind::Number)
+        return E;
+    for (unsigned i = 0; i != V.NumVars; ++i) {
+        ExprId Init = V.getVar(i).Init;
+        if (Init and Pool.getKind(Init) != ExprKind::Number)
+            return E;
+    }
+    return replace(E, V.Body);
+}
+
+inline void FunctionAST::foldConstants(ConstEvaluator *Eval) {
+    Body = ExprFolder(Pool, Eval).fold(Body);
+}
+
+#endif // fold_h
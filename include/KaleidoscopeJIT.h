@@ -14,14 +14,19 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "ObjectFileCache.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
@@ -30,7 +35,9 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <functional>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -42,29 +49,95 @@ public:
   using ObjLayerT = RTDyldObjectLinkingLayer;
   using CompileLayerT = IRCompileLayer<ObjLayerT, SimpleCompiler>;
   using ModuleHandleT = CompileLayerT::ModuleHandleT;
-
-  KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+  using ObjectPtr = ObjLayerT::ObjectPtr;
+
+  // lazily compiled modules get stubs for their functions, the first call
+  // of one optimizes and compiles the whole module
+  using OptimizeFunction =
+      std::function<std::shared_ptr<Module>(std::shared_ptr<Module>)>;
+  using OptimizeLayerT = IRTransformLayer<CompileLayerT, OptimizeFunction>;
+  using LazyLayerT = CompileOnDemandLayer<OptimizeLayerT>;
+  using LazyHandleT = LazyLayerT::ModuleHandleT;
+
+  // CPU and Attrs select the host sub-target code is generated for, the
+  // generic one when they are empty
+  KaleidoscopeJIT(StringRef CPU = "",
+                  const std::vector<std::string> &Attrs = {},
+                  const TargetOptions &Options = TargetOptions())
+      : CPU(CPU), Attrs(Attrs), Options(Options),
+        TM(createTargetMachine()),
+        DL(TM->createDataLayout()),
         ObjectLayer([]() { return std::make_shared<SectionMemoryManager>(); }),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+        CompileLayer(ObjectLayer, SimpleCompiler(*TM, &Cache)),
+        OptimizeLayer(CompileLayer,
+                      [this](std::shared_ptr<Module> M) {
+                        if (Optimize)
+                          Optimize(*M);
+                        return M;
+                      }),
+        CompileCallbackManager(
+            orc::createLocalCompileCallbackManager(TM->getTargetTriple(), 0)),
+        LazyLayer(OptimizeLayer, partitionModule, *CompileCallbackManager,
+                  orc::createLocalIndirectStubsManagerBuilder(
+                      TM->getTargetTriple())) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  // createTargetMachine - a target machine like the JIT's own, for
+  // compiling modules on another thread
+  std::unique_ptr<TargetMachine> createTargetMachine() {
+    return std::unique_ptr<TargetMachine>(EngineBuilder()
+                                              .setMCPU(CPU)
+                                              .setMAttrs(Attrs)
+                                              .setTargetOptions(Options)
+                                              .selectTarget());
+  }
+
+  // compile - the object code of M, which addObject takes
+  ObjectPtr compile(TargetMachine &TM, Module &M) {
+    return std::make_shared<object::OwningBinary<object::ObjectFile>>(
+        SimpleCompiler(TM, &Cache)(M));
+  }
+
+  // openObjectCache - keeps the objects compiled from now on in Dir and
+  // loads them from there when the same code is compiled again. the
+  // target machine has to be set up by now, its options are part of the
+  // key
+  bool openObjectCache(StringRef Dir, uint64_t MaxSize) {
+    std::string Config;
+    raw_string_ostream OS(Config);
+    OS << "llvm " << LLVM_VERSION_STRING << ", "
+       << TM->getTargetTriple().str() << ", " << TM->getTargetCPU() << ", "
+       << TM->getTargetFeatureString() << ", -O" << int(TM->getOptLevel());
+    return Cache.open(Dir, MaxSize, OS.str());
+  }
+
+  ObjectFileCache &getObjectCache() { return Cache; }
+
   ModuleHandleT addModule(std::unique_ptr<Module> M) {
-    // We need a memory manager to allocate memory and resolve symbols for this
-    // new module. Create one that resolves symbols by looking back into the
-    // JIT.
-    auto Resolver = createLambdaResolver(
-        [&](const std::string &Name) {
-          if (auto Sym = findMangledSymbol(Name))
-            return Sym;
-          return JITSymbol(nullptr);
-        },
-        [](const std::string &S) { return nullptr; });
     auto H = cantFail(CompileLayer.addModule(std::move(M),
-                                             std::move(Resolver)));
+                                             createResolver()));
+
+    ModuleHandles.push_back(H);
+    return H;
+  }
+
+  // setOptimizer - what a lazily compiled module goes through before it is
+  // compiled
+  void setOptimizer(std::function<void(Module &)> F) { Optimize = std::move(F); }
+
+  LazyHandleT addLazyModule(std::unique_ptr<Module> M) {
+    auto H = cantFail(LazyLayer.addModule(std::move(M), createResolver()));
+
+    LazyHandles.push_back(H);
+    return H;
+  }
+
+  ModuleHandleT addObject(ObjectPtr Obj) {
+    auto H = cantFail(ObjectLayer.addObject(std::move(Obj),
+                                            createResolver()));
 
     ModuleHandles.push_back(H);
     return H;
@@ -80,6 +153,28 @@ public:
   }
 
 private:
+  // a module is compiled as a whole, with all the functions defined in it
+  static std::set<Function *> partitionModule(Function &F) {
+    std::set<Function *> Partition;
+    for (auto &G : *F.getParent())
+      if (!G.isDeclaration())
+        Partition.insert(&G);
+    return Partition;
+  }
+
+  // We need a memory manager to allocate memory and resolve symbols for a
+  // new module. Create one that resolves symbols by looking back into the
+  // JIT.
+  std::shared_ptr<JITSymbolResolver> createResolver() {
+    return createLambdaResolver(
+        [&](const std::string &Name) {
+          if (auto Sym = findMangledSymbol(Name))
+            return Sym;
+          return JITSymbol(nullptr);
+        },
+        [](const std::string &S) { return nullptr; });
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -109,6 +204,9 @@ private:
     for (auto H : make_range(ModuleHandles.rbegin(), ModuleHandles.rend()))
       if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
         return Sym;
+    for (auto H : make_range(LazyHandles.rbegin(), LazyHandles.rend()))
+      if (auto Sym = LazyLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+        return Sym;
 
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
@@ -127,11 +225,20 @@ private:
     return nullptr;
   }
 
+  std::string CPU;
+  std::vector<std::string> Attrs;
+  TargetOptions Options;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  ObjectFileCache Cache;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
+  OptimizeLayerT OptimizeLayer;
+  std::unique_ptr<JITCompileCallbackManager> CompileCallbackManager;
+  LazyLayerT LazyLayer;
+  std::function<void(Module &)> Optimize;
   std::vector<ModuleHandleT> ModuleHandles;
+  std::vector<LazyHandleT> LazyHandles;
 };
 
 } // end namespace orc
@@ -0,0 +1,199 @@
+//===- ObjectFileCache.h - An on-disk object cache for the JIT ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Keeps the object code the JIT compiles in a directory, so a later run
+// compiling the same optimized IR for the same target loads it instead.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_OBJECTFILECACHE_H
+#define LLVM_EXECUTIONENGINE_ORC_OBJECTFILECACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/raw_sha1_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+// An object is stored under the SHA-1 of the module's IR, taken before it
+// is compiled, and of a configuration string naming everything else the
+// code depends on: the LLVM version, the target and the codegen options.
+// A hit marks the file as used now, prune removes the files used least
+// recently until the directory fits its size.
+class ObjectFileCache : public ObjectCache {
+public:
+  // open - keeps objects in Dir, creating it if need be. false if that
+  // failed, the cache then stays closed and never hits
+  bool open(StringRef Dir, uint64_t MaxSize, StringRef Config) {
+    if (sys::fs::create_directories(Dir))
+      return false;
+    this->Dir = Dir.str();
+    this->MaxSize = MaxSize;
+    this->Config = Config.str();
+    return true;
+  }
+
+  bool isOpen() const { return !Dir.empty(); }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    if (!isOpen())
+      return nullptr;
+
+    std::string Path = getPath(*M);
+    if (auto Obj = load(Path)) {
+      ++Hits;
+      return Obj;
+    }
+
+    // codegen changes the module, the path has to be taken now
+    ++Misses;
+    std::lock_guard<std::mutex> Lock(PendingMutex);
+    Pending[M] = std::move(Path);
+    return nullptr;
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    std::string Path;
+    {
+      std::lock_guard<std::mutex> Lock(PendingMutex);
+      auto I = Pending.find(M);
+      if (I == Pending.end())
+        return;
+      Path = std::move(I->second);
+      Pending.erase(I);
+    }
+
+    // another thread or process may store the same object, each writes a
+    // file of its own and renames it into place
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TempPath))
+      return;
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Obj.getBuffer();
+    OS.close();
+    if (OS.has_error() || sys::fs::rename(TempPath, Path)) {
+      OS.clear_error();
+      sys::fs::remove(TempPath);
+    }
+  }
+
+  // prune - removes the objects used least recently until the ones left
+  // take up MaxSize bytes at most
+  void prune() {
+    if (!isOpen())
+      return;
+
+    struct Entry {
+      std::string Path;
+      uint64_t Size;
+      sys::TimePoint<> Used;
+    };
+    std::vector<Entry> Entries;
+    Size = 0;
+    std::error_code EC;
+    for (sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+         I.increment(EC)) {
+      sys::fs::file_status Status;
+      if (sys::path::extension(I->path()) != ".o" ||
+          sys::fs::status(I->path(), Status))
+        continue;
+      Entries.push_back({I->path(), Status.getSize(),
+                         Status.getLastModificationTime()});
+      Size += Status.getSize();
+    }
+
+    std::sort(Entries.begin(), Entries.end(),
+              [](const Entry &A, const Entry &B) { return A.Used < B.Used; });
+    NumFiles = Entries.size();
+    for (auto &E : Entries) {
+      if (Size <= MaxSize)
+        break;
+      if (sys::fs::remove(E.Path))
+        continue;
+      Size -= E.Size;
+      --NumFiles;
+    }
+  }
+
+  unsigned getHits() const { return Hits; }
+  unsigned getMisses() const { return Misses; }
+
+  // the bytes and files in the cache, as of the last prune
+  uint64_t getSize() const { return Size; }
+  unsigned getNumFiles() const { return NumFiles; }
+
+private:
+  std::string getPath(const Module &M) const {
+    raw_sha1_ostream Hash;
+    Hash << Config << '\0';
+    M.print(Hash, nullptr);
+
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, toHex(Hash.sha1()) + ".o");
+    return Path.str().str();
+  }
+
+  // load - the object stored at Path, if there is a valid one. the file is
+  // marked as used now
+  static std::unique_ptr<MemoryBuffer> load(const std::string &Path) {
+    int FD;
+    if (sys::fs::openFileForRead(Path, FD))
+      return nullptr;
+    auto Buffer = MemoryBuffer::getOpenFile(FD, Path, -1, false);
+    sys::fs::setLastModificationAndAccessTime(
+        FD, std::chrono::system_clock::now());
+    sys::Process::SafelyCloseFileDescriptor(FD);
+    if (!Buffer)
+      return nullptr;
+
+    auto Obj =
+        object::ObjectFile::createObjectFile((*Buffer)->getMemBufferRef());
+    if (!Obj) {
+      consumeError(Obj.takeError());
+      sys::fs::remove(Path);
+      return nullptr;
+    }
+    return std::move(*Buffer);
+  }
+
+  std::string Dir;
+  uint64_t MaxSize = 0;
+  std::string Config;
+
+  std::atomic<unsigned> Hits{0};
+  std::atomic<unsigned> Misses{0};
+  uint64_t Size = 0;
+  unsigned NumFiles = 0;
+
+  // the paths of the modules that missed, until they are compiled
+  std::mutex PendingMutex;
+  DenseMap<const Module *, std::string> Pending;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_OBJECTFILECACHE_H
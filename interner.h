@@ -0,0 +1,65 @@
+#ifndef interner_h
+#define interner_h
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "arena.h"
+
+// SymbolId - an interned name, equal names always get the same id
+using SymbolId = uint32_t;
+
+//
+// StringInterner - maps names to dense SymbolIds and back. the characters are
+// copied into an arena once, so the views handed out stay valid for the
+// lifetime of the interner. not thread safe, every parser/codegen pair that
+// runs on its own thread has its own interner
+//
+class StringInterner {
+    ASTArena Strings;
+    std::unordered_map<std::string_view, SymbolId> Ids;
+    std::vector<std::string_view> Names;
+
+    // the names of the user operator functions, "unary!" and "binary|",
+    // by operator character. ~0u until first asked for
+    SymbolId OperatorNames[2][256];
+
+public:
+    StringInterner() {
+        for (auto &Ids : OperatorNames)
+            for (auto &Id : Ids)
+                Id = ~0u;
+    }
+    StringInterner(StringInterner const&) = delete;
+    StringInterner &operator=(StringInterner const&) = delete;
+
+    // intern - returns the id of Name, adding it if it is new
+    SymbolId intern(std::string_view Name) {
+        auto It = Ids.find(Name);
+        if (It != Ids.end())
+            return It->second;
+
+        std::string_view Copy = Strings.copyString(Name);
+        SymbolId Id = Names.size();
+        Names.push_back(Copy);
+        Ids.emplace(Copy, Id);
+        return Id;
+    }
+
+    // internOperator - the id of the function implementing the unary or
+    // binary operator Op
+    SymbolId internOperator(bool IsBinary, char Op) {
+        SymbolId &Id = OperatorNames[IsBinary][(unsigned char)Op];
+        if (Id == ~0u)
+            Id = intern(std::string(IsBinary ? "binary" : "unary") + Op);
+        return Id;
+    }
+
+    std::string_view getName(SymbolId Id) const { return Names[Id]; }
+    size_t size() const { return Names.size(); }
+};
+
+#endif // interner_h
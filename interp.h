@@ -0,0 +1,876 @@
+#ifndef interp_h
+#define interp_h
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "builtins.h"
+#include "interner.h"
+#include "symtab.h"
+#include "types.h"
+
+//
+// tier 0 of the jit's -tiered mode. the Interpreter runs the checked body
+// of a function straight from its ExprPool, so a definition costs nothing
+// until it is called and a script that is over in a few milliseconds never
+// waits for LLVM. every call of a function and every iteration of a loop in
+// it heats it up. a hot function is handed to the TierUp, which compiles it
+// in the background, and calls of it from then on run the native code. a
+// loop that keeps running is compiled the same way, from its body on, and
+// the interpreter hands it the frame to finish the loop in
+//
+// tier 0 runs what it can run exactly like the compiled code would: the
+// scalar types, calls of kaleidoscope functions, of the math builtins and
+// of C functions taking and returning up to four doubles. a function with
+// arrays or vectors, or a memoized one, is compiled before it is first
+// called. so is one the interpreter would have to recurse too deep into,
+// and a tail call does not recurse at all
+//
+// a value is held in a Value, as a double or an i64, a bool as the int 0
+// or 1. its type is the one type checking gave the expression it came from
+//
+union Value {
+    double D;
+    int64_t I;
+};
+
+// NativeEntry - the tier 0 entry point of a compiled function, f.tier0. it
+// takes the bits of the arguments and stores the bits of the result
+using NativeEntry = void (*)(Value const* Args, Value *Result);
+
+// LoopEntry - native code for the rest of a loop tier 0 was running. it
+// takes the frame, runs the loop from its body on and stores the variables
+// back into the frame
+using LoopEntry = void (*)(Value *Frame);
+
+// Tier0Function - a function as tier 0 knows it: its checked definition if
+// the interpreter runs it, the address of a C function, or only the
+// prototype of one that is compiled. Native is looked up on the first call
+// of it once it is compiled
+struct Tier0Function {
+    enum TierState : uint8_t {
+        Interpreted, // run by the interpreter
+        Queued,      // hot, being compiled in the background
+        Compiled,    // compiled, or will be before anything calls it
+    };
+
+    PrototypeAST Proto;
+    std::unique_ptr<FunctionAST> AST;
+    void *CFunction = nullptr;
+    NativeEntry Native = nullptr;
+    TierState State = Compiled;
+
+    // calls and loop iterations so far
+    uint64_t Heat = 0;
+
+    // HotLoop - a for loop and the variables in scope in its body, its own
+    // last. Native is set once it got hot and its code is ready
+    struct HotLoop {
+        ExprId Loop;
+        std::vector<std::pair<SymbolId, uint32_t>> Scope;
+        LoopEntry Native = nullptr;
+        bool Queued = false;
+    };
+
+    // Slots[E] - the frame slot of variable E or of the first variable of
+    // var E, the index into Loops of for loop E. SlotTypes are the types of
+    // the slots, the arguments come first
+    std::vector<uint32_t> Slots;
+    std::vector<ValueType> SlotTypes;
+    std::vector<HotLoop> Loops;
+
+    explicit Tier0Function(PrototypeAST Proto) : Proto(std::move(Proto)) {}
+
+    bool isInterpreted() const { return State != Compiled; }
+
+    // hasQueuedLoops - whether the tier-up may still refer to it
+    bool hasQueuedLoops() const {
+        for (auto &L : Loops)
+            if (L.Queued)
+                return true;
+        return false;
+    }
+};
+
+class Interpreter {
+public:
+    // TierUp - where native code comes from, the jit
+    class TierUp {
+    public:
+        virtual ~TierUp() = default;
+
+        // promote - F got hot, compile it in the background
+        virtual void promote(Tier0Function &F) = 0;
+
+        // promoteLoop - a loop of F got hot, compile the rest of it in the
+        // background
+        virtual void promoteLoop(Tier0Function &F, unsigned Loop) = 0;
+
+        // compileNow - compile F before the interpreter goes on, false if
+        // that failed
+        virtual bool compileNow(Tier0Function &F) = 0;
+
+        // installReady - adds the code compiled in the background to the
+        // jit, its functions are Compiled from then on
+        virtual void installReady() = 0;
+
+        // link - sets Native on a Compiled function, false if it has no
+        // native code
+        virtual bool link(Tier0Function &F) = 0;
+    };
+
+    // the calls and loop iterations that make a function hot
+    static constexpr uint64_t HotThreshold = 1000;
+
+    // the iterations of one run of a loop after which the rest of the run
+    // is worth compiling
+    static constexpr uint64_t LoopThreshold = 10 * HotThreshold;
+
+    // how deep tier 0 recurses before it compiles the function it would
+    // call, the C++ stack is not unlimited
+    static constexpr unsigned MaxDepth = 512;
+
+private:
+    StringInterner &Symbols;
+    TierUp *Hooks = nullptr;
+    SymbolIdMap<std::unique_ptr<Tier0Function>> Functions;
+
+    // the functions replaced and the expressions run while the code of a
+    // loop of theirs was being compiled, the tier-up refers to them
+    std::vector<std::unique_ptr<Tier0Function>> Retired;
+
+    // the frames of the running calls, innermost last. a frame holds the
+    // arguments, then every other variable of its function
+    std::vector<Value> Stack;
+    size_t FrameBase = 0;
+    Tier0Function *Current = nullptr;
+    unsigned Depth = 0;
+
+    // set from the tier-up thread when there is native code to install
+    std::atomic<bool> NativeReady{false};
+
+    uint64_t NumCalls = 0;
+
+    Tier0Function *getCallee(SymbolId Name, unsigned NumArgs,
+                             ValueType ReturnType);
+    bool resolve(Tier0Function &F, PrototypeMap const& Protos,
+                 std::vector<std::pair<SymbolId, uint32_t>> &Scope, ExprId E);
+
+    bool call(Tier0Function *F, size_t Base, Value &Result);
+    bool callNative(Tier0Function &F, size_t Base, Value &Result);
+    bool pushArgs(Tier0Function const& Callee, uint32_t const* Args,
+                  unsigned NumArgs);
+    bool callUser(SymbolId Name, uint32_t const* Args, unsigned NumArgs,
+                  ValueType ReturnType, Value &Result);
+    bool evalReturn(ExprId E, Value &Result, Tier0Function *&TailCallee);
+    bool eval(ExprId E, Value &Result);
+    bool evalFor(ExprId E, Value &Result);
+    bool resumeNative(Tier0Function &F, unsigned Loop);
+
+    void pollNative() {
+        if (NativeReady.load(std::memory_order_acquire)) {
+            NativeReady.store(false, std::memory_order_relaxed);
+            Hooks->installReady();
+        }
+    }
+
+    void retire(std::unique_ptr<Tier0Function> F) {
+        if (F and F->hasQueuedLoops())
+            Retired.push_back(std::move(F));
+    }
+
+    ExprPool const& getPool() const { return Current->AST->getPool(); }
+    Value &getSlot(ExprId E) {
+        return Stack[FrameBase + Current->Slots[E.getIndex()]];
+    }
+
+    void heatUp(Tier0Function &F) {
+        if (++F.Heat == HotThreshold and F.State == Tier0Function::Interpreted)
+            Hooks->promote(F);
+    }
+
+public:
+    explicit Interpreter(StringInterner &Symbols) : Symbols(Symbols) {}
+
+    void setTierUp(TierUp *T) { Hooks = T; }
+
+    // prepare - resolves the variables of a checked definition to frame
+    // slots. if tier 0 can run it, it takes F and returns it as a function
+    // for addFunction or run
+    std::unique_ptr<Tier0Function> prepare(std::unique_ptr<FunctionAST> &F,
+                                           PrototypeMap const& Protos);
+
+    // addFunction - F replaces any function of its name
+    void addFunction(std::unique_ptr<Tier0Function> F) {
+        SymbolId Name = F->Proto.getName();
+        std::swap(Functions[Name], F);
+        retire(std::move(F));
+    }
+
+    // addCompiled - a function that is compiled before anything calls it
+    void addCompiled(PrototypeAST const& P) {
+        addFunction(std::make_unique<Tier0Function>(P));
+    }
+
+    // addExtern - a C function at Address
+    void addExtern(PrototypeAST const& P, void *Address) {
+        auto F = std::make_unique<Tier0Function>(P);
+        F->CFunction = Address;
+        addFunction(std::move(F));
+    }
+
+    Tier0Function *getFunction(SymbolId Name) {
+        return Functions.lookup(Name).get();
+    }
+
+    // notifyNativeReady - called by the tier-up thread, the next call the
+    // interpreter makes installs the code
+    void notifyNativeReady() {
+        NativeReady.store(true, std::memory_order_release);
+    }
+
+    // run - evaluates a top-level expression prepared by prepare, false
+    // with an error message if that failed
+    bool run(std::unique_ptr<Tier0Function> Expr, double &Result);
+
+    uint64_t getNumCalls() const { return NumCalls; }
+
+    // forEachCallee - calls Fn on the name of every function the code in
+    // Pool calls
+    template <typename FnT>
+    static void forEachCallee(StringInterner &Symbols, ExprPool const& Pool,
+                              FnT Fn);
+};
+
+// isScalarType - whether tier 0 can hold a value of type T
+inline bool isScalarType(ValueType T) {
+    return T == ValueType::Double or T == ValueType::Int or
+           T == ValueType::Bool;
+}
+
+// isScalarPrototype - whether a function only takes and returns scalars
+inline bool isScalarPrototype(PrototypeAST const& P) {
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i)
+        if (!isScalarType(P.getArgType(i)))
+            return false;
+    return isScalarType(P.getReturnType());
+}
+
+// convertScalar - V of type From as a To, the way convertValue in codegen
+// converts: a bool is 0 or 1, an int converts to the nearest double
+inline Value convertScalar(Value V, ValueType From, ValueType To) {
+    if (From == To or To != ValueType::Double)
+        return V;
+    Value R;
+    R.D = double(V.I);
+    return R;
+}
+
+// isTrueScalar - V of type T as a condition, see toCondition in codegen
+inline bool isTrueScalar(Value V, ValueType T) {
+    return T == ValueType::Double ? isTrue(V.D) : V.I != 0;
+}
+
+template <typename FnT>
+void Interpreter::forEachCallee(StringInterner &Symbols, ExprPool const& Pool,
+                                FnT Fn) {
+    for (uint32_t i = 0, e = Pool.size(); i != e; ++i) {
+        ExprId E(i);
+        switch (Pool.getKind(E)) {
+        case ExprKind::Call:
+            if (Pool.getCall(E).BuiltinFn == Builtin::None)
+                Fn(Pool.getCall(E).Callee);
+            break;
+        case ExprKind::Unary:
+            Fn(Symbols.internOperator(false, Pool.getUnary(E).Opcode));
+            break;
+        case ExprKind::Binary: {
+            char Op = Pool.getBinary(E).Op;
+            if (Op != '=' and Op != '+' and Op != '-' and Op != '*' and
+                Op != '<')
+                Fn(Symbols.internOperator(true, Op));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+inline std::unique_ptr<Tier0Function>
+Interpreter::prepare(std::unique_ptr<FunctionAST> &F,
+                     PrototypeMap const& Protos) {
+    PrototypeAST const& P = F->getProto();
+    if (!isScalarPrototype(P))
+        return nullptr;
+
+    auto T = std::make_unique<Tier0Function>(P);
+    T->Slots.assign(F->getPool().size(), ~0u);
+    std::vector<std::pair<SymbolId, uint32_t>> Scope;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i) {
+        Scope.emplace_back(P.getArgs()[i], i);
+        T->SlotTypes.push_back(P.getArgType(i));
+    }
+
+    // resolve looks at the pool through T
+    T->AST = std::move(F);
+    if (!resolve(*T, Protos, Scope, T->AST->getBody())) {
+        F = std::move(T->AST);
+        return nullptr;
+    }
+    T->State = Tier0Function::Interpreted;
+    return T;
+}
+
+// resolve - gives the variables below E their slots, false if tier 0 can
+// not run E. what codegen would report, an unknown name or a call with the
+// wrong number of arguments, is left to it too
+inline bool Interpreter::resolve(
+    Tier0Function &F, PrototypeMap const& Protos,
+    std::vector<std::pair<SymbolId, uint32_t>> &Scope, ExprId E) {
+    ExprPool const& Pool = F.AST->getPool();
+    if (!isScalarType(Pool.getType(E)))
+        return false;
+
+    auto Lookup = [&](SymbolId Name) {
+        for (size_t i = Scope.size(); i != 0; --i)
+            if (Scope[i - 1].first == Name)
+                return Scope[i - 1].second;
+        return ~0u;
+    };
+    auto NewSlot = [&](SymbolId Name, ValueType T) {
+        uint32_t Slot = F.SlotTypes.size();
+        F.SlotTypes.push_back(T);
+        Scope.emplace_back(Name, Slot);
+        return Slot;
+    };
+
+    // a callee has to be a kaleidoscope function of scalars, or a C
+    // function the interpreter can call
+    auto IsCallable = [&](SymbolId Name, unsigned NumArgs) {
+        auto &Callee = Protos.lookup(Name);
+        if (!Callee or Callee->getArgs().size() != NumArgs or
+            !isScalarPrototype(*Callee))
+            return false;
+        if (!Callee->hasFlag(PF_Extern))
+            return true;
+        Tier0Function *C = getFunction(Name);
+        return C and C->CFunction;
+    };
+
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number:
+        return true;
+
+    case ExprKind::Variable: {
+        uint32_t Slot = Lookup(Pool.getVariable(E).Name);
+        F.Slots[E.getIndex()] = Slot;
+        return Slot != ~0u;
+    }
+
+    case ExprKind::Unary: {
+        UnaryExprAST U = Pool.getUnary(E);
+        return IsCallable(Symbols.internOperator(false, U.Opcode), 1) and
+               resolve(F, Protos, Scope, U.Operand);
+    }
+
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (B.Op == '=' and Pool.getKind(B.LHS) != ExprKind::Variable)
+            return false;
+        if (B.Op != '=' and B.Op != '+' and B.Op != '-' and B.Op != '*' and
+            B.Op != '<' and !IsCallable(Symbols.internOperator(true, B.Op), 2))
+            return false;
+        return resolve(F, Protos, Scope, B.LHS) and
+               resolve(F, Protos, Scope, B.RHS);
+    }
+
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        if (C.BuiltinFn == Builtin::None and !IsCallable(C.Callee, C.NumArgs))
+            return false;
+        for (unsigned i = 0; i != C.NumArgs; ++i)
+            if (!resolve(F, Protos, Scope, C.getArg(i)))
+                return false;
+        return true;
+    }
+
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        return resolve(F, Protos, Scope, If.Cond) and
+               resolve(F, Protos, Scope, If.Then) and
+               resolve(F, Protos, Scope, If.Else);
+    }
+
+    case ExprKind::For: {
+        ForExprAST L = Pool.getFor(E);
+        if (!isScalarType(L.VarType) or !resolve(F, Protos, Scope, L.Start))
+            return false;
+        size_t Outer = Scope.size();
+        NewSlot(L.VarName, L.VarType);
+        F.Slots[E.getIndex()] = F.Loops.size();
+        F.Loops.push_back({E, Scope});
+        bool Ok = resolve(F, Protos, Scope, L.End) and
+                  resolve(F, Protos, Scope, L.Body) and
+                  (!L.Step or resolve(F, Protos, Scope, L.Step));
+        Scope.resize(Outer);
+        return Ok;
+    }
+
+    case ExprKind::Var: {
+        // an initializer sees the variables bound before it
+        VarExprAST V = Pool.getVar(E);
+        size_t Outer = Scope.size();
+        F.Slots[E.getIndex()] = F.SlotTypes.size();
+        bool Ok = true;
+        for (unsigned i = 0; Ok and i != V.NumVars; ++i) {
+            VarBinding B = V.getVar(i);
+            Ok = isScalarType(B.Type) and
+                 (!B.Init or resolve(F, Protos, Scope, B.Init));
+            NewSlot(B.Name, B.Type);
+        }
+        Ok = Ok and resolve(F, Protos, Scope, V.Body);
+        Scope.resize(Outer);
+        return Ok;
+    }
+
+    case ExprKind::Subscript:
+        return false;
+    }
+    return false;
+}
+
+inline bool Interpreter::run(std::unique_ptr<Tier0Function> Expr,
+                             double &Result) {
+    // a top-level expression runs once, it never gets hot. its loops can
+    Expr->Heat = HotThreshold;
+    Current = Expr.get();
+    FrameBase = Stack.size();
+    Stack.resize(FrameBase + Expr->SlotTypes.size());
+
+    Value V;
+    bool Ok = eval(Expr->AST->getBody(), V);
+    Result = convertScalar(V, getPool().getType(Expr->AST->getBody()),
+                           ValueType::Double).D;
+
+    Stack.resize(FrameBase);
+    Current = nullptr;
+    retire(std::move(Expr));
+    return Ok;
+}
+
+// getCallee - the function a call of Name runs, null with an error message
+// if there is none taking NumArgs arguments and returning ReturnType, the
+// type the call was checked with
+inline Tier0Function *Interpreter::getCallee(SymbolId Name, unsigned NumArgs,
+                                             ValueType ReturnType) {
+    Tier0Function *F = getFunction(Name);
+    if (!F or F->Proto.getArgs().size() != NumArgs) {
+        LogError("unknown function referenced");
+        return nullptr;
+    }
+    if (F->Proto.getReturnType() != ReturnType) {
+        LogError("function redefined with different types");
+        return nullptr;
+    }
+    return F;
+}
+
+// pushArgs - evaluates the arguments of a call of Callee onto the stack,
+// converted to the types it takes. they are the start of its frame
+inline bool Interpreter::pushArgs(Tier0Function const& Callee,
+                                  uint32_t const* Args, unsigned NumArgs) {
+    ExprPool const& Pool = getPool();
+    for (unsigned i = 0; i != NumArgs; ++i) {
+        Value V;
+        if (!eval(ExprId(Args[i]), V))
+            return false;
+        ValueType From = Pool.getType(ExprId(Args[i]));
+        ValueType To = Callee.Proto.getArgType(i);
+        if (!isWiderOrSame(To, From)) {
+            LogError("function redefined with different types");
+            return false;
+        }
+        Stack.push_back(convertScalar(V, From, To));
+    }
+    return true;
+}
+
+// callUser - a call of the kaleidoscope or C function Name
+inline bool Interpreter::callUser(SymbolId Name, uint32_t const* Args,
+                                  unsigned NumArgs, ValueType ReturnType,
+                                  Value &Result) {
+    Tier0Function *F = getCallee(Name, NumArgs, ReturnType);
+    if (!F)
+        return false;
+
+    size_t Base = Stack.size();
+    Tier0Function *Caller = Current;
+    size_t CallerBase = FrameBase;
+    bool Ok = pushArgs(*F, Args, NumArgs) and call(F, Base, Result);
+    Current = Caller;
+    FrameBase = CallerBase;
+    Stack.resize(Base);
+    return Ok;
+}
+
+// callNative - runs F, whose arguments start at Base, as native code
+inline bool Interpreter::callNative(Tier0Function &F, size_t Base,
+                                    Value &Result) {
+    if (F.Native or (!F.CFunction and Hooks->link(F))) {
+        F.Native(Stack.data() + Base, &Result);
+        return true;
+    }
+
+    if (F.CFunction) {
+        // all doubles, see resolve
+        Value const* A = Stack.data() + Base;
+        void *P = F.CFunction;
+        switch (F.Proto.getArgs().size()) {
+        case 0:
+            Result.D = ((double (*)())P)();
+            return true;
+        case 1:
+            Result.D = ((double (*)(double))P)(A[0].D);
+            return true;
+        case 2:
+            Result.D = ((double (*)(double, double))P)(A[0].D, A[1].D);
+            return true;
+        case 3:
+            Result.D = ((double (*)(double, double, double))P)(A[0].D, A[1].D,
+                                                               A[2].D);
+            return true;
+        case 4:
+            Result.D = ((double (*)(double, double, double, double))P)(
+                A[0].D, A[1].D, A[2].D, A[3].D);
+            return true;
+        default:
+            break;
+        }
+    }
+
+    LogError("unknown function referenced");
+    return false;
+}
+
+// call - runs F on the arguments at Base. a tail call of an interpreted
+// function reuses the frame instead of recursing
+inline bool Interpreter::call(Tier0Function *F, size_t Base, Value &Result) {
+    pollNative();
+
+    if (Depth == MaxDepth and F->isInterpreted() and !Hooks->compileNow(*F))
+        return false;
+
+    ++Depth;
+    bool Ok = true;
+    while (1) {
+        if (!F->isInterpreted()) {
+            Ok = callNative(*F, Base, Result);
+            break;
+        }
+
+        ++NumCalls;
+        heatUp(*F);
+        Current = F;
+        FrameBase = Base;
+        Stack.resize(Base + F->SlotTypes.size());
+
+        Tier0Function *TailCallee = nullptr;
+        Ok = evalReturn(F->AST->getBody(), Result, TailCallee);
+        if (!Ok or !TailCallee)
+            break;
+
+        // the arguments of the tail call were pushed above the frame, they
+        // are the new one
+        size_t NumArgs = TailCallee->Proto.getArgs().size();
+        size_t Args = Stack.size() - NumArgs;
+        for (size_t i = 0; i != NumArgs; ++i)
+            Stack[Base + i] = Stack[Args + i];
+        Stack.resize(Base + NumArgs);
+        F = TailCallee;
+    }
+    --Depth;
+    return Ok;
+}
+
+// evalReturn - evaluates E in tail position, like codegenReturn: the
+// branches of an if and the body of a var are in tail position too. a call
+// there of an interpreted function returning the same type is left to the
+// caller, its arguments pushed and the function in TailCallee
+inline bool Interpreter::evalReturn(ExprId E, Value &Result,
+                                    Tier0Function *&TailCallee) {
+    ExprPool const& Pool = getPool();
+    switch (Pool.getKind(E)) {
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        Value Cond;
+        if (!eval(If.Cond, Cond))
+            return false;
+        return evalReturn(isTrueScalar(Cond, Pool.getType(If.Cond)) ? If.Then
+                                                                     : If.Else,
+                          Result, TailCallee);
+    }
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        uint32_t Slot = Current->Slots[E.getIndex()];
+        for (unsigned i = 0; i != V.NumVars; ++i) {
+            VarBinding B = V.getVar(i);
+            Value Init;
+            Init.I = 0;
+            if (B.Init) {
+                if (!eval(B.Init, Init))
+                    return false;
+                Init = convertScalar(Init, Pool.getType(B.Init), B.Type);
+            }
+            Stack[FrameBase + Slot + i] = Init;
+        }
+        return evalReturn(V.Body, Result, TailCallee);
+    }
+
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        if (C.BuiltinFn != Builtin::None)
+            break;
+        Tier0Function *F = getCallee(C.Callee, C.NumArgs, Pool.getType(E));
+        if (!F)
+            return false;
+        if (!F->isInterpreted() or
+            F->Proto.getReturnType() != Current->Proto.getReturnType())
+            break;
+        if (!pushArgs(*F, C.ArgIds, C.NumArgs))
+            return false;
+        TailCallee = F;
+        return true;
+    }
+
+    default:
+        break;
+    }
+
+    Value V;
+    if (!eval(E, V))
+        return false;
+    Result = convertScalar(V, Pool.getType(E), Current->Proto.getReturnType());
+    return true;
+}
+
+inline bool Interpreter::eval(ExprId E, Value &Result) {
+    ExprPool const& Pool = getPool();
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number: {
+        NumberExprAST N = Pool.getNumber(E);
+        if (N.Type == ValueType::Double)
+            Result.D = N.Val;
+        else if (N.Type == ValueType::Int)
+            Result.I = int64_t(N.Val);
+        else
+            Result.I = isTrue(N.Val);
+        return true;
+    }
+
+    case ExprKind::Variable:
+        Result = getSlot(E);
+        return true;
+
+    case ExprKind::Unary: {
+        UnaryExprAST U = Pool.getUnary(E);
+        uint32_t Operand = U.Operand.getIndex();
+        return callUser(Symbols.internOperator(false, U.Opcode), &Operand, 1,
+                        Pool.getType(E), Result);
+    }
+
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (B.Op == '=') {
+            Value V;
+            if (!eval(B.RHS, V))
+                return false;
+            Result = convertScalar(V, Pool.getType(B.RHS), Pool.getType(E));
+            getSlot(B.LHS) = Result;
+            return true;
+        }
+
+        if (B.Op != '+' and B.Op != '-' and B.Op != '*' and B.Op != '<') {
+            uint32_t Ops[2] = {B.LHS.getIndex(), B.RHS.getIndex()};
+            return callUser(Symbols.internOperator(true, B.Op), Ops, 2,
+                            Pool.getType(E), Result);
+        }
+
+        Value L, R;
+        if (!eval(B.LHS, L) or !eval(B.RHS, R))
+            return false;
+
+        // ints when both sides are ints or bools, doubles otherwise
+        ValueType TL = Pool.getType(B.LHS), TR = Pool.getType(B.RHS);
+        if (TL != ValueType::Double and TR != ValueType::Double) {
+            uint64_t A = L.I, C = R.I;
+            switch (B.Op) {
+            case '+':
+                Result.I = int64_t(A + C);
+                break;
+            case '-':
+                Result.I = int64_t(A - C);
+                break;
+            case '*':
+                Result.I = int64_t(A * C);
+                break;
+            default:
+                Result.I = L.I < R.I;
+                break;
+            }
+            return true;
+        }
+
+        double A = convertScalar(L, TL, ValueType::Double).D;
+        double C = convertScalar(R, TR, ValueType::Double).D;
+        switch (B.Op) {
+        case '+':
+            Result.D = A + C;
+            break;
+        case '-':
+            Result.D = A - C;
+            break;
+        case '*':
+            Result.D = A * C;
+            break;
+        default:
+            // unordered or less than, like fcmp ult
+            Result.I = !(A >= C);
+            break;
+        }
+        return true;
+    }
+
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        if (C.BuiltinFn == Builtin::None)
+            return callUser(C.Callee, C.ArgIds, C.NumArgs, Pool.getType(E),
+                            Result);
+
+        // the math builtins take up to three doubles
+        double Ops[3];
+        for (unsigned i = 0; i != C.NumArgs and i != 3; ++i) {
+            Value V;
+            if (!eval(C.getArg(i), V))
+                return false;
+            Ops[i] = convertScalar(V, Pool.getType(C.getArg(i)),
+                                   ValueType::Double).D;
+        }
+        return evaluateBuiltin(C.BuiltinFn, Ops, Result.D);
+    }
+
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        Value Cond, V;
+        if (!eval(If.Cond, Cond))
+            return false;
+        ExprId Branch =
+            isTrueScalar(Cond, Pool.getType(If.Cond)) ? If.Then : If.Else;
+        if (!eval(Branch, V))
+            return false;
+        Result = convertScalar(V, Pool.getType(Branch), Pool.getType(E));
+        return true;
+    }
+
+    case ExprKind::For:
+        return evalFor(E, Result);
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        uint32_t Slot = Current->Slots[E.getIndex()];
+        for (unsigned i = 0; i != V.NumVars; ++i) {
+            VarBinding B = V.getVar(i);
+            Value Init;
+            Init.I = 0;
+            if (B.Init) {
+                if (!eval(B.Init, Init))
+                    return false;
+                Init = convertScalar(Init, Pool.getType(B.Init), B.Type);
+            }
+            Stack[FrameBase + Slot + i] = Init;
+        }
+        return eval(V.Body, Result);
+    }
+
+    case ExprKind::Subscript:
+        break;
+    }
+    return false;
+}
+
+// evalFor - the same order as the emitted loop: body, step, end condition,
+// then the increment of the (possibly reassigned) loop variable. a run of
+// the loop that goes on long enough is finished by native code
+inline bool Interpreter::evalFor(ExprId E, Value &Result) {
+    ExprPool const& Pool = getPool();
+    ForExprAST L = Pool.getFor(E);
+    Value Start;
+    if (!eval(L.Start, Start))
+        return false;
+
+    Tier0Function &F = *Current;
+    unsigned Loop = F.Slots[E.getIndex()];
+    uint32_t Var = F.Loops[Loop].Scope.back().second;
+    Stack[FrameBase + Var] = convertScalar(Start, Pool.getType(L.Start),
+                                           L.VarType);
+
+    bool IsDouble = L.VarType == ValueType::Double;
+    ValueType EndType = Pool.getType(L.End);
+    for (uint64_t Iterations = 1;; ++Iterations) {
+        Value Body, Step, End;
+        if (!eval(L.Body, Body))
+            return false;
+        if (L.Step) {
+            if (!eval(L.Step, Step))
+                return false;
+            Step = convertScalar(Step, Pool.getType(L.Step), L.VarType);
+        } else if (IsDouble) {
+            Step.D = 1.0;
+        } else {
+            Step.I = 1;
+        }
+        if (!eval(L.End, End))
+            return false;
+
+        // the stack may have moved with the calls in the loop
+        Value &V = Stack[FrameBase + Var];
+        if (IsDouble)
+            V.D += Step.D;
+        else
+            V.I = int64_t(uint64_t(V.I) + uint64_t(Step.I));
+        if (!isTrueScalar(End, EndType))
+            break;
+        heatUp(F);
+        if (Iterations >= LoopThreshold and resumeNative(F, Loop))
+            break;
+    }
+
+    Result.I = 0;
+    if (Pool.getType(E) == ValueType::Double)
+        Result.D = 0.0;
+    return true;
+}
+
+// resumeNative - runs the rest of a hot loop of F natively, if its code is
+// ready. asks for it the first time
+inline bool Interpreter::resumeNative(Tier0Function &F, unsigned Loop) {
+    Tier0Function::HotLoop &L = F.Loops[Loop];
+    if (!L.Native) {
+        if (!L.Queued) {
+            L.Queued = true;
+            Hooks->promoteLoop(F, Loop);
+        }
+        pollNative();
+        if (!L.Native)
+            return false;
+    }
+    L.Native(Stack.data() + FrameBase);
+    return true;
+}
+
+#endif // interp_h
@@ -1,7 +1,21 @@
 #ifndef lexer_h
 #define lexer_h
 
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <system_error>
+
+#if !defined(KINIT_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+#include "interner.h"
+#include "source.h"
 
 //
 // lexer defs/decls
@@ -22,73 +36,280 @@ enum Token {
     tok_var = -13
 };
 
-static std::string IdentifierStr;
-static double NumVal;
+//
+// keywords are recognized with a perfect hash over the first and last
+// character and the length. the multipliers are searched for at compile time,
+// so adding a keyword here is all it takes
+//
+struct KeywordEntry {
+    std::string_view Name;
+    int Tok = tok_identifier;
+};
+
+static constexpr KeywordEntry Keywords[] = {
+    {"def", tok_def},       {"extern", tok_extern}, {"if", tok_if},
+    {"then", tok_then},     {"else", tok_else},     {"for", tok_for},
+    {"in", tok_in},         {"binary", tok_binary}, {"unary", tok_unary},
+    {"var", tok_var},
+};
+
+static constexpr unsigned KeywordTableSize = 32;
+
+static constexpr unsigned hashKeyword(std::string_view S, unsigned Mul0,
+                                      unsigned Mul1) {
+    return ((unsigned char)S.front() * Mul0 + (unsigned char)S.back() * Mul1 +
+            S.size()) % KeywordTableSize;
+}
+
+struct KeywordTable {
+    unsigned Mul0 = 0, Mul1 = 0;
+    KeywordEntry Slots[KeywordTableSize] = {};
+};
+
+// buildKeywordTable - finds multipliers that give every keyword its own slot
+static constexpr KeywordTable buildKeywordTable() {
+    for (unsigned Mul0 = 1; Mul0 < 64; ++Mul0) {
+        for (unsigned Mul1 = 1; Mul1 < 64; ++Mul1) {
+            KeywordTable T;
+            T.Mul0 = Mul0;
+            T.Mul1 = Mul1;
+
+            bool Collision = false;
+            for (auto const& K : Keywords) {
+                auto &Slot = T.Slots[hashKeyword(K.Name, Mul0, Mul1)];
+                if (!Slot.Name.empty()) {
+                    Collision = true;
+                    break;
+                }
+                Slot = K;
+            }
+            if (!Collision)
+                return T;
+        }
+    }
+    return KeywordTable();
+}
+
+static constexpr KeywordTable TheKeywordTable = buildKeywordTable();
+static_assert(TheKeywordTable.Mul0 != 0, "no perfect hash for the keyword set");
+
+// getKeywordToken - returns the keyword token for an identifier, or
+// tok_identifier if it is not a keyword
+static int getKeywordToken(std::string_view Ident) {
+    auto const& Slot = TheKeywordTable.Slots[hashKeyword(
+        Ident, TheKeywordTable.Mul0, TheKeywordTable.Mul1)];
+    if (Slot.Name == Ident)
+        return Slot.Tok;
+    return tok_identifier;
+}
+
+// parseNumber - parses number text in place. from_chars reads straight out
+// of the source buffer; strtod needs a nul terminated copy and is only used
+// where the library lacks floating point from_chars, or for the out of range
+// literals from_chars refuses to round
+static double parseNumber(std::string_view NumStr) {
+#if defined(__cpp_lib_to_chars)
+    double Val = 0;
+    auto Res = std::from_chars(NumStr.data(), NumStr.data() + NumStr.size(),
+                               Val);
+    if (Res.ec == std::errc())
+        return Val;
+    if (Res.ec == std::errc::invalid_argument)
+        return 0;
+#endif
+    char Buf[64];
+    if (NumStr.size() < sizeof(Buf)) {
+        memcpy(Buf, NumStr.data(), NumStr.size());
+        Buf[NumStr.size()] = '\0';
+        return strtod(Buf, 0);
+    }
+    return strtod(std::string(NumStr).c_str(), 0);
+}
+
+//
+// whitespace and comment skipping. runs are scanned 32 (AVX2) or 16 (SSE2)
+// bytes at a time; the scalar loop handles the tail and is the whole
+// implementation elsewhere, or when built with KINIT_NO_SIMD. both treat the
+// same six characters as whitespace as isspace() does in the "C" locale
+//
+static inline bool isSpaceChar(int C) {
+    return C == ' ' or (C >= '\t' and C <= '\r');
+}
+
+#if !defined(KINIT_NO_SIMD) && defined(__AVX2__)
+// spaceMask32 - bit i is set if P[i] is whitespace
+static inline unsigned spaceMask32(char const* P) {
+    __m256i V = _mm256_loadu_si256((__m256i const*)P);
+    __m256i Space = _mm256_cmpeq_epi8(V, _mm256_set1_epi8(' '));
+    // '\t'..'\r' are contiguous: V - '\t' <= 4 as an unsigned byte
+    __m256i Off = _mm256_sub_epi8(V, _mm256_set1_epi8('\t'));
+    __m256i Ctl = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(Off, _mm256_set1_epi8(4)), Off);
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(Space, Ctl));
+}
+
+// lineEndMask32 - bit i is set if P[i] is '\n' or '\r'
+static inline unsigned lineEndMask32(char const* P) {
+    __m256i V = _mm256_loadu_si256((__m256i const*)P);
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\n')),
+        _mm256_cmpeq_epi8(V, _mm256_set1_epi8('\r'))));
+}
+#endif
+
+#if !defined(KINIT_NO_SIMD) && defined(__SSE2__)
+// spaceMask16 - bit i is set if P[i] is whitespace
+static inline unsigned spaceMask16(char const* P) {
+    __m128i V = _mm_loadu_si128((__m128i const*)P);
+    __m128i Space = _mm_cmpeq_epi8(V, _mm_set1_epi8(' '));
+    __m128i Off = _mm_sub_epi8(V, _mm_set1_epi8('\t'));
+    __m128i Ctl = _mm_cmpeq_epi8(_mm_min_epu8(Off, _mm_set1_epi8(4)), Off);
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(Space, Ctl));
+}
+
+// lineEndMask16 - bit i is set if P[i] is '\n' or '\r'
+static inline unsigned lineEndMask16(char const* P) {
+    __m128i V = _mm_loadu_si128((__m128i const*)P);
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+        _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))));
+}
+#endif
+
+// skipWhitespace - returns the first non whitespace character in [P, End)
+static inline char const* skipWhitespace(char const* P, char const* End) {
+    // most runs are a single space, don't pay for a vector load on those
+    if (P != End and !isSpaceChar((unsigned char)*P))
+        return P;
+
+#if !defined(KINIT_NO_SIMD) && defined(__AVX2__)
+    for (; End - P >= 32; P += 32)
+        if (unsigned Mask = ~spaceMask32(P))
+            return P + __builtin_ctz(Mask);
+#endif
+#if !defined(KINIT_NO_SIMD) && defined(__SSE2__)
+    for (; End - P >= 16; P += 16)
+        if (unsigned Mask = ~spaceMask16(P) & 0xffff)
+            return P + __builtin_ctz(Mask);
+#endif
+    while (P != End and isSpaceChar((unsigned char)*P))
+        ++P;
+    return P;
+}
+
+// findLineEnd - returns the first '\n' or '\r' in [P, End), or End
+static inline char const* findLineEnd(char const* P, char const* End) {
+#if !defined(KINIT_NO_SIMD) && defined(__AVX2__)
+    for (; End - P >= 32; P += 32)
+        if (unsigned Mask = lineEndMask32(P))
+            return P + __builtin_ctz(Mask);
+#endif
+#if !defined(KINIT_NO_SIMD) && defined(__SSE2__)
+    for (; End - P >= 16; P += 16)
+        if (unsigned Mask = lineEndMask16(P))
+            return P + __builtin_ctz(Mask);
+#endif
+    while (P != End and *P != '\n' and *P != '\r')
+        ++P;
+    return P;
+}
+
+//
+// Lexer - owns all the scanning state for one source buffer, so independent
+// lexers can run side by side (e.g. on different threads)
+//
+class Lexer {
+    SourceBuffer &Source;
+
+    // cursor into the current window of the source buffer
+    char const* CurPtr;
+    char const* BufEnd;
+
+    // identifiers are interned as they are lexed, so the parser and codegen
+    // only ever see their SymbolId
+    StringInterner &Symbols;
+    std::string_view IdentifierStr; // view into the source buffer
+    SymbolId IdentifierId = 0;
+    double NumVal = 0;
+
+    // peekChar - returns the character under the cursor, pulling in more input
+    // once the buffer is exhausted
+    int peekChar() {
+        if (CurPtr == BufEnd) {
+            if (!Source.refill())
+                return EOF;
+            CurPtr = Source.getBufferStart();
+            BufEnd = Source.getBufferEnd();
+        }
+        return (unsigned char)*CurPtr;
+    }
+
+public:
+    Lexer(SourceBuffer &Source, StringInterner &Symbols)
+        : Source(Source), CurPtr(Source.getBufferStart()),
+          BufEnd(Source.getBufferEnd()), Symbols(Symbols)
+    {}
+
+    // gettok - returns the next token from the source buffer
+    int gettok();
+
+    // the identifier text stays valid until the next call to gettok
+    std::string_view getIdentifier() const { return IdentifierStr; }
+    SymbolId getIdentifierId() const { return IdentifierId; }
+    double getNumVal() const { return NumVal; }
 
-// gettok - returns the next token from standard input
-static int gettok() {
-    static int LastChar = ' ';
+    bool isInteractive() const { return Source.isInteractive(); }
+};
+
+inline int Lexer::gettok() {
+    int LastChar;
+    while (1) {
+        // skip any whitespace, peekChar refills an exhausted buffer and the
+        // new one may start with more of it
+        CurPtr = skipWhitespace(CurPtr, BufEnd);
+        LastChar = peekChar();
+        if (isSpaceChar(LastChar))
+            continue;
+        if (LastChar != '#')
+            break;
 
-    // skip any whitespace
-    while(isspace(LastChar))
-        LastChar = getchar();
+        // comment until end of line
+        ++CurPtr;
+        do
+            CurPtr = findLineEnd(CurPtr, BufEnd);
+        while (CurPtr == BufEnd and peekChar() != EOF);
+    }
 
     if (isalpha(LastChar)) {
         // identifier [a-zA-Z][a-zA-Z0-9]*
-        IdentifierStr = LastChar;
-        while(isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
-
-        if (IdentifierStr == "def") 
-            return tok_def;
-        if (IdentifierStr == "extern")
-            return tok_extern;
-        if (IdentifierStr == "if")
-            return tok_if;
-        if (IdentifierStr == "then")
-            return tok_then;
-        if (IdentifierStr == "else")
-            return tok_else;
-        if (IdentifierStr == "for")
-            return tok_for;
-        if (IdentifierStr == "in")
-            return tok_in;
-        if (IdentifierStr == "binary")
-            return tok_binary;
-        if (IdentifierStr == "unary")
-            return tok_unary;
-        if (IdentifierStr == "var")
-            return tok_var;
-        return tok_identifier;
+        char const* Start = CurPtr;
+        do
+            ++CurPtr;
+        while(CurPtr != BufEnd and isalnum((unsigned char)*CurPtr));
+        IdentifierStr = std::string_view(Start, CurPtr - Start);
+
+        int Tok = getKeywordToken(IdentifierStr);
+        if (Tok == tok_identifier)
+            IdentifierId = Symbols.intern(IdentifierStr);
+        return Tok;
     }
 
     if (isdigit(LastChar) || LastChar == '.') {
         // number: [0-9.]+
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while(isdigit(LastChar) || LastChar == '.');
+        char const* Start = CurPtr;
+        do
+            ++CurPtr;
+        while(CurPtr != BufEnd and (isdigit((unsigned char)*CurPtr) or *CurPtr == '.'));
 
-        NumVal = strtod(NumStr.c_str(), 0);
+        NumVal = parseNumber(std::string_view(Start, CurPtr - Start));
         return tok_number;
     }
 
-    if (LastChar == '#') {
-        do 
-            LastChar = getchar();
-        while(LastChar != EOF and LastChar != '\n' and LastChar != '\r');
-
-        if (LastChar != EOF)
-            return gettok();
-    }
-
     if (LastChar == EOF)
         return tok_eof;
 
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+    ++CurPtr;
+    return LastChar;
 }
 
 #endif // lexer_h
@@ -0,0 +1,212 @@
+#ifndef multiversion_h
+#define multiversion_h
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// function multi-versioning for object output. every function defined in
+// the module is cloned once per -mclones cpu, plus a default clone for the
+// module's own -mcpu/-mattr. the clones of one cpu call each other
+// directly, so a whole call tree runs specialized once it is entered
+//
+// the original symbol becomes a dispatcher, which calls through a function
+// pointer. the pointer starts out at a resolver, which on the first call
+// reads the cpu features the runtime (libgcc or compiler-rt) found in
+// __cpu_model, picks the first clone the machine supports, and stores it
+//
+// only x86 is supported, as __cpu_model is x86 only
+//
+// the dispatcher, resolver and clones keep the calling convention of the
+// function, fastcc for the body of a kaleidoscope function
+//
+
+// the bits of __cpu_model.__cpu_features[0], as numbered by libgcc and
+// compiler-rt, for the features that matter to generated code
+struct CPUFeatureBit {
+    char const* Name;
+    unsigned Bit;
+};
+
+static CPUFeatureBit const CPUFeatureBits[] = {
+    {"popcnt", 2},    {"sse4.2", 8},    {"avx", 9},        {"avx2", 10},
+    {"fma", 14},      {"avx512f", 15},  {"bmi", 16},       {"bmi2", 17},
+    {"avx512vl", 20}, {"avx512bw", 21}, {"avx512dq", 22},  {"avx512cd", 23},
+};
+
+// getCPUFeatureMask - the __cpu_features bits a cpu needs to run code built
+// for it
+static uint32_t getCPUFeatureMask(llvm::Target const& T, llvm::Triple const& TT,
+                                  std::string const& CPU) {
+    std::unique_ptr<llvm::MCSubtargetInfo> STI(
+        T.createMCSubtargetInfo(TT.str(), CPU, ""));
+    uint32_t Mask = 0;
+    for (auto &F : CPUFeatureBits)
+        if (STI->checkFeatures(std::string("+") + F.Name))
+            Mask |= 1u << F.Bit;
+    return Mask;
+}
+
+// cloneFunctions - clones every function in Fns into M. the clones get
+// Suffix appended to their names, and the given cpu and features unless
+// CPU is empty
+static std::vector<llvm::Function*>
+cloneFunctions(llvm::Module &M, std::vector<llvm::Function*> const& Fns,
+               std::string const& Suffix, std::string const& CPU,
+               std::string const& Features) {
+    llvm::ValueToValueMapTy VMap;
+    std::vector<llvm::Function*> Clones;
+
+    // declare all the clones first, so that calls between the functions map
+    // to calls between their clones
+    for (auto *F : Fns) {
+        auto *NF = llvm::Function::Create(F->getFunctionType(),
+                                          llvm::GlobalValue::InternalLinkage,
+                                          F->getName() + "." + Suffix, &M);
+        VMap[F] = NF;
+        Clones.push_back(NF);
+    }
+
+    for (size_t i = 0; i != Fns.size(); ++i) {
+        auto DestArg = Clones[i]->arg_begin();
+        for (auto &Arg : Fns[i]->args()) {
+            DestArg->setName(Arg.getName());
+            VMap[&Arg] = &*DestArg++;
+        }
+
+        llvm::SmallVector<llvm::ReturnInst*, 8> Returns;
+        llvm::CloneFunctionInto(Clones[i], Fns[i], VMap, false, Returns);
+
+        // cloning copies the attributes of the original, so the target goes
+        // on afterwards
+        Clones[i]->setLinkage(llvm::GlobalValue::InternalLinkage);
+        if (!CPU.empty()) {
+            Clones[i]->addFnAttr("target-cpu", CPU);
+            Clones[i]->addFnAttr("target-features", Features);
+        }
+    }
+    return Clones;
+}
+
+// emitDispatcher - turns F into a call through a pointer that the resolver
+// sets to the best of Clones. Masks[i] are the features Clones[i] needs,
+// Default is used when none of them is supported
+static void emitDispatcher(llvm::Module &M, llvm::Function *F,
+                           std::vector<llvm::Function*> const& Clones,
+                           std::vector<uint32_t> const& Masks,
+                           llvm::Function *Default) {
+    llvm::LLVMContext &Ctx = M.getContext();
+    llvm::FunctionType *FT = F->getFunctionType();
+    llvm::PointerType *FnPtrTy = llvm::PointerType::getUnqual(FT);
+    llvm::Type *Int32Ty = llvm::Type::getInt32Ty(Ctx);
+
+    // the runtime's cpu detection, int __cpu_indicator_init(void) and
+    // struct { unsigned vendor, type, subtype, features[1]; } __cpu_model
+    auto InitFn = M.getOrInsertFunction(
+        "__cpu_indicator_init", llvm::FunctionType::get(Int32Ty, false));
+    auto *CPUModelTy = llvm::StructType::get(
+        Ctx, {Int32Ty, Int32Ty, Int32Ty, llvm::ArrayType::get(Int32Ty, 1)});
+    auto *CPUModel = M.getOrInsertGlobal("__cpu_model", CPUModelTy);
+
+    auto *Resolver = llvm::Function::Create(
+        FT, llvm::GlobalValue::InternalLinkage, F->getName() + ".resolve", &M);
+    Resolver->setCallingConv(F->getCallingConv());
+    auto *Slot = new llvm::GlobalVariable(
+        M, FnPtrTy, false, llvm::GlobalValue::InternalLinkage, Resolver,
+        F->getName() + ".ptr");
+
+    std::vector<llvm::Value*> Args;
+
+    // resolver: pick a clone, remember it, and make this first call
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(Ctx, "entry", Resolver));
+    B.CreateCall(InitFn);
+    llvm::Value *FeaturesPtr =
+        B.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 0, 3);
+    llvm::Value *CPUFeatures = B.CreateLoad(
+        Int32Ty, B.CreateConstInBoundsGEP2_32(
+                     llvm::ArrayType::get(Int32Ty, 1), FeaturesPtr, 0, 0),
+        "features");
+
+    // the first clone in -mclones order whose features are all there wins
+    llvm::Value *Best = Default;
+    for (size_t i = Clones.size(); i-- != 0;) {
+        llvm::Value *Mask = llvm::ConstantInt::get(Int32Ty, Masks[i]);
+        llvm::Value *Supported =
+            B.CreateICmpEQ(B.CreateAnd(CPUFeatures, Mask), Mask);
+        Best = B.CreateSelect(Supported, Clones[i], Best);
+    }
+    B.CreateStore(Best, Slot);
+
+    for (auto &Arg : Resolver->args())
+        Args.push_back(&Arg);
+    auto *First = B.CreateCall(FT, Best, Args);
+    First->setCallingConv(F->getCallingConv());
+    First->setTailCall();
+    B.CreateRet(First);
+
+    // dispatcher: the original symbol calls whatever the pointer holds
+    F->deleteBody();
+    B.SetInsertPoint(llvm::BasicBlock::Create(Ctx, "entry", F));
+    Args.clear();
+    for (auto &Arg : F->args())
+        Args.push_back(&Arg);
+    auto *Call = B.CreateCall(FT, B.CreateLoad(FnPtrTy, Slot, "impl"), Args);
+    Call->setCallingConv(F->getCallingConv());
+    Call->setTailCall();
+    B.CreateRet(Call);
+}
+
+// emitFunctionClones - multi-versions every function defined in M for the
+// given cpus. returns false with an error message if it can not
+static bool emitFunctionClones(llvm::Module &M, llvm::Target const& T,
+                               std::string const& DefaultCPU,
+                               std::string const& DefaultFeatures,
+                               std::vector<std::string> const& CPUs,
+                               std::string &Error) {
+    llvm::Triple TT(M.getTargetTriple());
+    if (TT.getArch() != llvm::Triple::x86 and
+        TT.getArch() != llvm::Triple::x86_64) {
+        Error = "-mclones is only supported for x86 targets";
+        return false;
+    }
+
+    std::vector<llvm::Function*> Fns;
+    for (auto &F : M)
+        if (!F.isDeclaration())
+            Fns.push_back(&F);
+    if (Fns.empty())
+        return true;
+
+    std::vector<std::vector<llvm::Function*>> Clones;
+    std::vector<uint32_t> Masks;
+    for (auto &CPU : CPUs) {
+        Clones.push_back(cloneFunctions(M, Fns, CPU, CPU, ""));
+        Masks.push_back(getCPUFeatureMask(T, TT, CPU));
+    }
+    auto Defaults = cloneFunctions(M, Fns, "default", DefaultCPU,
+                                   DefaultFeatures);
+
+    std::vector<llvm::Function*> FnClones(CPUs.size());
+    for (size_t i = 0; i != Fns.size(); ++i) {
+        for (size_t j = 0; j != CPUs.size(); ++j)
+            FnClones[j] = Clones[j][i];
+        emitDispatcher(M, Fns[i], FnClones, Masks, Defaults[i]);
+    }
+    return true;
+}
+
+#endif // multiversion_h
@@ -0,0 +1,163 @@
+#ifndef options_h
+#define options_h
+
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//
+// CompilerOptions - what the drivers take on the command line
+//
+//   [-O0|-O1|-O2|-O3] [-ffast-math] [-fbounds-check] [-fmemoize]
+//   [-mcpu=<cpu>] [-mattr=<+feature,-feature...>] [-mclones=<cpu,cpu...>]
+//   [-j<threads>] [-lazy] [-tiered] [-cache-dir=<dir>] [-cache-size=<MB>]
+//   [file]
+//
+// -mcpu and -mattr default to native, the cpu the compiler runs on. the
+// source is read from stdin when no file is given
+//
+struct CompilerOptions {
+    unsigned OptLevel = 2;
+
+    // -ffast-math: every function as if it was declared @fastmath
+    bool FastMath = false;
+
+    // -fbounds-check: trap on an array index out of its length argument.
+    // off by default, a check in a loop keeps it from being vectorized
+    bool BoundsCheck = false;
+
+    // -fmemoize: every pure function calling itself more than once as if
+    // it was declared @pure, so its results are kept in a memo table
+    bool Memoize = false;
+
+    std::string CPU = "native";
+    std::string Features = "native";
+
+    // -mclones: emit a copy of every function for each of these cpus, most
+    // specific first, see multiversion.h. the -mcpu/-mattr version is the
+    // fallback then, they default to the baseline x86-64
+    std::vector<std::string> Clones;
+
+    // -j: the threads the jit compiles definitions on, 0 for one per core
+    unsigned Threads = 0;
+
+    // -lazy: the jit compiles a definition on the first call of it, not
+    // when it is read
+    bool Lazy = false;
+
+    // -tiered: the jit interprets a definition until it gets hot, then
+    // compiles it in the background, see interp.h
+    bool Tiered = false;
+
+    // -cache-dir: where the jit keeps the objects it compiled, for later
+    // runs to load. no cache when empty. -cache-size is what the directory
+    // is trimmed to at exit
+    std::string CacheDir;
+    uint64_t CacheSize = 64 << 20;
+
+    char const* InputFile = nullptr;
+};
+
+// matchOption - whether Arg is Name=<value>, Value points to the value
+static bool matchOption(char const* Arg, char const* Name, char const* &Value) {
+    size_t Len = strlen(Name);
+    if (strncmp(Arg, Name, Len) != 0 or Arg[Len] != '=')
+        return false;
+    Value = Arg + Len + 1;
+    return true;
+}
+
+// parseCommandLine - fills Opts from argv, prints a usage line and returns
+// false on anything it does not understand
+static bool parseCommandLine(int argc, char **argv, CompilerOptions &Opts) {
+    bool HasCPU = false, HasFeatures = false;
+    for (int i = 1; i < argc; ++i) {
+        char const* Arg = argv[i];
+        char const* Value;
+        if (Arg[0] == '-' and Arg[1] == 'O' and Arg[2] >= '0' and
+            Arg[2] <= '3' and Arg[3] == '\0') {
+            Opts.OptLevel = Arg[2] - '0';
+            continue;
+        }
+        if (strcmp(Arg, "-ffast-math") == 0) {
+            Opts.FastMath = true;
+            continue;
+        }
+        if (strcmp(Arg, "-fbounds-check") == 0) {
+            Opts.BoundsCheck = true;
+            continue;
+        }
+        if (strcmp(Arg, "-fmemoize") == 0) {
+            Opts.Memoize = true;
+            continue;
+        }
+        if (matchOption(Arg, "-mcpu", Value)) {
+            Opts.CPU = Value;
+            HasCPU = true;
+            continue;
+        }
+        if (matchOption(Arg, "-mattr", Value)) {
+            Opts.Features = Value;
+            HasFeatures = true;
+            continue;
+        }
+        if (matchOption(Arg, "-mclones", Value)) {
+            Opts.Clones.clear();
+            while (char const* Comma = strchr(Value, ',')) {
+                if (Comma != Value)
+                    Opts.Clones.emplace_back(Value, Comma - Value);
+                Value = Comma + 1;
+            }
+            if (*Value)
+                Opts.Clones.emplace_back(Value);
+            continue;
+        }
+        if (Arg[0] == '-' and Arg[1] == 'j' and isdigit(Arg[2])) {
+            Opts.Threads = atoi(Arg + 2);
+            continue;
+        }
+        if (strcmp(Arg, "-lazy") == 0) {
+            Opts.Lazy = true;
+            continue;
+        }
+        if (strcmp(Arg, "-tiered") == 0) {
+            Opts.Tiered = true;
+            continue;
+        }
+        if (matchOption(Arg, "-cache-dir", Value)) {
+            Opts.CacheDir = Value;
+            continue;
+        }
+        if (matchOption(Arg, "-cache-size", Value) and isdigit(Value[0])) {
+            Opts.CacheSize = strtoull(Value, nullptr, 10) << 20;
+            continue;
+        }
+        if (Arg[0] != '-' and !Opts.InputFile) {
+            Opts.InputFile = Arg;
+            continue;
+        }
+        fprintf(stderr, "unknown argument %s\n", Arg);
+        fprintf(stderr, "usage: %s [-O0|-O1|-O2|-O3] [-ffast-math] [-fbounds-check] "
+                "[-fmemoize] [-mcpu=<cpu>] [-mattr=<features>] [-mclones=<cpus>] "
+                "[-j<threads>] [-lazy] [-tiered] [-cache-dir=<dir>] "
+                "[-cache-size=<MB>] [file]\n",
+                argv[0]);
+        return false;
+    }
+
+    // the fallback of -mclones, and the dispatchers, have to run on the
+    // machines without any of the clone cpus, not just the one building them
+    if (!Opts.Clones.empty()) {
+        if (!HasCPU)
+            Opts.CPU = "x86-64";
+        if (!HasFeatures)
+            Opts.Features = "";
+    }
+    return true;
+}
+
+#endif // options_h
@@ -1,32 +1,103 @@
 #ifndef parser_h
 #define parser_h
 
+#include <array>
 #include <iostream>
 #include <vector>
-#include <map>
-
-#include "llvm/IR/Verifier.h"
 
 #include "ast.h"
 #include "lexer.h"
 
-// function declarations
-static std::unique_ptr<ExprAST> ParseExpression();
-static std::unique_ptr<ExprAST> ParseIfExpr();
-static std::unique_ptr<ExprAST> ParseForExpr();
+using PrecedenceTable = std::array<int, 128>;
+
+// makeDefaultBinopPrecedence - the standard binary operators, 1 is the lowest
+// precedence
+static constexpr PrecedenceTable makeDefaultBinopPrecedence() {
+    PrecedenceTable Table{};
+    for (auto &Prec : Table)
+        Prec = -1;
+    Table['='] = 2;
+    Table['<'] = 10;
+    Table['+'] = 20;
+    Table['-'] = 30;
+    Table['*'] = 40;
+    return Table;
+}
+
+static constexpr PrecedenceTable DefaultBinopPrecedence =
+    makeDefaultBinopPrecedence();
 
 //
-// provide a simple token buffer
-// CurTok is the current token the parser is looking at. getNexToken reads
-// another token from the lexer and updates CurTok with its results
+// Parser - a recursive descent parser over one Lexer. the current token and
+// the operator precedence table live in the parser, so every parser has its
+// own set of user defined binary operators
 //
-static int CurTok;
-static int getNextToken() {
-    return CurTok = gettok();
-}
+class Parser {
+    Lexer Lex;
+
+    // CurTok is the current token the parser is looking at. getNextToken
+    // reads another token from the lexer and updates CurTok with its results
+    int CurTok = 0;
+
+    // the lexer interns identifiers, the parser only interns the names it
+    // makes up itself, like those of operators
+    StringInterner &Symbols;
+
+    // the pool the body of the function being parsed goes into
+    ExprPool *Pool = nullptr;
+
+    // scratch stacks for call arguments and var bindings, reused across
+    // nested expressions so an argument list does not allocate on its own
+    std::vector<ExprId> ArgStack;
+    std::vector<VarBinding> VarStack;
+
+    // BinopPrecedence - this holds the precedence for each binary operator
+    // that is defined, indexed by the operator character. -1 marks a
+    // character that is not a binary operator
+    PrecedenceTable BinopPrecedence = DefaultBinopPrecedence;
+
+    int GetTokPrecedence();
+
+    ExprId ParseNumberExpr();
+    ExprId ParseParenAST();
+    ExprId ParseIdentifierExpr();
+    ExprId ParseVarExpr();
+    ExprId ParsePrimary();
+    ExprId ParseUnary();
+    ExprId ParseBinOpRHS(int ExprPrec, ExprId LHS);
+    ExprId ParseExpression();
+    ExprId ParseIfExpr();
+    ExprId ParseForExpr();
+    bool ParseTypeAnnotation(ValueType &Type);
+    std::unique_ptr<PrototypeAST> ParsePrototype();
+
+public:
+    Parser(SourceBuffer &Source, StringInterner &Symbols)
+        : Lex(Source, Symbols), Symbols(Symbols)
+    {}
+
+    int getCurTok() const { return CurTok; }
+    int getNextToken() {
+        return CurTok = Lex.gettok();
+    }
+
+    // isInteractive - whether each line of input waits on its results
+    bool isInteractive() const { return Lex.isInteractive(); }
+
+    // setBinopPrecedence - installs a user defined binary operator
+    void setBinopPrecedence(char Op, int Prec) {
+        if ((unsigned char)Op < BinopPrecedence.size())
+            BinopPrecedence[(unsigned char)Op] = Prec;
+    }
+
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr(
+        std::string_view Name = "__anon_expr");
+};
 
 // helper funcs
-std::unique_ptr<ExprAST> LogError(char const* Str) {
+ExprId LogError(char const* Str) {
     fprintf(stderr, "LogError: %s\n", Str);
     return nullptr;
 }
@@ -37,14 +108,14 @@ std::unique_ptr<PrototypeAST> LogErrorP(char const* Str) {
 }
 
 // numberepxr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+inline ExprId Parser::ParseNumberExpr() {
+    auto Result = Pool->addNumber(Lex.getNumVal());
     getNextToken(); // consume the number
     return Result;
 }
 
 // parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenAST() {
+inline ExprId Parser::ParseParenAST() {
     getNextToken(); // eat (
     auto V = ParseExpression();
     if (!V)
@@ -59,22 +130,35 @@ static std::unique_ptr<ExprAST> ParseParenAST() {
 // identifierexpr
 //   ::= identifier
 //   ::= identifier '(' expression ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+//   ::= identifier '[' expression ']'
+inline ExprId Parser::ParseIdentifierExpr() {
+    SymbolId IdName = Lex.getIdentifierId();
 
     getNextToken(); // eat identifier
+    if (CurTok == '[') {
+        getNextToken(); // eat [
+        auto Index = ParseExpression();
+        if (!Index)
+            return nullptr;
+        if (CurTok != ']')
+            return LogError("expected ']'");
+        getNextToken(); // eat ]
+        return Pool->addSubscript(IdName, Index);
+    }
     if (CurTok != '(')
-        return std::make_unique<VariableExprAST>(IdName);
+        return Pool->addVariable(IdName);
 
     // Call
     getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    size_t ArgBase = ArgStack.size();
     if (CurTok != ')') {
         while (1) {
             if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else 
+                ArgStack.push_back(Arg);
+            else {
+                ArgStack.resize(ArgBase);
                 return nullptr;
+            }
 
             if (CurTok == ')')
                 break;
@@ -82,58 +166,82 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
             if (CurTok == ')')
                 break;
 
-            if (CurTok != ',')
+            if (CurTok != ',') {
+                ArgStack.resize(ArgBase);
                 return LogError("Expected ')' or ',' in argument list");
+            }
             getNextToken();
         }
     }
 
     getNextToken();
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    auto Call = Pool->addCall(IdName, ArgStack.data() + ArgBase,
+                              ArgStack.size() - ArgBase);
+    ArgStack.resize(ArgBase);
+    return Call;
 }
 
-static std::unique_ptr<ExprAST> ParseVarExpr() {
+inline ExprId Parser::ParseVarExpr() {
     getNextToken();
     
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    size_t VarBase = VarStack.size();
 
     // at least one variable name is required
     if (CurTok != tok_identifier)
         return LogError("expected identifier after var");
 
     while(1) {
-        std::string Name = IdentifierStr;
+        SymbolId Name = Lex.getIdentifierId();
         getNextToken();
 
+        // read the optional type
+        ValueType Type = ValueType::Unknown;
+        if (CurTok == ':' and !ParseTypeAnnotation(Type)) {
+            VarStack.resize(VarBase);
+            return nullptr;
+        }
+
         // read the optional intiailzier
-        std::unique_ptr<ExprAST> Init;
+        ExprId Init = nullptr;
         if (CurTok == '=') {
             getNextToken();
 
             Init = ParseExpression();
-            if (!Init) return nullptr;
+            if (!Init) {
+                VarStack.resize(VarBase);
+                return nullptr;
+            }
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarStack.push_back(VarBinding{Name, Init, Type});
 
         // end of var list, exit loop.
         if (CurTok != ',') break;
         getNextToken();
 
-        if (CurTok != tok_identifier)
+        if (CurTok != tok_identifier) {
+            VarStack.resize(VarBase);
             return LogError("expected identifier list after var");
+        }
     }
 
     // at this point we have to have 'in'
-    if (CurTok != tok_in)
+    if (CurTok != tok_in) {
+        VarStack.resize(VarBase);
         return LogError("expected 'in' keywrod after 'var'");
+    }
     getNextToken();
 
     auto Body = ParseExpression();
-    if (!Body)
+    if (!Body) {
+        VarStack.resize(VarBase);
         return nullptr;
+    }
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    auto Var = Pool->addVar(VarStack.data() + VarBase,
+                            VarStack.size() - VarBase, Body);
+    VarStack.resize(VarBase);
+    return Var;
 }
 
 // primary
@@ -143,7 +251,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
 //   ::= ifexpr
 //   ::= forexpr
 //   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
+inline ExprId Parser::ParsePrimary() {
     switch (CurTok) {
     default:
         return LogError("unknown token when expecting an expression");
@@ -162,34 +270,27 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     }
 }
 
-// BinopPrecedence - this holds the precedence for each binary operator that is defined
-static std::map<char, int> BinopPrecedence;
-
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
+inline int Parser::GetTokPrecedence() {
+    if ((unsigned)CurTok >= BinopPrecedence.size())
         return -1;
-
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0) return -1;
-    return TokPrec;
+    return BinopPrecedence[CurTok];
 }
 
-static std::unique_ptr<ExprAST> ParseUnary() {
+inline ExprId Parser::ParseUnary() {
     if (!isascii(CurTok) or CurTok == '(' or CurTok == ',')
         return ParsePrimary();
 
     int Opc = CurTok;
     getNextToken();
     if (auto Operand = ParseUnary())
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+        return Pool->addUnary(Opc, Operand);
 
     return nullptr;
 }
 
 // binoprhs
 //   ::= ("+" primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+inline ExprId Parser::ParseBinOpRHS(int ExprPrec, ExprId LHS) {
     // if this is a binop, find its precedence
     while(1) {
         int TokPrec = GetTokPrecedence();
@@ -211,34 +312,90 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
         // the pending operator take RHS  as its LHS.
         int NextPrec = GetTokPrecedence();
         if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec+1, std::move(RHS));
+            RHS = ParseBinOpRHS(TokPrec+1, RHS);
             if (!RHS)
                 return nullptr;
         }
 
         // merge LHS/RHS
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
-                                              std::move(RHS));
+        LHS = Pool->addBinary(BinOp, LHS, RHS);
 
     }
 }
 
 // expression
 //   ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
+inline ExprId Parser::ParseExpression() {
     auto LHS = ParseUnary();
     if (!LHS)
         return nullptr;
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
+}
+
+// getPrototypeFlag - the flag an '@' attribute name stands for, 0 if it is
+// not one
+static unsigned getPrototypeFlag(std::string_view Name) {
+    if (Name == "fastmath")
+        return PF_FastMath;
+    if (Name == "pure")
+        return PF_Pure;
+    return 0;
+}
+
+// getValueType - the type a name stands for, Unknown if it is not one
+static ValueType getValueType(std::string_view Name) {
+    if (Name == "double")
+        return ValueType::Double;
+    if (Name == "int")
+        return ValueType::Int;
+    if (Name == "bool")
+        return ValueType::Bool;
+    if (Name == "vec2")
+        return ValueType::Vec2;
+    if (Name == "vec4")
+        return ValueType::Vec4;
+    if (Name == "vec8")
+        return ValueType::Vec8;
+    return ValueType::Unknown;
+}
+
+// typeannotation
+//   ::= ':' ('double' | 'int' | 'bool' | 'vec2' | 'vec4' | 'vec8')
+inline bool Parser::ParseTypeAnnotation(ValueType &Type) {
+    if (getNextToken() != tok_identifier) {
+        LogError("expected type name after ':'");
+        return false;
+    }
+    Type = getValueType(Lex.getIdentifier());
+    if (Type == ValueType::Unknown) {
+        LogError("unknown type name");
+        return false;
+    }
+    getNextToken();
+    return true;
 }
 
 // function prototype
 // prototype
-//   ::= id '(' id* ')'
-//   ::= binary LETTER number? (id, id)
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    std::string FnName;
+//   ::= attr* id '(' arg* ')' typeannotation?
+//   ::= attr* binary LETTER number? (arg, arg) typeannotation?
+// attr ::= '@' id
+// arg ::= id typeannotation? ('[' id ']')?
+inline std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+    unsigned Flags = 0;
+    while (CurTok == '@') {
+        if (getNextToken() != tok_identifier)
+            return LogErrorP("expected attribute name after '@'");
+        unsigned Flag = getPrototypeFlag(Lex.getIdentifier());
+        if (!Flag)
+            return LogErrorP("unknown function attribute");
+        Flags |= Flag;
+        getNextToken();
+    }
+
+    SymbolId FnName;
+    char OperatorName = 0;
 
     unsigned Kind = 0;
     unsigned BinaryPrecedence = 30;
@@ -247,7 +404,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     default:
         return LogErrorP("expected function anem in prototype");
     case tok_identifier:
-        FnName = IdentifierStr;
+        FnName = Lex.getIdentifierId();
         Kind = 0;
         getNextToken();
         break;
@@ -255,8 +412,8 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         getNextToken();
         if (!isascii(CurTok))
             return LogErrorP("expectd unary operator");
-        FnName = "unary";
-        FnName += (char)CurTok;
+        OperatorName = (char)CurTok;
+        FnName = Symbols.internOperator(false, OperatorName);
         Kind = 1;
         getNextToken();
         break;
@@ -264,16 +421,16 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         getNextToken();
         if (!isascii(CurTok))
             return LogErrorP("expected binary operator");
-        FnName = "binary";
-        FnName += (char)CurTok;
+        OperatorName = (char)CurTok;
+        FnName = Symbols.internOperator(true, OperatorName);
         Kind = 2;
         getNextToken();
 
         // read the precedence if present
         if (CurTok == tok_number) {
-            if (NumVal < 1 || NumVal > 100)
+            if (Lex.getNumVal() < 1 || Lex.getNumVal() > 100)
                 return LogErrorP("invalid precedence: must be 1..100");
-            BinaryPrecedence = (unsigned)NumVal;
+            BinaryPrecedence = (unsigned)Lex.getNumVal();
             getNextToken();
         }
         break;
@@ -282,55 +439,111 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (CurTok != '(')
         return LogErrorP("expected '(' in prototype");
 
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
+    std::vector<SymbolId> ArgNames;
+    std::vector<ValueType> ArgTypes;
+    std::vector<SymbolId> LengthNames;
+    getNextToken(); // eat (
+    while (CurTok == tok_identifier) {
+        ArgNames.push_back(Lex.getIdentifierId());
+        ValueType Type = ValueType::Double;
+        if (getNextToken() == ':' and !ParseTypeAnnotation(Type))
+            return nullptr;
+
+        // an array, with the name of the argument holding its length
+        SymbolId LengthName = ~0u;
+        if (CurTok == '[') {
+            if (Type == ValueType::Double)
+                Type = ValueType::DoubleArray;
+            else if (Type == ValueType::Int)
+                Type = ValueType::IntArray;
+            else
+                return LogErrorP("arrays can only hold doubles or ints");
+            if (getNextToken() != tok_identifier)
+                return LogErrorP("expected array length argument");
+            LengthName = Lex.getIdentifierId();
+            if (getNextToken() != ']')
+                return LogErrorP("expected ']' in prototype");
+            getNextToken();
+        }
+        ArgTypes.push_back(Type);
+        LengthNames.push_back(LengthName);
+    }
     if (CurTok != ')')
         return LogErrorP("expected ')' in prototype");
 
+    // the length of an array is one of the int arguments
+    std::vector<unsigned> ArrayLengths(ArgNames.size(), ~0u);
+    for (unsigned i = 0; i != ArgNames.size(); ++i) {
+        if (LengthNames[i] == ~0u)
+            continue;
+        for (unsigned j = 0; j != ArgNames.size(); ++j)
+            if (ArgNames[j] == LengthNames[i])
+                ArrayLengths[i] = j;
+        if (ArrayLengths[i] == ~0u or
+            ArgTypes[ArrayLengths[i]] != ValueType::Int)
+            return LogErrorP("array length must be an int argument");
+    }
+
     // success
     getNextToken();
 
+    ValueType ReturnType = ValueType::Double;
+    if (CurTok == ':' and !ParseTypeAnnotation(ReturnType))
+        return nullptr;
+
     // verify right number of names for operator
     if (Kind and ArgNames.size() != Kind)
         return LogErrorP("invalid number of operands for operator");
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0, 
-        BinaryPrecedence);
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), OperatorName,
+        BinaryPrecedence, Flags, std::move(ArgTypes), ReturnType,
+        std::move(ArrayLengths));
 }
 
 // definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+inline std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
     getNextToken();
     auto Proto = ParsePrototype();
     if (!Proto) return nullptr;
 
+    // every node of the body goes into the function's own pool
+    ExprPool FnPool;
+    Pool = &FnPool;
     if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return std::make_unique<FunctionAST>(std::move(Proto),
+                                             std::move(FnPool), E);
     return nullptr;
 }
 
 // external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+inline std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
     getNextToken(); // eat extern
-    return ParsePrototype();
+    auto Proto = ParsePrototype();
+    if (Proto)
+        Proto->setFlag(PF_Extern);
+    return Proto;
 }
 
 
 // toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+// the expression is wrapped in an anonymous function called Name
+inline std::unique_ptr<FunctionAST>
+Parser::ParseTopLevelExpr(std::string_view Name) {
+    ExprPool FnPool;
+    Pool = &FnPool;
     if (auto E = ParseExpression()) {
         // make an anonymous proto
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", 
-                                                    std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto = std::make_unique<PrototypeAST>(Symbols.intern(Name),
+                                                    std::vector<SymbolId>());
+        return std::make_unique<FunctionAST>(std::move(Proto),
+                                             std::move(FnPool), E);
     }
 
     return nullptr;
 }
 
 // ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+inline ExprId Parser::ParseIfExpr() {
     getNextToken();
 
     // condition
@@ -355,19 +568,25 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
     if (!Else)
         return nullptr;
 
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+    return Pool->addIf(Cond, Then, Else);
 }
 
-// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
+// forexpr
+//   ::= 'for' identifier typeannotation? '=' expr ',' expr (',' expr)?
+//       'in' expression
+inline ExprId Parser::ParseForExpr() {
     getNextToken();
 
     if (CurTok != tok_identifier)
         return LogError("expected identifier after for");
 
-    std::string IdName = IdentifierStr;
+    SymbolId IdName = Lex.getIdentifierId();
     getNextToken();
 
+    ValueType VarType = ValueType::Unknown;
+    if (CurTok == ':' and !ParseTypeAnnotation(VarType))
+        return nullptr;
+
     if (CurTok != '=')
         return LogError("expected '=' after for");
     getNextToken();
@@ -383,7 +602,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if (!End)
         return nullptr;
 
-    std::unique_ptr<ExprAST> Step;
+    ExprId Step = nullptr;
     if (CurTok == ',') {
         getNextToken();
         Step = ParseExpression();
@@ -399,9 +618,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if (!Body)
         return nullptr;
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start),
-                                        std::move(End), std::move(Step),
-                                        std::move(Body));
+    return Pool->addFor(IdName, Start, End, Step, Body, VarType);
 }
 
 #endif // parser_h
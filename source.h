@@ -0,0 +1,136 @@
+#ifndef source_h
+#define source_h
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// source buffer the lexer scans by pointer. a file is mmap'd in one go, a
+// piped stdin is slurped with large reads, and an interactive stdin is pulled
+// in a line at a time so the repl still answers after every line
+//
+class SourceBuffer {
+    const char *BufStart = nullptr;
+    const char *BufEnd = nullptr;
+
+    // backing storage: a read-only mapping or an owned buffer
+    void *Mapping = nullptr;
+    size_t MappingSize = 0;
+    std::vector<char> Storage;
+
+    // set for an interactive stdin, refill() reads the next line from it
+    FILE *Stream = nullptr;
+    char *Line = nullptr;
+    size_t LineCap = 0;
+
+    SourceBuffer() = default;
+
+    void setStorage() {
+        BufStart = Storage.data();
+        BufEnd = BufStart + Storage.size();
+    }
+
+    bool readAll(int FD) {
+        size_t Size = 0;
+        Storage.resize(1 << 16);
+        while (1) {
+            if (Size == Storage.size())
+                Storage.resize(Storage.size() * 2);
+
+            ssize_t N = read(FD, Storage.data() + Size, Storage.size() - Size);
+            if (N == 0)
+                break;
+            if (N < 0)
+                return false;
+            Size += N;
+        }
+        Storage.resize(Size);
+        setStorage();
+        return true;
+    }
+
+public:
+    SourceBuffer(SourceBuffer const&) = delete;
+    SourceBuffer &operator=(SourceBuffer const&) = delete;
+
+    ~SourceBuffer() {
+        if (Mapping)
+            munmap(Mapping, MappingSize);
+        free(Line);
+    }
+
+    // getFile - maps the file at Path, returns null if it can not be read
+    static std::unique_ptr<SourceBuffer> getFile(char const* Path) {
+        int FD = open(Path, O_RDONLY);
+        if (FD < 0)
+            return nullptr;
+
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+        struct stat St;
+        if (fstat(FD, &St) == 0 and S_ISREG(St.st_mode) and St.st_size > 0) {
+            void *P = mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+            if (P != MAP_FAILED) {
+                madvise(P, St.st_size, MADV_SEQUENTIAL);
+                SB->Mapping = P;
+                SB->MappingSize = St.st_size;
+                SB->BufStart = static_cast<char const*>(P);
+                SB->BufEnd = SB->BufStart + St.st_size;
+                close(FD);
+                return SB;
+            }
+        }
+
+        // not mappable (empty file, pipe, ...), fall back to reading it
+        bool Ok = SB->readAll(FD);
+        close(FD);
+        if (!Ok)
+            return nullptr;
+        return SB;
+    }
+
+    // getSTDIN - reads standard input, a line at a time when it is a terminal
+    static std::unique_ptr<SourceBuffer> getSTDIN() {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+        if (isatty(STDIN_FILENO)) {
+            SB->Stream = stdin;
+            return SB;
+        }
+
+        if (!SB->readAll(STDIN_FILENO))
+            return nullptr;
+        return SB;
+    }
+
+    char const* getBufferStart() const { return BufStart; }
+    char const* getBufferEnd() const { return BufEnd; }
+
+    // isInteractive - whether the input is read a line at a time from a
+    // terminal, someone is waiting on each line
+    bool isInteractive() const { return Stream != nullptr; }
+
+    // refill - replaces the buffer with the next line of an interactive
+    // stream. returns false at the end of input. pointers into the previous
+    // buffer are invalidated
+    bool refill() {
+        if (!Stream)
+            return false;
+
+        ssize_t N = getline(&Line, &LineCap, Stream);
+        if (N <= 0) {
+            Stream = nullptr;
+            return false;
+        }
+        BufStart = Line;
+        BufEnd = Line + N;
+        return true;
+    }
+};
+
+#endif // source_h
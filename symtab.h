@@ -0,0 +1,70 @@
+#ifndef symtab_h
+#define symtab_h
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "interner.h"
+
+//
+// SymbolIdMap - a map from SymbolId to T stored as a dense vector. ids are
+// handed out densely by the interner, so a lookup is an index and a missing
+// entry is a default constructed T
+//
+template <typename T>
+class SymbolIdMap {
+    std::vector<T> Values;
+
+public:
+    T const& lookup(SymbolId Id) const {
+        static T const Empty{};
+        return Id < Values.size() ? Values[Id] : Empty;
+    }
+
+    T &operator[](SymbolId Id) {
+        if (Id >= Values.size())
+            Values.resize(Id + 1);
+        return Values[Id];
+    }
+
+    void clear() { Values.clear(); }
+};
+
+//
+// ScopedSymbolTable - the variables visible while emitting a function. each
+// name has one current binding, found in constant time. binding a name saves
+// the binding it shadows on a stack, and leaving a scope pops that stack
+// back to where it was when the scope was entered
+//
+template <typename T>
+class ScopedSymbolTable {
+    SymbolIdMap<T*> Bindings;
+    std::vector<std::pair<SymbolId, T*>> Shadowed;
+
+public:
+    using Scope = size_t;
+
+    T *lookup(SymbolId Id) const { return Bindings.lookup(Id); }
+
+    Scope enterScope() const { return Shadowed.size(); }
+
+    void bind(SymbolId Id, T *Value) {
+        T *&Slot = Bindings[Id];
+        Shadowed.emplace_back(Id, Slot);
+        Slot = Value;
+    }
+
+    void leaveScope(Scope S) {
+        while (Shadowed.size() > S) {
+            Bindings[Shadowed.back().first] = Shadowed.back().second;
+            Shadowed.pop_back();
+        }
+    }
+
+    // clear - drops every binding, including those of scopes that were left
+    // early on an error
+    void clear() { leaveScope(0); }
+};
+
+#endif // symtab_h
@@ -0,0 +1,485 @@
+#ifndef types_h
+#define types_h
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "builtins.h"
+#include "interner.h"
+#include "parser.h"
+#include "symtab.h"
+
+//
+// types: double, int (i64) and bool (i1). arguments and results of
+// functions are doubles unless annotated, the types of var and for
+// variables are inferred from their initializers, and every expression
+// gets its type from its operands:
+//
+//   + - *     int if both operands are int or bool, double otherwise
+//   <         bool
+//   if        the wider of the two branches
+//   for       0, a double
+//
+// a value converts to a wider type implicitly, bool to int to double,
+// never the other way. the exception are constants: a number literal is a
+// double, but one with an integer value, or + - * or an if of such
+// literals, or the 0 of a for loop, takes the type int where an int is
+// wanted. so `var i:int = 0` and `i + 1` stay integers while unannotated
+// code means what it always did
+//
+// any type can be a condition: zero is false, for a double also NaN
+//
+// arrays, `a:double[n]` or `a:int[n]`, are only arguments. they can be
+// indexed with an int, a[i], and passed on to a function taking the same
+// type of array, nothing else
+//
+// vectors, vec2 vec4 and vec8, hold 2, 4 or 8 doubles. + - * work lanewise
+// and < gives 1 or 0 in each lane. a scalar converts to a vector by going
+// into every lane, v[i] is one lane. a vector can not be a condition
+//
+
+using PrototypeMap = SymbolIdMap<std::unique_ptr<PrototypeAST>>;
+
+// getCalledBuiltin - the builtin called by a call of Name, whose prototype
+// is Proto if one was declared. a declared function hides a builtin, but a
+// math builtin still replaces an extern of all doubles with its arity
+inline Builtin getCalledBuiltin(StringInterner const& Symbols,
+                                PrototypeAST const* Proto, SymbolId Name) {
+    Builtin B = getBuiltin(Symbols.getName(Name));
+    if (!Proto)
+        return B;
+    unsigned Arity = getMathArity(B);
+    if (Arity == 0 or !Proto->hasFlag(PF_Extern) or
+        Proto->getArgs().size() != Arity or
+        Proto->getReturnType() != ValueType::Double)
+        return Builtin::None;
+    for (unsigned i = 0; i != Arity; ++i)
+        if (Proto->getArgType(i) != ValueType::Double)
+            return Builtin::None;
+    return B;
+}
+
+// getTypeName - the name a type is written as
+inline char const* getTypeName(ValueType T) {
+    switch (T) {
+    case ValueType::Double:
+        return "double";
+    case ValueType::Int:
+        return "int";
+    case ValueType::Bool:
+        return "bool";
+    case ValueType::DoubleArray:
+        return "double[]";
+    case ValueType::IntArray:
+        return "int[]";
+    case ValueType::Vec2:
+        return "vec2";
+    case ValueType::Vec4:
+        return "vec4";
+    case ValueType::Vec8:
+        return "vec8";
+    case ValueType::Unknown:
+        break;
+    }
+    return "unknown";
+}
+
+// isWiderOrSame - whether a From converts to a To implicitly
+inline bool isWiderOrSame(ValueType To, ValueType From) {
+    if (To == From)
+        return true;
+    if (isArrayType(From) or isVectorType(From))
+        return false;
+    return To == ValueType::Double or isVectorType(To) or
+           (To == ValueType::Int and From == ValueType::Bool);
+}
+
+// getCommonType - the narrowest type A and B convert to, neither is an
+// array and they are not vectors of different widths
+inline ValueType getCommonType(ValueType A, ValueType B) {
+    if (A == B or isVectorType(A))
+        return A;
+    if (isVectorType(B))
+        return B;
+    if (A == ValueType::Double or B == ValueType::Double)
+        return ValueType::Double;
+    return ValueType::Int;
+}
+
+//
+// TypeChecker - infers the type of every expression of a function body and
+// checks the conversions between them. the types go into the body's pool,
+// the inferred types of var and for variables into their nodes. calls of
+// unknown functions and uses of unknown variables are left for codegen to
+// report, their type is double
+//
+class TypeChecker {
+    ExprPool &Pool;
+    PrototypeMap const& Protos;
+    StringInterner &Symbols;
+
+    // the variables in scope, innermost last
+    std::vector<std::pair<SymbolId, ValueType>> Env;
+
+    ValueType lookup(SymbolId Name) const {
+        for (size_t i = Env.size(); i != 0; --i)
+            if (Env[i - 1].first == Name)
+                return Env[i - 1].second;
+        return ValueType::Unknown;
+    }
+
+    bool error(ValueType To, ValueType From) const {
+        std::string Msg = std::string("can not convert ") + getTypeName(From) +
+                          " to " + getTypeName(To);
+        LogError(Msg.c_str());
+        return false;
+    }
+
+    // isNotArray - whether E is not an array, an error if it is
+    bool isNotArray(ExprId E) const {
+        if (!isArrayType(Pool.getType(E)))
+            return true;
+        LogError("an array can only be indexed or passed to a function");
+        return false;
+    }
+
+    // isScalar - whether E is neither an array nor a vector
+    bool isScalar(ExprId E) const {
+        if (!isNotArray(E))
+            return false;
+        if (!isVectorType(Pool.getType(E)))
+            return true;
+        LogError("expected a scalar, not a vector");
+        return false;
+    }
+
+    bool isIntConstant(ExprId E) const;
+    void makeInt(ExprId E);
+    bool convert(ExprId E, ValueType To);
+    bool unify(ExprId A, ExprId B, ValueType &Common);
+
+    bool checkCall(PrototypeAST const* Callee, ExprId const* Args,
+                   unsigned NumArgs, ExprId E);
+    bool checkBuiltin(Builtin B, ExprId const* Args, unsigned NumArgs,
+                      ExprId E);
+    bool check(ExprId E);
+
+public:
+    TypeChecker(ExprPool &Pool, PrototypeMap const& Protos,
+                StringInterner &Symbols)
+        : Pool(Pool), Protos(Protos), Symbols(Symbols) {}
+
+    // checkFunction - infers the types of Body, the body of Proto. returns
+    // false with an error message if a conversion is not allowed
+    bool checkFunction(PrototypeAST const& Proto, ExprId Body);
+};
+
+// isIntConstant - whether E is a double built of integer literals only, by
+// + - * or as both branches of an if. a for loop is the constant 0
+inline bool TypeChecker::isIntConstant(ExprId E) const {
+    if (Pool.getType(E) != ValueType::Double)
+        return false;
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number: {
+        double Val = Pool.getNumber(E).Val;
+        return Val == std::trunc(Val) and std::fabs(Val) < 0x1p53;
+    }
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (B.Op != '+' and B.Op != '-' and B.Op != '*')
+            return false;
+        return isIntConstant(B.LHS) and isIntConstant(B.RHS);
+    }
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        return isIntConstant(If.Then) and isIntConstant(If.Else);
+    }
+    case ExprKind::For:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// makeInt - retypes an int constant as int
+inline void TypeChecker::makeInt(ExprId E) {
+    Pool.setType(E, ValueType::Int);
+    if (Pool.getKind(E) == ExprKind::Binary) {
+        makeInt(Pool.getBinary(E).LHS);
+        makeInt(Pool.getBinary(E).RHS);
+    } else if (Pool.getKind(E) == ExprKind::If) {
+        makeInt(Pool.getIf(E).Then);
+        makeInt(Pool.getIf(E).Else);
+    }
+}
+
+// convert - checks that E converts to To
+inline bool TypeChecker::convert(ExprId E, ValueType To) {
+    ValueType From = Pool.getType(E);
+    if (isWiderOrSame(To, From))
+        return true;
+    if (To == ValueType::Int and isIntConstant(E)) {
+        makeInt(E);
+        return true;
+    }
+    return error(To, From);
+}
+
+// unify - the common type of A and B, an int constant next to an int or a
+// bool becomes an int
+inline bool TypeChecker::unify(ExprId A, ExprId B, ValueType &Common) {
+    if (!isNotArray(A) or !isNotArray(B))
+        return false;
+    ValueType TA = Pool.getType(A), TB = Pool.getType(B);
+    if (isVectorType(TA) and isVectorType(TB) and TA != TB)
+        return error(TA, TB);
+    auto isInteger = [](ValueType T) {
+        return T == ValueType::Int or T == ValueType::Bool;
+    };
+    if (isInteger(TA) and isIntConstant(B))
+        makeInt(B);
+    else if (isInteger(TB) and isIntConstant(A))
+        makeInt(A);
+    Common = getCommonType(Pool.getType(A), Pool.getType(B));
+    return true;
+}
+
+inline bool TypeChecker::checkCall(PrototypeAST const* Callee,
+                                   ExprId const* Args, unsigned NumArgs,
+                                   ExprId E) {
+    for (unsigned i = 0; i != NumArgs; ++i)
+        if (!check(Args[i]))
+            return false;
+
+    // an argument count mismatch is reported by codegen
+    if (!Callee or Callee->getArgs().size() != NumArgs) {
+        Pool.setType(E, ValueType::Double);
+        return true;
+    }
+
+    for (unsigned i = 0; i != NumArgs; ++i)
+        if (!convert(Args[i], Callee->getArgType(i)))
+            return false;
+    Pool.setType(E, Callee->getReturnType());
+    return true;
+}
+
+inline bool TypeChecker::checkBuiltin(Builtin B, ExprId const* Args,
+                                      unsigned NumArgs, ExprId E) {
+    for (unsigned i = 0; i != NumArgs; ++i)
+        if (!check(Args[i]))
+            return false;
+
+    switch (B) {
+    case Builtin::Vec2:
+    case Builtin::Vec4:
+    case Builtin::Vec8: {
+        ValueType T = B == Builtin::Vec2   ? ValueType::Vec2
+                      : B == Builtin::Vec4 ? ValueType::Vec4
+                                           : ValueType::Vec8;
+        if (NumArgs != 1 and NumArgs != getVectorWidth(T)) {
+            LogError("a vector takes one value or one per lane");
+            return false;
+        }
+        for (unsigned i = 0; i != NumArgs; ++i)
+            if (!convert(Args[i], ValueType::Double))
+                return false;
+        Pool.setType(E, T);
+        return true;
+    }
+    case Builtin::HSum:
+    case Builtin::HMin:
+    case Builtin::HMax:
+        if (NumArgs != 1 or !isVectorType(Pool.getType(Args[0]))) {
+            LogError("a reduction takes one vector");
+            return false;
+        }
+        Pool.setType(E, ValueType::Double);
+        return true;
+    default:
+        break;
+    }
+
+    // math takes doubles, or vectors of one width and works lanewise
+    if (NumArgs != getMathArity(B)) {
+        LogError("incorrect # arguments passed");
+        return false;
+    }
+    ValueType T = ValueType::Double;
+    for (unsigned i = 0; i != NumArgs; ++i) {
+        ValueType ArgType = Pool.getType(Args[i]);
+        if (isVectorType(ArgType) and !isVectorType(T))
+            T = ArgType;
+    }
+    for (unsigned i = 0; i != NumArgs; ++i)
+        if (!convert(Args[i], T))
+            return false;
+    Pool.setType(E, T);
+    return true;
+}
+
+inline bool TypeChecker::check(ExprId E) {
+    switch (Pool.getKind(E)) {
+    case ExprKind::Number:
+        return true;
+
+    case ExprKind::Variable: {
+        ValueType T = lookup(Pool.getVariable(E).Name);
+        Pool.setType(E, T == ValueType::Unknown ? ValueType::Double : T);
+        return true;
+    }
+
+    case ExprKind::Unary: {
+        UnaryExprAST U = Pool.getUnary(E);
+        auto &Callee = Protos.lookup(Symbols.internOperator(false, U.Opcode));
+        return checkCall(Callee.get(), &U.Operand, 1, E);
+    }
+
+    case ExprKind::Binary: {
+        BinaryExprAST B = Pool.getBinary(E);
+        if (!check(B.LHS) or !check(B.RHS))
+            return false;
+
+        ValueType Common;
+        switch (B.Op) {
+        case '=':
+            Pool.setType(E, Pool.getType(B.LHS));
+            return isNotArray(B.LHS) and convert(B.RHS, Pool.getType(B.LHS));
+        case '+':
+        case '-':
+        case '*':
+            // arithmetic on two bools is on ints, true + true is 2
+            if (!unify(B.LHS, B.RHS, Common))
+                return false;
+            Pool.setType(E, Common == ValueType::Bool ? ValueType::Int : Common);
+            return true;
+        case '<':
+            if (!unify(B.LHS, B.RHS, Common))
+                return false;
+            Pool.setType(E, isVectorType(Common) ? Common : ValueType::Bool);
+            return true;
+        default: {
+            auto &Callee = Protos.lookup(Symbols.internOperator(true, B.Op));
+            ExprId Ops[2] = {B.LHS, B.RHS};
+            return checkCall(Callee.get(), Ops, 2, E);
+        }
+        }
+    }
+
+    case ExprKind::Call: {
+        CallExprAST C = Pool.getCall(E);
+        std::vector<ExprId> Args;
+        for (unsigned i = 0; i != C.NumArgs; ++i)
+            Args.push_back(C.getArg(i));
+        auto &Callee = Protos.lookup(C.Callee);
+        Builtin B = getCalledBuiltin(Symbols, Callee.get(), C.Callee);
+        if (B != Builtin::None) {
+            Pool.setBuiltin(E, B);
+            return checkBuiltin(B, Args.data(), C.NumArgs, E);
+        }
+        return checkCall(Callee.get(), Args.data(), C.NumArgs, E);
+    }
+
+    case ExprKind::If: {
+        IfExprAST If = Pool.getIf(E);
+        ValueType Common;
+        if (!check(If.Cond) or !isScalar(If.Cond) or !check(If.Then) or
+            !check(If.Else) or !unify(If.Then, If.Else, Common))
+            return false;
+        Pool.setType(E, Common);
+        return true;
+    }
+
+    case ExprKind::For: {
+        // the loop variable is an int if it starts out as one, unless
+        // annotated. the step is converted to its type
+        ForExprAST F = Pool.getFor(E);
+        if (!check(F.Start) or !isScalar(F.Start))
+            return false;
+
+        ValueType VarType = F.VarType;
+        if (isVectorType(VarType)) {
+            LogError("a loop variable can not be a vector");
+            return false;
+        }
+        if (VarType == ValueType::Unknown)
+            VarType = getCommonType(Pool.getType(F.Start), ValueType::Int);
+        if (!convert(F.Start, VarType))
+            return false;
+        Pool.setForVarType(E, VarType);
+
+        size_t Scope = Env.size();
+        Env.emplace_back(F.VarName, VarType);
+        bool Ok = check(F.End) and isScalar(F.End) and check(F.Body) and
+                  (!F.Step or (check(F.Step) and convert(F.Step, VarType)));
+        Env.resize(Scope);
+
+        Pool.setType(E, ValueType::Double);
+        return Ok;
+    }
+
+    case ExprKind::Var: {
+        VarExprAST V = Pool.getVar(E);
+        size_t Scope = Env.size();
+        for (unsigned i = 0; i != V.NumVars; ++i) {
+            VarBinding B = V.getVar(i);
+            ValueType T = B.Type;
+            if (B.Init) {
+                if (!check(B.Init) or !isNotArray(B.Init)) {
+                    Env.resize(Scope);
+                    return false;
+                }
+                if (T == ValueType::Unknown)
+                    T = Pool.getType(B.Init);
+                else if (!convert(B.Init, T)) {
+                    Env.resize(Scope);
+                    return false;
+                }
+            } else if (T == ValueType::Unknown) {
+                T = ValueType::Double;
+            }
+            Pool.setVarType(E, i, T);
+            Env.emplace_back(B.Name, T);
+        }
+
+        bool Ok = check(V.Body);
+        Env.resize(Scope);
+        Pool.setType(E, Pool.getType(V.Body));
+        return Ok;
+    }
+
+    case ExprKind::Subscript: {
+        SubscriptExprAST S = Pool.getSubscript(E);
+        ValueType T = lookup(S.Array);
+        if (isVectorType(T)) {
+            Pool.setType(E, ValueType::Double);
+            return check(S.Index) and convert(S.Index, ValueType::Int);
+        }
+        if (!isArrayType(T)) {
+            // an unknown name is left to codegen like any other
+            Pool.setType(E, ValueType::Double);
+            if (T == ValueType::Unknown)
+                return check(S.Index);
+            LogError("subscripted value is not an array or a vector");
+            return false;
+        }
+        Pool.setType(E, getElementType(T));
+        return check(S.Index) and convert(S.Index, ValueType::Int);
+    }
+    }
+    return false;
+}
+
+inline bool TypeChecker::checkFunction(PrototypeAST const& Proto,
+                                       ExprId Body) {
+    Env.clear();
+    for (unsigned i = 0, e = Proto.getArgs().size(); i != e; ++i)
+        Env.emplace_back(Proto.getArgs()[i], Proto.getArgType(i));
+    return check(Body) and convert(Body, Proto.getReturnType());
+}
+
+#endif // types_h
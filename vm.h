@@ -0,0 +1,788 @@
+#ifndef vm_h
+#define vm_h
+
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ast.h"
+#include "bytecode.h"
+#include "check.h"
+#include "interner.h"
+#include "parser.h"
+#include "symtab.h"
+#include "types.h"
+
+//
+// the vm, a backend that needs nothing of LLVM. a definition is checked and
+// folded the way the jit does it (check.h), compiled to bytecode in one pass
+// over its pool (bytecode.h) and run by the VirtualMachine. there is no
+// optimizer and no native code, so a definition is ready in microseconds
+// and a top-level expression runs as soon as it is read, while a hot loop
+// runs several times slower than the jit's code
+//
+// the vm computes what the compiled code computes: the same types and
+// conversions, the same order of evaluation, the same memo tables, and tail
+// calls that take no stack. it calls the C functions of the process taking
+// and returning scalars, up to six arguments, arrays included. an index out
+// of bounds under -fbounds-check ends the top-level expression with an
+// error instead of a trap
+//
+
+// HostThunk - calls the C function Fn on the arguments in Args
+using HostThunk = void (*)(void *Fn, Register const* Args, Register &Result);
+
+// the most arguments a C function the vm calls can take
+static constexpr unsigned MaxHostArgs = 6;
+
+// HostArg - the type of argument I of a C function, an i64 if bit I of
+// IntMask is set (an int, a bool or an array), a double otherwise
+template <unsigned IntMask, size_t I>
+using HostArg = std::conditional_t<((IntMask >> I) & 1) != 0, int64_t, double>;
+
+template <unsigned IntMask, size_t I>
+inline HostArg<IntMask, I> getHostArg(Register const* Args) {
+    if constexpr (((IntMask >> I) & 1) != 0)
+        return Args[I].I;
+    else
+        return Args[I].D;
+}
+
+template <typename R, unsigned IntMask, size_t... Is>
+void callHost(void *Fn, [[maybe_unused]] Register const* Args,
+              Register &Result) {
+    using FnT = R (*)(HostArg<IntMask, Is>...);
+    R V = reinterpret_cast<FnT>(Fn)(getHostArg<IntMask, Is>(Args)...);
+    if constexpr (std::is_same_v<R, double>)
+        Result.D = V;
+    else
+        Result.I = V;
+}
+
+template <typename R, unsigned IntMask, size_t... Is>
+constexpr HostThunk makeHostThunk(std::index_sequence<Is...>) {
+    return &callHost<R, IntMask, Is...>;
+}
+
+// makeHostThunks - the thunks for N arguments, one for each IntMask
+template <typename R, size_t N, size_t... Masks>
+constexpr std::array<HostThunk, sizeof...(Masks)>
+makeHostThunks(std::index_sequence<Masks...>) {
+    return {{makeHostThunk<R, Masks>(std::make_index_sequence<N>())...}};
+}
+
+// getHostThunk - the thunk calling a C function returning R
+template <typename R>
+HostThunk getHostThunk(unsigned NumArgs, unsigned IntMask) {
+    static constexpr auto Thunks0 =
+        makeHostThunks<R, 0>(std::make_index_sequence<1>());
+    static constexpr auto Thunks1 =
+        makeHostThunks<R, 1>(std::make_index_sequence<2>());
+    static constexpr auto Thunks2 =
+        makeHostThunks<R, 2>(std::make_index_sequence<4>());
+    static constexpr auto Thunks3 =
+        makeHostThunks<R, 3>(std::make_index_sequence<8>());
+    static constexpr auto Thunks4 =
+        makeHostThunks<R, 4>(std::make_index_sequence<16>());
+    static constexpr auto Thunks5 =
+        makeHostThunks<R, 5>(std::make_index_sequence<32>());
+    static constexpr auto Thunks6 =
+        makeHostThunks<R, 6>(std::make_index_sequence<64>());
+    static_assert(MaxHostArgs == 6, "a table of thunks for each count");
+
+    switch (NumArgs) {
+    case 0:
+        return Thunks0[IntMask];
+    case 1:
+        return Thunks1[IntMask];
+    case 2:
+        return Thunks2[IntMask];
+    case 3:
+        return Thunks3[IntMask];
+    case 4:
+        return Thunks4[IntMask];
+    case 5:
+        return Thunks5[IntMask];
+    case 6:
+        return Thunks6[IntMask];
+    default:
+        return nullptr;
+    }
+}
+
+// MemoTable - the memo table of a memoized function, f.memo in codegen.h:
+// MemoSlots entries of the argument bits, the bits of the result and
+// whether the entry is full
+class MemoTable {
+    unsigned NumKeys;
+    std::vector<uint64_t> Entries;
+
+    uint64_t *getEntry(uint64_t Slot) {
+        return &Entries[Slot * (NumKeys + 2)];
+    }
+
+public:
+    explicit MemoTable(unsigned NumKeys)
+        : NumKeys(NumKeys), Entries(MemoSlots * (NumKeys + 2)) {}
+
+    // lookup - the result for the arguments Args, if the table has it.
+    // otherwise Slot is where it goes once it is evaluated
+    bool lookup(Register const* Args, Register &Result, uint64_t &Slot) {
+        uint64_t Hash = 0;
+        for (unsigned i = 0; i != NumKeys; ++i)
+            Hash = (Hash ^ uint64_t(Args[i].I)) * 0x9e3779b97f4a7c15;
+        uint64_t Home = Hash >> (64 - MemoBits);
+
+        Slot = Home;
+        for (uint64_t Probe = 0; Probe != MemoProbes; ++Probe) {
+            uint64_t *Entry = getEntry(Slot);
+            if (!Entry[NumKeys + 1])
+                return false;
+            bool Match = true;
+            for (unsigned i = 0; i != NumKeys; ++i)
+                Match = Match and Entry[i] == uint64_t(Args[i].I);
+            if (Match) {
+                Result.I = Entry[NumKeys];
+                return true;
+            }
+            Slot = (Slot + 1) & (MemoSlots - 1);
+        }
+
+        // after MemoProbes full slots the miss takes the first one
+        Slot = Home;
+        return false;
+    }
+
+    void fill(uint64_t Slot, uint64_t const* Keys, Register Result) {
+        uint64_t *Entry = getEntry(Slot);
+        std::copy(Keys, Keys + NumKeys, Entry);
+        Entry[NumKeys] = Result.I;
+        Entry[NumKeys + 1] = 1;
+    }
+};
+
+// VMFunction - a function as the vm knows it: its bytecode, or the C
+// function it calls, or neither while it is only declared. Callees[i] is
+// the function Code->Callees[i] named when the code was installed
+struct VMFunction {
+    PrototypeAST Proto;
+    std::unique_ptr<BytecodeFunction> Code;
+    std::vector<VMFunction*> Callees;
+    void *Host = nullptr;
+    HostThunk Thunk = nullptr;
+
+    // a memoized function gets its table on the first call
+    bool Memoize = false;
+    std::unique_ptr<MemoTable> Memo;
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+
+    explicit VMFunction(PrototypeAST Proto) : Proto(std::move(Proto)) {}
+
+    bool isDefined() const { return Code or Host; }
+};
+
+class VirtualMachine {
+public:
+    // the registers of all frames and the frames a run may take, past
+    // either it ends with a stack overflow
+    static constexpr size_t MaxRegisters = size_t(1) << 24;
+    static constexpr size_t MaxFrames = size_t(1) << 22;
+
+private:
+    static constexpr uint64_t NoSlot = ~uint64_t(0);
+
+    // every function ever defined or declared. a call is bound to the
+    // function of its name when the calling code is installed, like the jit
+    // links a module to the symbols defined before it
+    std::vector<std::unique_ptr<VMFunction>> Records;
+    SymbolIdMap<VMFunction*> Functions;
+
+    // Frame - a running call. the caller's state to return to, and the memo
+    // slot the result goes to
+    struct Frame {
+        VMFunction *Caller;
+        uint32_t const* ReturnPC;
+        size_t CallerBase;
+        uint32_t Dest;
+        uint64_t MemoSlot;
+    };
+    std::vector<Register> Stack;
+    std::vector<Frame> Frames;
+
+    // the arguments of the memoized calls that missed, innermost last
+    std::vector<uint64_t> MemoKeys;
+
+    VMFunction *addRecord(PrototypeAST const& P) {
+        Records.push_back(std::make_unique<VMFunction>(P));
+        Functions[P.getName()] = Records.back().get();
+        return Records.back().get();
+    }
+
+    static bool isSameType(PrototypeAST const& A, PrototypeAST const& B) {
+        if (A.getReturnType() != B.getReturnType() or
+            A.getArgs().size() != B.getArgs().size())
+            return false;
+        for (unsigned i = 0, e = A.getArgs().size(); i != e; ++i)
+            if (A.getArgType(i) != B.getArgType(i))
+                return false;
+        return true;
+    }
+
+    void resolveCallees(VMFunction &F, PrototypeMap const& Protos);
+    bool lookupMemo(VMFunction &F, Register const* Args, Register &Result,
+                    uint64_t &Slot);
+    bool run(VMFunction *F, Register *Result);
+
+    // reserve - makes room for Size registers, false if that is too many
+    bool reserve(size_t Size) {
+        if (Size <= Stack.size())
+            return true;
+        if (Size > MaxRegisters)
+            return false;
+        Stack.resize(std::max(Size, std::min(2 * Stack.size(), MaxRegisters)));
+        return true;
+    }
+
+public:
+    VMFunction *getFunction(SymbolId Name) { return Functions.lookup(Name); }
+
+    // define - installs the code of a definition. it replaces a function
+    // of the name that was only declared, code installed before keeps
+    // calling any function it replaces
+    VMFunction &define(PrototypeAST const& P,
+                       std::unique_ptr<BytecodeFunction> Code, bool Memoize,
+                       PrototypeMap const& Protos);
+
+    // addHost - the C function at Address, false if the vm can not call it
+    bool addHost(PrototypeAST const& P, void *Address);
+
+    // call - runs F on the registers of its arguments. Result takes as many
+    // registers as F returns. false with an error message if the run failed.
+    // the vm is not reentrant, a C function it calls must not call it
+    bool call(VMFunction &F, Register const* Args, Register *Result);
+
+    // evaluate - runs the code of a top-level expression
+    bool evaluate(PrototypeAST const& P, std::unique_ptr<BytecodeFunction> Code,
+                  PrototypeMap const& Protos, double &Result);
+};
+
+inline void VirtualMachine::resolveCallees(VMFunction &F,
+                                           PrototypeMap const& Protos) {
+    F.Callees.clear();
+    for (SymbolId Name : F.Code->Callees) {
+        VMFunction *Callee = Functions.lookup(Name);
+        auto &P = Protos.lookup(Name);
+        if (!Callee or !isSameType(Callee->Proto, *P))
+            Callee = addRecord(*P);
+        F.Callees.push_back(Callee);
+    }
+}
+
+inline VMFunction &VirtualMachine::define(PrototypeAST const& P,
+                                          std::unique_ptr<BytecodeFunction> Code,
+                                          bool Memoize,
+                                          PrototypeMap const& Protos) {
+    VMFunction *F = Functions.lookup(P.getName());
+    if (!F or F->isDefined() or !isSameType(F->Proto, P))
+        F = addRecord(P);
+    F->Proto = P;
+    F->Code = std::move(Code);
+    F->Memoize = Memoize;
+    resolveCallees(*F, Protos);
+    return *F;
+}
+
+inline bool VirtualMachine::addHost(PrototypeAST const& P, void *Address) {
+    unsigned NumArgs = P.getArgs().size();
+    if (NumArgs > MaxHostArgs)
+        return false;
+    unsigned IntMask = 0;
+    for (unsigned i = 0; i != NumArgs; ++i) {
+        if (isVectorType(P.getArgType(i)))
+            return false;
+        if (P.getArgType(i) != ValueType::Double)
+            IntMask |= 1u << i;
+    }
+
+    HostThunk Thunk;
+    switch (P.getReturnType()) {
+    case ValueType::Double:
+        Thunk = getHostThunk<double>(NumArgs, IntMask);
+        break;
+    case ValueType::Int:
+        Thunk = getHostThunk<int64_t>(NumArgs, IntMask);
+        break;
+    case ValueType::Bool:
+        Thunk = getHostThunk<bool>(NumArgs, IntMask);
+        break;
+    default:
+        return false;
+    }
+
+    VMFunction *F = addRecord(P);
+    F->Host = Address;
+    F->Thunk = Thunk;
+    return true;
+}
+
+// lookupMemo - looks the arguments of a call of the memoized F up. on a
+// miss their bits are kept until the call returns, the result goes to Slot
+inline bool VirtualMachine::lookupMemo(VMFunction &F, Register const* Args,
+                                       Register &Result, uint64_t &Slot) {
+    unsigned NumArgs = F.Proto.getArgs().size();
+    if (!F.Memo)
+        F.Memo = std::make_unique<MemoTable>(NumArgs);
+    if (F.Memo->lookup(Args, Result, Slot)) {
+        ++F.Hits;
+        return true;
+    }
+    ++F.Misses;
+    for (unsigned i = 0; i != NumArgs; ++i)
+        MemoKeys.push_back(uint64_t(Args[i].I));
+    return false;
+}
+
+inline bool VirtualMachine::call(VMFunction &F, Register const* Args,
+                                 Register *Result) {
+    if (!F.Code) {
+        if (!F.Thunk)
+            return LogError("unknown function referenced"), false;
+        F.Thunk(F.Host, Args, *Result);
+        return true;
+    }
+
+    uint64_t Slot = NoSlot;
+    if (F.Memoize and lookupMemo(F, Args, *Result, Slot))
+        return true;
+    if (!reserve(F.Code->NumRegisters))
+        return LogError("stack overflow"), false;
+    std::copy(Args, Args + F.Code->NumArgRegisters, Stack.begin());
+    Frames.push_back({nullptr, nullptr, 0, 0, Slot});
+    return run(&F, Result);
+}
+
+inline bool VirtualMachine::evaluate(PrototypeAST const& P,
+                                     std::unique_ptr<BytecodeFunction> Code,
+                                     PrototypeMap const& Protos,
+                                     double &Result) {
+    VMFunction F(P);
+    F.Code = std::move(Code);
+    resolveCallees(F, Protos);
+    Register R;
+    if (!call(F, &R, &R))
+        return false;
+    Result = R.D;
+    return true;
+}
+
+//
+// the dispatch loop. with GCC and clang an instruction jumps straight to
+// the code of the next one through a table of label addresses, elsewhere
+// it is a switch in a loop
+//
+#ifdef __GNUC__
+#define VM_DISPATCH() goto *Labels[*PC]
+#define VM_LOOP() VM_DISPATCH();
+#define VM_OP(Name) Op_##Name:
+#else
+#define VM_DISPATCH() continue
+#define VM_LOOP() for (;;) switch (Opcode(*PC))
+#define VM_OP(Name) case Opcode::Name:
+#endif
+#define VM_NEXT(Name)                                                         \
+    PC += 1 + getNumOperands(Opcode::Name);                                   \
+    VM_DISPATCH()
+
+// run - runs F, whose frame was pushed with its arguments at the top of the
+// stack, until it returns
+inline bool VirtualMachine::run(VMFunction *F, Register *Result) {
+#ifdef __GNUC__
+    static void *const Labels[] = {
+#define KS_OPCODE_LABEL(Name, NumOperands) &&Op_##Name,
+        KS_OPCODES(KS_OPCODE_LABEL)
+#undef KS_OPCODE_LABEL
+    };
+#endif
+    char const* Error = nullptr;
+    size_t Base = Frames.back().CallerBase;
+    uint32_t const* Start;
+    uint32_t const* PC;
+    Register *R;
+    VMFunction *Callee;
+    size_t CalleeBase;
+    uint32_t Dest;
+
+    // the frame of F is at Base, its arguments are in place
+Enter:
+    if (!reserve(Base + F->Code->NumRegisters)) {
+        Error = "stack overflow";
+        goto Fail;
+    }
+    R = Stack.data() + Base;
+    std::copy(F->Code->Constants.begin(), F->Code->Constants.end(),
+              R + F->Code->NumArgRegisters);
+    Start = PC = F->Code->Code.data();
+
+    VM_LOOP() {
+    VM_OP(Move)
+        R[PC[1]] = R[PC[2]];
+        VM_NEXT(Move);
+    VM_OP(Zero)
+        R[PC[1]].I = 0;
+        VM_NEXT(Zero);
+    VM_OP(IntToDouble)
+        R[PC[1]].D = double(R[PC[2]].I);
+        VM_NEXT(IntToDouble);
+
+    VM_OP(AddD)
+        R[PC[1]].D = R[PC[2]].D + R[PC[3]].D;
+        VM_NEXT(AddD);
+    VM_OP(SubD)
+        R[PC[1]].D = R[PC[2]].D - R[PC[3]].D;
+        VM_NEXT(SubD);
+    VM_OP(MulD)
+        R[PC[1]].D = R[PC[2]].D * R[PC[3]].D;
+        VM_NEXT(MulD);
+    VM_OP(LessD)
+        R[PC[1]].I = !(R[PC[2]].D >= R[PC[3]].D);
+        VM_NEXT(LessD);
+
+    // ints wrap around, like the IR's add, sub and mul
+    VM_OP(AddI)
+        R[PC[1]].I = int64_t(uint64_t(R[PC[2]].I) + uint64_t(R[PC[3]].I));
+        VM_NEXT(AddI);
+    VM_OP(SubI)
+        R[PC[1]].I = int64_t(uint64_t(R[PC[2]].I) - uint64_t(R[PC[3]].I));
+        VM_NEXT(SubI);
+    VM_OP(MulI)
+        R[PC[1]].I = int64_t(uint64_t(R[PC[2]].I) * uint64_t(R[PC[3]].I));
+        VM_NEXT(MulI);
+    VM_OP(LessI)
+        R[PC[1]].I = R[PC[2]].I < R[PC[3]].I;
+        VM_NEXT(LessI);
+    VM_OP(LessLane)
+        R[PC[1]].D = !(R[PC[2]].D >= R[PC[3]].D) ? 1.0 : 0.0;
+        VM_NEXT(LessLane);
+    VM_OP(IncD)
+        R[PC[1]].D += 1.0;
+        VM_NEXT(IncD);
+    VM_OP(IncI)
+        R[PC[1]].I = int64_t(uint64_t(R[PC[1]].I) + 1);
+        VM_NEXT(IncI);
+
+    VM_OP(Sqrt)
+        R[PC[1]].D = std::sqrt(R[PC[2]].D);
+        VM_NEXT(Sqrt);
+    VM_OP(Fabs)
+        R[PC[1]].D = std::fabs(R[PC[2]].D);
+        VM_NEXT(Fabs);
+    VM_OP(Sin)
+        R[PC[1]].D = std::sin(R[PC[2]].D);
+        VM_NEXT(Sin);
+    VM_OP(Cos)
+        R[PC[1]].D = std::cos(R[PC[2]].D);
+        VM_NEXT(Cos);
+    VM_OP(Exp)
+        R[PC[1]].D = std::exp(R[PC[2]].D);
+        VM_NEXT(Exp);
+    VM_OP(Log)
+        R[PC[1]].D = std::log(R[PC[2]].D);
+        VM_NEXT(Log);
+    VM_OP(Floor)
+        R[PC[1]].D = std::floor(R[PC[2]].D);
+        VM_NEXT(Floor);
+    VM_OP(Pow)
+        R[PC[1]].D = std::pow(R[PC[2]].D, R[PC[3]].D);
+        VM_NEXT(Pow);
+    VM_OP(Min)
+        R[PC[1]].D = std::fmin(R[PC[2]].D, R[PC[3]].D);
+        VM_NEXT(Min);
+    VM_OP(Max)
+        R[PC[1]].D = std::fmax(R[PC[2]].D, R[PC[3]].D);
+        VM_NEXT(Max);
+    VM_OP(Fma)
+        R[PC[1]].D = std::fma(R[PC[2]].D, R[PC[3]].D, R[PC[4]].D);
+        VM_NEXT(Fma);
+    VM_OP(SelectLess)
+        R[PC[1]] = R[PC[2]].D < R[PC[3]].D ? R[PC[2]] : R[PC[3]];
+        VM_NEXT(SelectLess);
+    VM_OP(SelectGreater)
+        R[PC[1]] = R[PC[2]].D > R[PC[3]].D ? R[PC[2]] : R[PC[3]];
+        VM_NEXT(SelectGreater);
+
+    VM_OP(Jump)
+        PC = Start + PC[1];
+        VM_DISPATCH();
+    VM_OP(JumpIfFalseD)
+        if (!isTrue(R[PC[1]].D)) {
+            PC = Start + PC[2];
+            VM_DISPATCH();
+        }
+        VM_NEXT(JumpIfFalseD);
+    VM_OP(JumpIfFalseI)
+        if (!R[PC[1]].I) {
+            PC = Start + PC[2];
+            VM_DISPATCH();
+        }
+        VM_NEXT(JumpIfFalseI);
+    VM_OP(JumpIfTrueD)
+        if (isTrue(R[PC[1]].D)) {
+            PC = Start + PC[2];
+            VM_DISPATCH();
+        }
+        VM_NEXT(JumpIfTrueD);
+    VM_OP(JumpIfTrueI)
+        if (R[PC[1]].I) {
+            PC = Start + PC[2];
+            VM_DISPATCH();
+        }
+        VM_NEXT(JumpIfTrueI);
+    VM_OP(JumpIfNotLessD)
+        if (R[PC[1]].D >= R[PC[2]].D) {
+            PC = Start + PC[3];
+            VM_DISPATCH();
+        }
+        VM_NEXT(JumpIfNotLessD);
+    VM_OP(JumpIfNotLessI)
+        if (R[PC[1]].I >= R[PC[2]].I) {
+            PC = Start + PC[3];
+            VM_DISPATCH();
+        }
+        VM_NEXT(JumpIfNotLessI);
+
+    VM_OP(Load)
+        std::memcpy(&R[PC[1]], static_cast<Register*>(R[PC[2]].P) + R[PC[3]].I,
+                    sizeof(Register));
+        VM_NEXT(Load);
+    VM_OP(Store)
+        std::memcpy(static_cast<Register*>(R[PC[2]].P) + R[PC[3]].I, &R[PC[1]],
+                    sizeof(Register));
+        VM_NEXT(Store);
+    VM_OP(LoadLane)
+        R[PC[1]] = R[PC[2] + (uint64_t(R[PC[3]].I) & (PC[4] - 1))];
+        VM_NEXT(LoadLane);
+    VM_OP(StoreLane)
+        R[PC[2] + (uint64_t(R[PC[3]].I) & (PC[4] - 1))] = R[PC[1]];
+        VM_NEXT(StoreLane);
+    VM_OP(Check)
+        if (uint64_t(R[PC[1]].I) >= uint64_t(R[PC[2]].I)) {
+            Error = "index out of bounds";
+            goto Fail;
+        }
+        VM_NEXT(Check);
+    VM_OP(CheckLane)
+        if (uint64_t(R[PC[1]].I) >= PC[2]) {
+            Error = "index out of bounds";
+            goto Fail;
+        }
+        VM_NEXT(CheckLane);
+
+    // a call of a C function is done right here. a tail call reuses the
+    // frame, the arguments move down to its base. the TailCall of a C
+    // function or a memo hit goes on to the Return after it
+    VM_OP(Call)
+    VM_OP(TailCall) {
+        Callee = F->Callees[PC[2]];
+        CalleeBase = Base + PC[3];
+        Dest = PC[1];
+        bool IsTailCall = Opcode(*PC) == Opcode::TailCall;
+        PC += 4;
+        if (!Callee->Code) {
+            if (!Callee->Thunk) {
+                Error = "unknown function referenced";
+                goto Fail;
+            }
+            Callee->Thunk(Callee->Host, Stack.data() + CalleeBase, R[Dest]);
+            VM_DISPATCH();
+        }
+
+        uint64_t Slot = NoSlot;
+        if (Callee->Memoize and
+            lookupMemo(*Callee, Stack.data() + CalleeBase, R[Dest], Slot))
+            VM_DISPATCH();
+
+        if (IsTailCall) {
+            std::memmove(Stack.data() + Base, Stack.data() + CalleeBase,
+                         Callee->Code->NumArgRegisters * sizeof(Register));
+            Frames.back().MemoSlot = Slot;
+        } else {
+            if (Frames.size() == MaxFrames) {
+                Error = "stack overflow";
+                goto Fail;
+            }
+            Frames.push_back({F, PC, Base, Dest, Slot});
+            Base = CalleeBase;
+        }
+        F = Callee;
+        goto Enter;
+    }
+
+    VM_OP(Return) {
+        Frame Done = Frames.back();
+        Frames.pop_back();
+        Register *Value = R + PC[1];
+        if (Done.MemoSlot != NoSlot) {
+            size_t NumKeys = F->Proto.getArgs().size();
+            F->Memo->fill(Done.MemoSlot, MemoKeys.data() + MemoKeys.size() -
+                                             NumKeys,
+                          *Value);
+            MemoKeys.resize(MemoKeys.size() - NumKeys);
+        }
+
+        uint32_t Width = F->Code->ReturnWidth;
+        if (!Done.Caller) {
+            std::copy(Value, Value + Width, Result);
+            return true;
+        }
+        F = Done.Caller;
+        Base = Done.CallerBase;
+        R = Stack.data() + Base;
+        std::memmove(R + Done.Dest, Value, Width * sizeof(Register));
+        Start = F->Code->Code.data();
+        PC = Done.ReturnPC;
+        VM_DISPATCH();
+    }
+    }
+
+Fail:
+    Frames.clear();
+    MemoKeys.clear();
+    LogError(Error);
+    return false;
+}
+
+#undef VM_DISPATCH
+#undef VM_LOOP
+#undef VM_OP
+#undef VM_NEXT
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and vm driver
+//===----------------------------------------------------------------------===//
+
+static VirtualMachine TheVM;
+
+// compileFunction - the bytecode of a checked definition, null with an
+// error message if the vm can not run it
+static std::unique_ptr<BytecodeFunction> compileFunction(FunctionAST const& F) {
+    return BytecodeCompiler(F.getPool(), FunctionProtos, TheSymbols,
+                            TheOptions.BoundsCheck)
+        .compile(F.getProto(), F.getBody(), F.isMemoized());
+}
+
+static void HandleDefinition(Parser &P) {
+    if (auto FnAST = P.ParseDefinition()) {
+        // if this is an operator, install it before codegen so that a later
+        // use of it parses with the right precedence
+        auto &Proto = FnAST->getProto();
+        if (Proto.isBinaryOp())
+            P.setBinopPrecedence(Proto.getOperatorName(),
+                                 Proto.getBinaryPrecedence());
+
+        if (!FnAST->check())
+            return;
+        TheEvaluator.addFunction(Proto, FnAST->getPool(), FnAST->getBody());
+        if (auto Code = compileFunction(*FnAST)) {
+            auto Name = TheSymbols.getName(Proto.getName());
+            fprintf(stderr, "Read function definition: %.*s\n",
+                    int(Name.size()), Name.data());
+            printBytecode(*Code, TheSymbols, stderr);
+            fprintf(stderr, "\n");
+            TheVM.define(Proto, std::move(Code), FnAST->isMemoized(),
+                         FunctionProtos);
+        }
+    } else {
+        // skip token for error recovery
+        P.getNextToken();
+    }
+}
+
+static void HandleExtern(Parser &P) {
+    if (auto ProtoAST = P.ParseExtern()) {
+        // the process has every C function an extern can name, anything
+        // else is a kaleidoscope function, defined before or after
+        std::string Name(TheSymbols.getName(ProtoAST->getName()));
+        void *Address = dlsym(RTLD_DEFAULT, Name.c_str());
+        if (!Address) {
+            ProtoAST->clearFlag(PF_Extern);
+        } else if (!TheVM.addHost(*ProtoAST, Address)) {
+            LogError("the vm only calls C functions of up to six scalars "
+                     "or arrays");
+            return;
+        }
+
+        fprintf(stderr, "read extern: %s\n", Name.c_str());
+        FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    } else {
+        // skip token for error recovery
+        P.getNextToken();
+    }
+}
+
+static void HandleTopLevelExpression(Parser &P) {
+    if (auto FnAST = P.ParseTopLevelExpr()) {
+        if (!FnAST->check())
+            return;
+        if (auto Code = compileFunction(*FnAST)) {
+            fprintf(stderr, "read top-level expresssion:\n");
+            printBytecode(*Code, TheSymbols, stderr);
+            fprintf(stderr, "\n");
+
+            double Result;
+            if (TheVM.evaluate(FnAST->getProto(), std::move(Code),
+                               FunctionProtos, Result))
+                fprintf(stderr, "evaluated to %f\n", Result);
+        }
+    } else {
+        // skip token for error recovery
+        P.getNextToken();
+    }
+}
+
+// printMemoStats - the hit and miss counts of the memoized functions
+static void printMemoStats() {
+    for (SymbolId Name : MemoFunctions) {
+        VMFunction *F = TheVM.getFunction(Name);
+        if (!F or !F->Memoize)
+            continue;
+        auto Base = TheSymbols.getName(Name);
+        fprintf(stderr, "memo %.*s: %lld hits, %lld misses\n",
+                int(Base.size()), Base.data(), (long long)F->Hits,
+                (long long)F->Misses);
+    }
+}
+
+// top ::= definition | external | expression | ';'
+static void MainLoop(Parser &P) {
+    while (1) {
+        fprintf(stderr, "ready> ");
+        switch (P.getCurTok()) {
+        case tok_eof:
+            printMemoStats();
+            return;
+        case ';':
+            P.getNextToken();
+            break;
+        case tok_def:
+            HandleDefinition(P);
+            break;
+        case tok_extern:
+            HandleExtern(P);
+            break;
+        default:
+            HandleTopLevelExpression(P);
+            break;
+        }
+    }
+}
+
+#endif // vm_h